@@ -0,0 +1,280 @@
+/*
+ * APDU benchmark.
+ *
+ * A soft CAC card answers a fixed mix of APDUs (applet selection, properties
+ * and buffer reads) in a loop, the way an application walks the card after
+ * it is inserted. Reported are the latency of each kind of APDU and of the
+ * whole mix, the APDU throughput and, where the allocator can be counted,
+ * the allocations made per APDU. The initialization of the emulator (NSS
+ * database, modules) is not part of any of the numbers.
+ *
+ * This code is licensed under the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+#include <libcacard.h>
+
+#define SOFT_READER "soft=(,BenchApdu,CAC,,cert1,cert2,cert3) "
+
+#define RESPONSE_LEN (255 + 2)
+
+typedef struct {
+    const char *name;
+    unsigned char apdu[16];
+    int apdu_len;
+    GArray *latencies;      /* gint64 nanoseconds */
+    guint64 allocs;
+} BenchApdu;
+
+static BenchApdu apdus[] = {
+    /* SELECT the first PKI applet */
+    { "select", { 0x00, 0xa4, 0x04, 0x00, 0x07,
+                  0xa0, 0x00, 0x00, 0x00, 0x79, 0x01, 0x00 }, 12, NULL, 0 },
+    /* GET PROPERTIES of the applet, answered with the Le to use */
+    { "properties", { 0x80, 0x56, 0x01, 0x00, 0x00 }, 5, NULL, 0 },
+    /* READ BUFFER, length of the tag buffer */
+    { "read_length", { 0x80, 0x52, 0x00, 0x00, 0x02,
+                       CAC_FILE_TAG, 0x02, 0x02 }, 8, NULL, 0 },
+    /* READ BUFFER, start of the value buffer (the certificate) */
+    { "read_value", { 0x80, 0x52, 0x00, 0x02, 0x02,
+                      CAC_FILE_VALUE, 0x80, 0x80 }, 8, NULL, 0 },
+};
+
+static int niterations = 10000;
+static char *dbdir;
+
+static GOptionEntry entries[] = {
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &niterations,
+      "Iterations of the APDU mix (10000)", "N" },
+    { "db", 'd', 0, G_OPTION_ARG_FILENAME, &dbdir,
+      "NSS database with the cert1-3 certificates", "DIR" },
+    { NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+/*
+ * The allocations are counted by wrapping the allocator of the C library,
+ * which g_malloc() and the NSS allocators end up in. This only works with
+ * glibc, and not under AddressSanitizer, which replaces the allocator itself.
+ */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static gint alloc_count;
+
+void *
+malloc(size_t size)
+{
+    g_atomic_int_inc(&alloc_count);
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    g_atomic_int_inc(&alloc_count);
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    g_atomic_int_inc(&alloc_count);
+    return __libc_realloc(ptr, size);
+}
+
+static guint
+allocs(void)
+{
+    return (guint)g_atomic_int_get(&alloc_count);
+}
+#else
+#define COUNT_ALLOCS 0
+
+static guint
+allocs(void)
+{
+    return 0;
+}
+#endif
+
+/* an emulated APDU takes a few microseconds, g_get_monotonic_time() is too
+ * coarse for it */
+static gint64
+now_ns(void)
+{
+#ifndef _WIN32
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+#else
+    return g_get_monotonic_time() * 1000;
+#endif
+}
+
+static int
+compare_gint64(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+percentile_us(GArray *values, int p)
+{
+    if (values->len == 0) {
+        return 0;
+    }
+    return g_array_index(values, gint64, (values->len - 1) * p / 100) / 1e3;
+}
+
+static VReader *
+first_reader(void)
+{
+    VReaderList *list = vreader_get_reader_list();
+    VReaderListEntry *entry = vreader_list_get_first(list);
+    VReader *reader = NULL;
+
+    if (entry) {
+        reader = vreader_reference(vreader_list_get_reader(entry));
+    }
+    vreader_list_delete(list);
+    return reader;
+}
+
+/* one APDU, its latency and allocations are recorded if record is set */
+static void
+transmit(VReader *reader, BenchApdu *a, gboolean record)
+{
+    unsigned char response[RESPONSE_LEN];
+    int response_len = sizeof(response);
+    VReaderStatus status;
+    guint allocs_before;
+    gint64 start, elapsed;
+
+    allocs_before = allocs();
+    start = now_ns();
+    status = vreader_xfr_bytes(reader, a->apdu, a->apdu_len,
+                               response, &response_len);
+    elapsed = now_ns() - start;
+    if (status != VREADER_OK) {
+        fprintf(stderr, "%s failed: %d\n", a->name, status);
+        exit(1);
+    }
+    if (record) {
+        a->allocs += allocs() - allocs_before;
+        g_array_append_val(a->latencies, elapsed);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    VCardEmulOptions *options;
+    VReader *reader;
+    GArray *mix;            /* gint64 nanoseconds */
+    gint64 start, total_time;
+    guint64 total_allocs = 0;
+    char *args;
+    int i, j;
+
+    context = g_option_context_new("- APDU benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (niterations < 1) {
+        fprintf(stderr, "invalid parameters\n");
+        return 1;
+    }
+    if (dbdir == NULL) {
+        const char *srcdir = g_getenv("G_TEST_SRCDIR");
+
+        dbdir = g_build_filename(srcdir ? srcdir : ".", "db", NULL);
+    }
+
+    args = g_strdup_printf("db=\"sql:%s\" use_hw=no " SOFT_READER, dbdir);
+    options = vcard_emul_options(args);
+    if (options == NULL || vcard_emul_init(options) != VCARD_EMUL_OK) {
+        fprintf(stderr, "initialization failed\n");
+        return 1;
+    }
+    g_free(args);
+    reader = first_reader();
+    if (reader == NULL || vreader_card_is_present(reader) != VREADER_OK) {
+        fprintf(stderr, "no card\n");
+        return 1;
+    }
+
+    for (i = 0; i < (int)G_N_ELEMENTS(apdus); i++) {
+        apdus[i].latencies = g_array_sized_new(FALSE, FALSE, sizeof(gint64),
+                                               niterations);
+    }
+    mix = g_array_sized_new(FALSE, FALSE, sizeof(gint64), niterations);
+
+    /* warm up: the lazily built responses and the caches are filled */
+    for (i = 0; i < (int)G_N_ELEMENTS(apdus); i++) {
+        transmit(reader, &apdus[i], FALSE);
+    }
+
+    start = now_ns();
+    for (j = 0; j < niterations; j++) {
+        gint64 mix_start = now_ns(), elapsed;
+
+        for (i = 0; i < (int)G_N_ELEMENTS(apdus); i++) {
+            transmit(reader, &apdus[i], TRUE);
+        }
+        elapsed = now_ns() - mix_start;
+        g_array_append_val(mix, elapsed);
+    }
+    total_time = now_ns() - start;
+
+    printf("iterations: %d\n", niterations);
+    for (i = 0; i < (int)G_N_ELEMENTS(apdus); i++) {
+        BenchApdu *a = &apdus[i];
+
+        g_array_sort(a->latencies, compare_gint64);
+        printf("%s_p50_us: %.2f\n", a->name, percentile_us(a->latencies, 50));
+        printf("%s_p99_us: %.2f\n", a->name, percentile_us(a->latencies, 99));
+        if (COUNT_ALLOCS) {
+            printf("%s_allocs_per_apdu: %.2f\n", a->name,
+                   (double)a->allocs / niterations);
+        }
+        total_allocs += a->allocs;
+        g_array_free(a->latencies, TRUE);
+    }
+    g_array_sort(mix, compare_gint64);
+    printf("mix_p50_us: %.2f\n", percentile_us(mix, 50));
+    printf("mix_p99_us: %.2f\n", percentile_us(mix, 99));
+    printf("apdus_per_sec: %.1f\n", total_time ?
+           niterations * G_N_ELEMENTS(apdus) * 1e9 / total_time : 0.0);
+    if (COUNT_ALLOCS) {
+        printf("apdu_allocs_per_apdu: %.2f\n",
+               (double)total_allocs / (niterations * G_N_ELEMENTS(apdus)));
+    }
+
+    g_array_free(mix, TRUE);
+    vreader_free(reader);
+    g_free(dbdir);
+    vcard_emul_finalize();
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */
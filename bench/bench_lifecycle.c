@@ -0,0 +1,395 @@
+/*
+ * Card lifecycle and event storm benchmark.
+ *
+ * Many soft readers are created, then producer threads remove and insert
+ * their cards in rounds while one consumer drains the events, the way an
+ * application does after a network blip reconnects a whole fleet. Reported
+ * are the time to add a reader, to construct a card and to insert it, the
+ * end-to-end event latency (from the removal/insertion call to
+ * vevent_wait_next_vevent() returning the event), the event throughput and
+ * the memory released by the card removal. The initialization of the
+ * emulator (NSS database, modules) is not part of any of the timings.
+ *
+ * This code is licensed under the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+#include <libcacard.h>
+
+#define SOFT_READER "soft=(,Bench%d,CAC,,cert1,cert2,cert3) "
+
+/* the cards constructed directly get three certificates of this size, their
+ * content does not matter to the construction */
+#define SETUP_CERTS 3
+#define SETUP_CERT_LEN 1024
+
+typedef struct {
+    VReader *reader;
+    gint64 issued;  /* when the last operation started, 0 once it is seen */
+} BenchReader;
+
+static BenchReader *readers;
+static int nreaders = 32;
+static int nthreads = 4;
+static int nrounds = 100;
+static char *dbdir;
+
+static GHashTable *reader_index; /* VReader -> index + 1 */
+static GMutex lock;
+static GCond cond;
+static GArray *latencies;        /* gint64 microseconds */
+static gint64 insert_time;       /* total time spent in the insertions */
+static guint64 inserts;
+
+static GOptionEntry entries[] = {
+    { "readers", 'r', 0, G_OPTION_ARG_INT, &nreaders,
+      "Number of soft readers (32)", "N" },
+    { "threads", 't', 0, G_OPTION_ARG_INT, &nthreads,
+      "Number of producer threads (4)", "N" },
+    { "rounds", 'n', 0, G_OPTION_ARG_INT, &nrounds,
+      "Removal and insertion rounds (100)", "N" },
+    { "db", 'd', 0, G_OPTION_ARG_FILENAME, &dbdir,
+      "NSS database with the cert1-3 certificates", "DIR" },
+    { NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+static gpointer
+consumer_thread(G_GNUC_UNUSED gpointer arg)
+{
+    VEvent *event;
+
+    while ((event = vevent_wait_next_vevent()) != NULL) {
+        BenchReader *br;
+        gint64 now = g_get_monotonic_time();
+        guint index;
+
+        if (event->type == VEVENT_LAST) {
+            vevent_delete(event);
+            break;
+        }
+        index = GPOINTER_TO_UINT(g_hash_table_lookup(reader_index,
+                                                     event->reader));
+        g_mutex_lock(&lock);
+        br = index ? &readers[index - 1] : NULL;
+        if (br && br->issued) {
+            gint64 latency = now - br->issued;
+
+            g_array_append_val(latencies, latency);
+            br->issued = 0;
+            g_cond_broadcast(&cond);
+        }
+        g_mutex_unlock(&lock);
+        vevent_delete(event);
+    }
+    return NULL;
+}
+
+static gpointer
+producer_thread(gpointer arg)
+{
+    int thread = GPOINTER_TO_INT(arg);
+    int round, i;
+
+    for (round = 0; round < nrounds; round++) {
+        gboolean remove = round % 2 == 0;
+
+        for (i = thread; i < nreaders; i += nthreads) {
+            gint64 start;
+
+            g_mutex_lock(&lock);
+            readers[i].issued = g_get_monotonic_time();
+            g_mutex_unlock(&lock);
+
+            start = g_get_monotonic_time();
+            if (remove) {
+                vcard_emul_force_card_remove(readers[i].reader);
+            } else {
+                vcard_emul_force_card_insert(readers[i].reader);
+                g_mutex_lock(&lock);
+                insert_time += g_get_monotonic_time() - start;
+                inserts++;
+                g_mutex_unlock(&lock);
+            }
+        }
+
+        /* wait until the consumer has seen the events of our readers */
+        g_mutex_lock(&lock);
+        for (i = thread; i < nreaders; i += nthreads) {
+            while (readers[i].issued != 0) {
+                g_cond_wait(&cond, &lock);
+            }
+        }
+        g_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static void
+drain_events(void)
+{
+    VEvent *event;
+
+    while ((event = vevent_get_next_vevent()) != NULL) {
+        vevent_delete(event);
+    }
+}
+
+/* memory held by the readers, their cards and the queued events */
+static size_t
+readers_mem_bytes(void)
+{
+    size_t total = 0;
+    int i, j;
+
+    for (i = 0; i < nreaders; i++) {
+        VCardMemStats stats;
+
+        vreader_get_mem_stats(readers[i].reader, &stats);
+        for (j = 0; j < VCARD_MEM_LAST; j++) {
+            total += stats.subsystem[j].bytes;
+        }
+    }
+    return total;
+}
+
+/* resident set size in kB, 0 if unknown */
+static long
+rss_kb(void)
+{
+#ifdef __linux__
+    char *statm = NULL;
+    long pages = 0, rss = 0;
+
+    if (!g_file_get_contents("/proc/self/statm", &statm, NULL, NULL)) {
+        return 0;
+    }
+    if (sscanf(statm, "%ld %ld", &pages, &rss) != 2) {
+        rss = 0;
+    }
+    g_free(statm);
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Time the reader and card setup alone: vreader_add_reader(), the
+ * construction of a CAC card and vreader_insert_card(), on readers which
+ * are removed again afterwards
+ */
+static void
+setup_readers(gint64 *add_time, gint64 *construct_time, gint64 *insert_time)
+{
+    unsigned char *cert[SETUP_CERTS];
+    int cert_len[SETUP_CERTS];
+    VCardKey *key[SETUP_CERTS] = { NULL };
+    VReader **setup;
+    gint64 start;
+    int i;
+
+    for (i = 0; i < SETUP_CERTS; i++) {
+        cert[i] = g_malloc(SETUP_CERT_LEN);
+        memset(cert[i], 0x30 + i, SETUP_CERT_LEN);
+        cert_len[i] = SETUP_CERT_LEN;
+    }
+    setup = g_new(VReader *, nreaders);
+    *add_time = *construct_time = *insert_time = 0;
+    for (i = 0; i < nreaders; i++) {
+        char *name = g_strdup_printf("Setup%d", i);
+        VCard *card;
+
+        setup[i] = vreader_new(name, NULL, NULL);
+        g_free(name);
+        start = g_get_monotonic_time();
+        vreader_add_reader(setup[i]);
+        *add_time += g_get_monotonic_time() - start;
+
+        start = g_get_monotonic_time();
+        card = vcard_new(NULL, NULL);
+        if (vcard_init(setup[i], card, VCARD_EMUL_CAC, NULL, cert, cert_len,
+                       key, SETUP_CERTS) != VCARD_DONE) {
+            fprintf(stderr, "card construction failed\n");
+            exit(1);
+        }
+        *construct_time += g_get_monotonic_time() - start;
+
+        start = g_get_monotonic_time();
+        vreader_insert_card(setup[i], card);
+        *insert_time += g_get_monotonic_time() - start;
+        vcard_free(card);
+    }
+    for (i = 0; i < nreaders; i++) {
+        vreader_remove_reader(setup[i]);
+        vreader_free(setup[i]);
+    }
+    drain_events();
+    g_free(setup);
+    for (i = 0; i < SETUP_CERTS; i++) {
+        g_free(cert[i]);
+    }
+}
+
+static int
+compare_gint64(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+static gint64
+percentile(GArray *values, int p)
+{
+    if (values->len == 0) {
+        return 0;
+    }
+    return g_array_index(values, gint64, (values->len - 1) * p / 100);
+}
+
+int
+main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    GString *args;
+    VCardEmulOptions *options;
+    VReaderList *list;
+    VReaderListEntry *entry;
+    GThread *consumer, **producers;
+    gint64 start, storm_time;
+    gint64 add_time, construct_time, card_insert_time;
+    size_t mem_inserted, mem_removed;
+    long rss_inserted, rss_removed;
+    int i;
+
+    context = g_option_context_new("- card lifecycle benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (nreaders < 1 || nthreads < 1 || nrounds < 0) {
+        fprintf(stderr, "invalid parameters\n");
+        return 1;
+    }
+    /* finish with the cards inserted */
+    nrounds += nrounds % 2;
+    if (dbdir == NULL) {
+        const char *srcdir = g_getenv("G_TEST_SRCDIR");
+
+        dbdir = g_build_filename(srcdir ? srcdir : ".", "db", NULL);
+    }
+
+    args = g_string_new(NULL);
+    g_string_printf(args, "db=\"sql:%s\" use_hw=no ", dbdir);
+    for (i = 0; i < nreaders; i++) {
+        g_string_append_printf(args, SOFT_READER, i);
+    }
+
+    /* the soft readers of the storm, built with the NSS initialization */
+    options = vcard_emul_options(args->str);
+    if (options == NULL || vcard_emul_init(options) != VCARD_EMUL_OK) {
+        fprintf(stderr, "initialization failed\n");
+        return 1;
+    }
+    g_string_free(args, TRUE);
+    drain_events();
+
+    setup_readers(&add_time, &construct_time, &card_insert_time);
+
+    readers = g_new0(BenchReader, nreaders);
+    reader_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    list = vreader_get_reader_list();
+    i = 0;
+    for (entry = vreader_list_get_first(list); entry && i < nreaders;
+         entry = vreader_list_get_next(entry)) {
+        readers[i].reader = vreader_list_get_reader(entry);
+        g_hash_table_insert(reader_index, readers[i].reader,
+                            GUINT_TO_POINTER(i + 1));
+        i++;
+    }
+    vreader_list_delete(list);
+    if (i != nreaders) {
+        fprintf(stderr, "expected %d readers, got %d\n", nreaders, i);
+        return 1;
+    }
+
+    /* memory released by the removal of all the cards */
+    mem_inserted = readers_mem_bytes();
+    rss_inserted = rss_kb();
+    for (i = 0; i < nreaders; i++) {
+        vcard_emul_force_card_remove(readers[i].reader);
+    }
+    drain_events();
+    mem_removed = readers_mem_bytes();
+    rss_removed = rss_kb();
+    for (i = 0; i < nreaders; i++) {
+        vcard_emul_force_card_insert(readers[i].reader);
+    }
+    drain_events();
+
+    /* the storm */
+    latencies = g_array_sized_new(FALSE, FALSE, sizeof(gint64),
+                                  nreaders * nrounds);
+    consumer = g_thread_new("consumer", consumer_thread, NULL);
+    producers = g_new(GThread *, nthreads);
+    start = g_get_monotonic_time();
+    for (i = 0; i < nthreads; i++) {
+        producers[i] = g_thread_new("producer", producer_thread,
+                                    GINT_TO_POINTER(i));
+    }
+    for (i = 0; i < nthreads; i++) {
+        g_thread_join(producers[i]);
+    }
+    storm_time = g_get_monotonic_time() - start;
+    vevent_queue_vevent(vevent_new(VEVENT_LAST, NULL, NULL));
+    g_thread_join(consumer);
+
+    g_array_sort(latencies, compare_gint64);
+
+    printf("readers: %d\n", nreaders);
+    printf("threads: %d\n", nthreads);
+    printf("rounds: %d\n", nrounds);
+    printf("reader_add_us: %.1f\n", (double)add_time / nreaders);
+    printf("card_construction_us: %.1f\n", (double)construct_time / nreaders);
+    printf("card_insert_us: %.1f\n", (double)card_insert_time / nreaders);
+    printf("card_reinsert_us: %.1f\n",
+           inserts ? (double)insert_time / inserts : 0.0);
+    printf("events: %u\n", latencies->len);
+    printf("events_per_sec: %.1f\n",
+           storm_time ? latencies->len * 1e6 / storm_time : 0.0);
+    printf("event_latency_p50_us: %" G_GINT64_FORMAT "\n",
+           percentile(latencies, 50));
+    printf("event_latency_p90_us: %" G_GINT64_FORMAT "\n",
+           percentile(latencies, 90));
+    printf("event_latency_p99_us: %" G_GINT64_FORMAT "\n",
+           percentile(latencies, 99));
+    printf("event_latency_max_us: %" G_GINT64_FORMAT "\n",
+           percentile(latencies, 100));
+    printf("mem_released_bytes: %" G_GSIZE_FORMAT "\n",
+           mem_inserted - MIN(mem_removed, mem_inserted));
+    printf("rss_released_kb: %ld\n", rss_inserted - rss_removed);
+
+    for (i = 0; i < nreaders; i++) {
+        vreader_free(readers[i].reader);
+    }
+    g_hash_table_destroy(reader_index);
+    g_array_free(latencies, TRUE);
+    g_free(producers);
+    g_free(readers);
+    g_free(dbdir);
+    vcard_emul_finalize();
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */
@@ -0,0 +1,279 @@
+#!/usr/bin/env python3
+#
+# Run the libcacard benchmarks several times, store the results as baselines
+# keyed by the build configuration, and compare a new run with a baseline.
+#
+# The benchmarks print one "key: value" line per metric. The metrics are
+# classified by their name:
+#
+#   *_us                       latency, lower is better
+#   *_per_sec                  throughput, higher is better
+#   *_allocs_per_apdu, allocs* allocations, lower is better
+#   *_bytes, *_kb              memory, lower is better, except the memory
+#                              given back (*_released_*), higher is better
+#
+# The other metrics (parameters, counts) are stored and shown but never fail
+# the comparison. A metric regresses when its change is in the wrong
+# direction, larger than the allowed percentage, and significant according
+# to Welch's t-test at the 95% level.
+#
+# This code is licensed under the GNU LGPL, version 2.1 or later.
+# See the COPYING file in the top-level directory.
+
+import argparse
+import json
+import math
+import os
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+FORMAT = 1
+
+# two-sided 95% Student t quantiles, by degrees of freedom
+T_95 = [
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+]
+
+
+def t_95(df):
+    if df < 1:
+        return float('inf')
+    if df > len(T_95):
+        return 1.960
+    return T_95[int(df) - 1]
+
+
+def kind(metric):
+    if metric.endswith('_us'):
+        return 'latency'
+    if metric.endswith('_per_sec'):
+        return 'throughput'
+    if metric.endswith('_allocs_per_apdu') or metric.startswith('allocs'):
+        return 'allocations'
+    if metric.endswith('_bytes') or metric.endswith('_kb'):
+        return 'memory'
+    return None
+
+
+def higher_is_better(metric):
+    return kind(metric) == 'throughput' or '_released_' in metric
+
+
+def summary(values):
+    n = len(values)
+    mean = statistics.mean(values)
+    sd = statistics.stdev(values) if n > 1 else 0.0
+    ci = t_95(n - 1) * sd / math.sqrt(n) if n > 1 else float('inf')
+    return mean, sd, ci
+
+
+def welch_significant(a, b):
+    ma, sa, _ = summary(a)
+    mb, sb, _ = summary(b)
+    va = sa * sa / len(a)
+    vb = sb * sb / len(b)
+    if va + vb == 0:
+        return ma != mb
+    t = abs(mb - ma) / math.sqrt(va + vb)
+    df_den = 0.0
+    if len(a) > 1:
+        df_den += va * va / (len(a) - 1)
+    if len(b) > 1:
+        df_den += vb * vb / (len(b) - 1)
+    df = (va + vb) ** 2 / df_den if df_den else 1
+    return t > t_95(math.floor(df))
+
+
+def parse_output(text):
+    metrics = {}
+    for line in text.splitlines():
+        m = re.match(r'^([A-Za-z0-9_]+):\s*(-?[0-9.]+(?:[eE][-+]?[0-9]+)?)\s*$',
+                     line)
+        if m:
+            metrics[m.group(1)] = float(m.group(2))
+    return metrics
+
+
+def run_benchmarks(args):
+    env = dict(os.environ)
+    for item in args.env:
+        key, _, value = item.partition('=')
+        env[key] = value
+
+    results = {}
+    for bench in args.benchmarks:
+        name = os.path.basename(bench)
+        if name.startswith('bench-'):
+            name = name[len('bench-'):]
+        runs = {}
+        for i in range(args.runs):
+            print('running %s (%d/%d)' % (name, i + 1, args.runs),
+                  file=sys.stderr)
+            proc = subprocess.run([bench] + args.bench_args, env=env,
+                                  stdout=subprocess.PIPE,
+                                  universal_newlines=True)
+            if proc.returncode != 0:
+                sys.exit('%s failed with status %d' % (bench, proc.returncode))
+            for metric, value in parse_output(proc.stdout).items():
+                runs.setdefault(metric, []).append(value)
+        results[name] = runs
+
+    return {
+        'format': FORMAT,
+        'config': args.config,
+        'version': args.version,
+        'date': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+        'runs': args.runs,
+        'benchmarks': results,
+    }
+
+
+def baseline_path(store, config):
+    return os.path.join(store, re.sub(r'[^A-Za-z0-9_.-]+', '-', config) +
+                        '.json')
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    if data.get('format') != FORMAT:
+        sys.exit('%s: unsupported format' % path)
+    return data
+
+
+def save(data, path):
+    directory = os.path.dirname(path)
+    if directory:
+        os.makedirs(directory, exist_ok=True)
+    with open(path + '.tmp', 'w') as f:
+        json.dump(data, f, indent=2, sort_keys=True)
+        f.write('\n')
+    os.replace(path + '.tmp', path)
+
+
+def show(data):
+    for name, runs in sorted(data['benchmarks'].items()):
+        print('%s (%s, %d runs)' % (name, data.get('version', '?'),
+                                    data['runs']))
+        for metric, values in sorted(runs.items()):
+            mean, _, ci = summary(values)
+            print('  %-28s %14.2f +- %.2f' % (metric, mean, ci))
+
+
+def compare(base, new, limits):
+    regressions = 0
+
+    print('%-40s %14s %14s %9s' % ('metric', 'baseline', 'new', 'change'))
+    for name, runs in sorted(new['benchmarks'].items()):
+        base_runs = base['benchmarks'].get(name)
+        if base_runs is None:
+            print('%s: no baseline' % name)
+            continue
+        for metric, values in sorted(runs.items()):
+            if metric not in base_runs:
+                continue
+            old = base_runs[metric]
+            mb, _, cb = summary(old)
+            mn, _, cn = summary(values)
+            change = (mn - mb) * 100.0 / mb if mb else 0.0
+            k = kind(metric)
+            verdict = ''
+            if k is not None and welch_significant(old, values):
+                worse = -change if higher_is_better(metric) else change
+                if worse > limits[k]:
+                    verdict = 'REGRESSION'
+                    regressions += 1
+                elif worse < 0:
+                    verdict = 'improved'
+            print('%-40s %8.1f+-%-5.1f %8.1f+-%-5.1f %+8.1f%% %s' %
+                  (name + '/' + metric, mb, cb, mn, cn, change, verdict))
+
+    print('%d regression(s) against %s (%s)' %
+          (regressions, base.get('version', '?'), base.get('date', '?')))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='libcacard benchmark baselines and comparison')
+    parser.add_argument('--store', default=os.environ.get(
+                            'LIBCACARD_BENCH_BASELINES',
+                            os.path.join(os.path.dirname(
+                                os.path.abspath(__file__)), 'baselines')),
+                        help='baseline directory (default: '
+                             '$LIBCACARD_BENCH_BASELINES or bench/baselines)')
+    parser.add_argument('--config', default='default',
+                        help='build configuration the baseline is stored for')
+    parser.add_argument('--max-latency-regression', type=float, default=10.0,
+                        metavar='PCT')
+    parser.add_argument('--max-throughput-regression', type=float,
+                        default=10.0, metavar='PCT')
+    parser.add_argument('--max-alloc-regression', type=float, default=5.0,
+                        metavar='PCT')
+    parser.add_argument('--max-memory-regression', type=float, default=10.0,
+                        metavar='PCT')
+    sub = parser.add_subparsers(dest='command')
+
+    run = sub.add_parser('run', help='run the benchmarks')
+    run.add_argument('--runs', type=int, default=5)
+    run.add_argument('--version', default='unknown')
+    run.add_argument('--env', action='append', default=[],
+                     metavar='KEY=VALUE')
+    run.add_argument('--output', help='write the results to this file')
+    run.add_argument('--save', action='store_true',
+                     help='store the results as the baseline')
+    run.add_argument('--compare', action='store_true',
+                     help='compare the results with the baseline')
+    run.add_argument('benchmarks', nargs='+')
+    run.add_argument('--bench-args', nargs=argparse.REMAINDER, default=[],
+                     help='arguments passed to the benchmarks')
+
+    cmp = sub.add_parser('compare', help='compare two result files')
+    cmp.add_argument('baseline')
+    cmp.add_argument('new')
+
+    args = parser.parse_args()
+    limits = {
+        'latency': args.max_latency_regression,
+        'throughput': args.max_throughput_regression,
+        'allocations': args.max_alloc_regression,
+        'memory': args.max_memory_regression,
+    }
+
+    if args.command == 'compare':
+        return 1 if compare(load(args.baseline), load(args.new), limits) else 0
+    if args.command != 'run':
+        parser.print_help()
+        return 2
+
+    if args.runs < 2:
+        sys.exit('at least 2 runs are needed')
+    data = run_benchmarks(args)
+    show(data)
+    if args.output:
+        save(data, args.output)
+
+    path = baseline_path(args.store, args.config)
+    status = 0
+    if args.compare:
+        if not os.path.exists(path):
+            sys.exit('no baseline for %s in %s' % (args.config, args.store))
+        status = 1 if compare(load(path), data, limits) else 0
+    if args.save:
+        if os.path.exists(path):
+            # keep the baselines of the benchmarks which were not run
+            old = load(path)
+            old['benchmarks'].update(data['benchmarks'])
+            data['benchmarks'] = old['benchmarks']
+        save(data, path)
+        print('baseline saved to %s' % path)
+    return status
+
+
+if __name__ == '__main__':
+    sys.exit(main())
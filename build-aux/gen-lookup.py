@@ -0,0 +1,346 @@
+#!/usr/bin/env python3
+#
+# Generate the perfect-hash lookup tables of the constant card identifiers:
+#
+#   status words   the VCARD7816_STATUS_* definitions of card_7816t.h
+#   AIDs           the file scope "*_aid[]" arrays of the applets, and the
+#                  service table of cac-aca.c
+#   COIDs          the card objects of the ACR table of cac-aca.c
+#
+# Each table is indexed by a hash of the key bytes. The seed of the hash is
+# searched at build time so that no two keys of a table share a slot, a
+# lookup is then one hash and one comparison. The hash must be kept in sync
+# with vcard_lookup_hash() in the generated source.
+#
+# This code is licensed under the GNU LGPL, version 2.1 or later.
+# See the COPYING file in the top-level directory.
+
+import argparse
+import os
+import re
+import sys
+
+FNV_PRIME = 0x01000193
+MAX_SEEDS = 1 << 14  # per table size, a larger table is tried next
+AID_MAX_LEN = 16
+# the PKI applets come first in the tables of cac-aca.c, the card uses the
+# first ones only
+ACA_PKI_APPLETS = 10
+
+
+def lookup_hash(key, seed):
+    h = seed
+    for b in key:
+        h = ((h ^ b) * FNV_PRIME) & 0xffffffff
+    return h ^ (h >> 16)
+
+
+def perfect_hash(keys):
+    """The table size and seed which give each key its own slot"""
+    size = 1
+    while size < len(keys):
+        size <<= 1
+    while True:
+        for seed in range(1, MAX_SEEDS):
+            slots = set()
+            for key in keys:
+                slot = lookup_hash(key, seed) & (size - 1)
+                if slot in slots:
+                    break
+                slots.add(slot)
+            else:
+                return size, seed
+        size <<= 1
+
+
+def c_bytes(data):
+    return ', '.join('0x%02x' % b for b in data)
+
+
+def unescape(s):
+    """The bytes of a C string literal made of \\x escapes"""
+    out = bytearray()
+    for m in re.finditer(r'\\x([0-9a-fA-F]{2})|(.)', s):
+        if m.group(1):
+            out.append(int(m.group(1), 16))
+        else:
+            out.append(ord(m.group(2)))
+    return bytes(out)
+
+
+def strip_comments(text):
+    return re.sub(r'/\*.*?\*/', '', text, flags=re.S)
+
+
+def table_body(text, name):
+    """The initializer of the static table name"""
+    m = re.search(r'\b%s\s*=\s*\{' % name, text)
+    if m is None:
+        sys.exit('gen-lookup: no %s table' % name)
+    depth = 0
+    for i in range(m.end() - 1, len(text)):
+        if text[i] == '{':
+            depth += 1
+        elif text[i] == '}':
+            depth -= 1
+            if depth == 0:
+                return text[m.end():i]
+    sys.exit('gen-lookup: unterminated %s table' % name)
+
+
+def parse_status(text):
+    status = []
+    seen = set()
+    for m in re.finditer(r'#define\s+(VCARD7816_STATUS_\w+)\s+(0x[0-9a-fA-F]+)',
+                         text):
+        value = int(m.group(2), 16)
+        # the aliases share the response of the first name
+        if value in seen:
+            continue
+        seen.add(value)
+        status.append((m.group(1), value))
+    return status
+
+
+def parse_aids(text, path, aids):
+    """The file scope "*_aid[]" arrays, static or not, sized or not"""
+    found = 0
+    for m in re.finditer(r'^(?:static\s+)?(?:const\s+)?unsigned\s+char\s+'
+                         r'(\w+_aid)\s*\[\w*\]\s*=\s*\{([^}]*)\}', text,
+                         flags=re.M):
+        data = bytes(int(v, 16) for v in re.findall(r'0x[0-9a-fA-F]+',
+                                                     m.group(2)))
+        if len(data) > AID_MAX_LEN:
+            sys.exit('gen-lookup: %s: %s is too long' % (path, m.group(1)))
+        aids.setdefault(data, -1)
+        found += 1
+    return found
+
+
+def parse_service_table(text, aids):
+    body = table_body(text, 'service_table')
+    entries = re.findall(r'\{\s*(0x[0-9a-fA-F]+)\s*,\s*(\d+)\s*,\s*"([^"]*)"\s*\}',
+                         body)
+    for index, (applet_id, aid_len, aid) in enumerate(entries):
+        data = unescape(aid)[:int(aid_len)]
+        if aids.get(data, -1) < 0:
+            aids[data] = index
+    return len(entries)
+
+
+def parse_acr_table(text):
+    """The first object of each COID, in the PKI and in the static applets"""
+    body = table_body(text, 'applets_table')
+    coids = {}
+    applet = -1
+    obj = 0
+    for m in re.finditer(r'\{\s*(0x[0-9a-fA-F]+)\s*,\s*\d+\s*,\s*\{'
+                         r'|\{\s*"([^"]*)"\s*,\s*\d+\s*,\s*\{', body):
+        if m.group(1):
+            applet += 1
+            obj = 0
+            continue
+        coid = unescape(m.group(2))
+        first = coids.setdefault(coid, [-1, -1, -1, -1])
+        base = 0 if applet < ACA_PKI_APPLETS else 2
+        if first[base] < 0:
+            first[base] = applet
+            first[base + 1] = obj
+        obj += 1
+    return coids
+
+
+def emit_slots(out, name, size, slots):
+    out.append('static const unsigned char %s[%d] = {' % (name, size))
+    for i in range(0, size, 12):
+        out.append('    ' + ', '.join('%d' % s for s in slots[i:i + 12]) + ',')
+    out.append('};')
+
+
+def build_slots(keys, size, seed):
+    slots = [0] * size
+    for index, key in enumerate(keys):
+        slots[lookup_hash(key, seed) & (size - 1)] = index + 1
+    return slots
+
+
+def generate(args):
+    status = []
+    aids = {}
+    coids = {}
+    for path in args.inputs:
+        with open(path) as f:
+            text = strip_comments(f.read())
+        if path.endswith('.h'):
+            status += parse_status(text)
+            continue
+        found = parse_aids(text, path, aids)
+        if os.path.basename(path) == 'cac-aca.c':
+            found += parse_service_table(text, aids)
+            coids = parse_acr_table(text)
+        # an input whose declarations are not recognized any more would
+        # silently lose its AIDs
+        if not found:
+            sys.exit('gen-lookup: %s: no AID' % path)
+
+    if not status or not aids or not coids:
+        sys.exit('gen-lookup: missing status words, AIDs or COIDs')
+    if max(len(status), len(aids), len(coids)) > 255:
+        sys.exit('gen-lookup: too many keys for the slot tables')
+
+    status_keys = [bytes([v >> 8, v & 0xff]) for _, v in status]
+    aid_keys = list(aids)
+    coid_keys = list(coids)
+    status_size, status_seed = perfect_hash(status_keys)
+    aid_size, aid_seed = perfect_hash(aid_keys)
+    coid_size, coid_seed = perfect_hash(coid_keys)
+
+    h = []
+    h.append('/* generated by gen-lookup.py from %s, do not edit */'
+             % ', '.join(os.path.basename(p) for p in args.inputs))
+    h.append('#ifndef VCARD_LOOKUP_H')
+    h.append('#define VCARD_LOOKUP_H 1')
+    h.append('')
+    h.append('#include "vcardt.h"')
+    h.append('#include "card_7816t.h"')
+    h.append('')
+    h.append('#define VCARD_LOOKUP_STATUS_COUNT %d' % len(status))
+    h.append('#define VCARD_LOOKUP_AID_COUNT %d' % len(aid_keys))
+    h.append('#define VCARD_LOOKUP_COID_COUNT %d' % len(coid_keys))
+    h.append('#define VCARD_LOOKUP_ACA_PKI_APPLETS %d' % ACA_PKI_APPLETS)
+    h.append('')
+    h.append('/* X(index, status) for each status word, in the index order */')
+    h.append('#define VCARD_LOOKUP_STATUS_LIST(X) \\')
+    for i, (name, _) in enumerate(status):
+        h.append('    X(%d, %s) \\' % (i, name))
+    h.append('')
+    h.append('typedef struct VCardLookupAidStruct {')
+    h.append('    unsigned char aid[%d];' % AID_MAX_LEN)
+    h.append('    int aid_len;')
+    h.append('    int aca_entry;      /* in the service table, or -1 */')
+    h.append('} VCardLookupAid;')
+    h.append('')
+    h.append('typedef struct VCardLookupCoidStruct {')
+    h.append('    unsigned char coid[2];')
+    h.append('    /* the first object with the COID in the ACR table, or -1 */')
+    h.append('    int pki_applet, pki_object;')
+    h.append('    int static_applet, static_object;')
+    h.append('} VCardLookupCoid;')
+    h.append('')
+    h.append('extern const VCardLookupAid vcard_lookup_aids[];')
+    h.append('extern const VCardLookupCoid vcard_lookup_coids[];')
+    h.append('')
+    h.append('/* the index of the key, or -1 if it is not a known one */')
+    h.append('int vcard_lookup_status(vcard_7816_status_t status);')
+    h.append('int vcard_lookup_aid(const unsigned char *aid, int aid_len);')
+    h.append('int vcard_lookup_coid(const unsigned char *coid);')
+    h.append('')
+    h.append('#endif')
+
+    c = []
+    c.append('/* generated by gen-lookup.py, do not edit */')
+    c.append('#include <string.h>')
+    c.append('#include <stdint.h>')
+    c.append('')
+    c.append('#include "%s"' % os.path.basename(args.header))
+    c.append('')
+    c.append('static inline uint32_t')
+    c.append('vcard_lookup_hash(const unsigned char *key, int len, uint32_t seed)')
+    c.append('{')
+    c.append('    uint32_t h = seed;')
+    c.append('    int i;')
+    c.append('')
+    c.append('    for (i = 0; i < len; i++) {')
+    c.append('        h = (h ^ key[i]) * 0x%08xU;' % FNV_PRIME)
+    c.append('    }')
+    c.append('    return h ^ (h >> 16);')
+    c.append('}')
+    c.append('')
+    c.append('static const vcard_7816_status_t vcard_lookup_status_keys[] = {')
+    for name, _ in status:
+        c.append('    %s,' % name)
+    c.append('};')
+    c.append('')
+    c.append('const VCardLookupAid vcard_lookup_aids[] = {')
+    for key in aid_keys:
+        c.append('    { { %s }, %d, %d },' % (c_bytes(key), len(key), aids[key]))
+    c.append('};')
+    c.append('')
+    c.append('const VCardLookupCoid vcard_lookup_coids[] = {')
+    for key in coid_keys:
+        c.append('    { { %s }, %d, %d, %d, %d },'
+                 % ((c_bytes(key),) + tuple(coids[key])))
+    c.append('};')
+    c.append('')
+    emit_slots(c, 'vcard_lookup_status_slots', status_size,
+               build_slots(status_keys, status_size, status_seed))
+    c.append('')
+    emit_slots(c, 'vcard_lookup_aid_slots', aid_size,
+               build_slots(aid_keys, aid_size, aid_seed))
+    c.append('')
+    emit_slots(c, 'vcard_lookup_coid_slots', coid_size,
+               build_slots(coid_keys, coid_size, coid_seed))
+    c.append('')
+    c.append('int')
+    c.append('vcard_lookup_status(vcard_7816_status_t status)')
+    c.append('{')
+    c.append('    unsigned char key[2] = { status >> 8, status & 0xff };')
+    c.append('    int i = vcard_lookup_status_slots[')
+    c.append('        vcard_lookup_hash(key, 2, %dU) & %d] - 1;'
+             % (status_seed, status_size - 1))
+    c.append('')
+    c.append('    if (i < 0 || vcard_lookup_status_keys[i] != status) {')
+    c.append('        return -1;')
+    c.append('    }')
+    c.append('    return i;')
+    c.append('}')
+    c.append('')
+    c.append('int')
+    c.append('vcard_lookup_aid(const unsigned char *aid, int aid_len)')
+    c.append('{')
+    c.append('    int i;')
+    c.append('')
+    c.append('    if (aid_len <= 0 || aid_len > %d) {' % AID_MAX_LEN)
+    c.append('        return -1;')
+    c.append('    }')
+    c.append('    i = vcard_lookup_aid_slots[')
+    c.append('        vcard_lookup_hash(aid, aid_len, %dU) & %d] - 1;'
+             % (aid_seed, aid_size - 1))
+    c.append('    if (i < 0 || vcard_lookup_aids[i].aid_len != aid_len ||')
+    c.append('        memcmp(vcard_lookup_aids[i].aid, aid, aid_len) != 0) {')
+    c.append('        return -1;')
+    c.append('    }')
+    c.append('    return i;')
+    c.append('}')
+    c.append('')
+    c.append('int')
+    c.append('vcard_lookup_coid(const unsigned char *coid)')
+    c.append('{')
+    c.append('    int i = vcard_lookup_coid_slots[')
+    c.append('        vcard_lookup_hash(coid, 2, %dU) & %d] - 1;'
+             % (coid_seed, coid_size - 1))
+    c.append('')
+    c.append('    if (i < 0 || memcmp(vcard_lookup_coids[i].coid, coid, 2) != 0) {')
+    c.append('        return -1;')
+    c.append('    }')
+    c.append('    return i;')
+    c.append('}')
+
+    with open(args.header, 'w') as f:
+        f.write('\n'.join(h) + '\n')
+    with open(args.source, 'w') as f:
+        f.write('\n'.join(c) + '\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Generate the lookup tables of the card identifiers')
+    parser.add_argument('--header', required=True)
+    parser.add_argument('--source', required=True)
+    parser.add_argument('inputs', nargs='+',
+                        help='card_7816t.h and the applet sources')
+    generate(parser.parse_args())
+
+
+if __name__ == '__main__':
+    main()
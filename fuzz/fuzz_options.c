@@ -77,4 +77,23 @@ int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size)
     return 0;
 }
 
+/* the depth is the number of certificates of a soft reader */
+size_t fuzz_perf_generate(unsigned int depth, uint8_t *out, size_t max_size)
+{
+    static const char head[] = "use_hw=no soft=(,R,CAC,";
+    size_t len = sizeof(head) - 1;
+    unsigned int i;
+
+    if (len + 2 * depth + 1 > MIN(max_size, kMaxInputLength)) {
+        return 0;
+    }
+    memcpy(out, head, len);
+    for (i = 0; i < depth; i++) {
+        out[len++] = ',';
+        out[len++] = 'a' + i % 26;
+    }
+    out[len++] = ')';
+    return len;
+}
+
 /* vim: set ts=4 sw=4 tw=0 noet expandtab: */
@@ -24,4 +24,28 @@ int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size)
     return 0;
 }
 
+/* SimpleTLV is flat, the depth is the number of members, every fourth one
+ * with the long length form */
+size_t fuzz_perf_generate(unsigned int depth, uint8_t *out, size_t max_size)
+{
+    size_t len = 0;
+    unsigned int i;
+
+    for (i = 0; i < depth; i++) {
+        if (len + 4 > max_size) {
+            return 0;
+        }
+        out[len++] = i & 0xff;
+        if (i % 4 == 3) {
+            out[len++] = 0xff;
+            out[len++] = 0x01;
+            out[len++] = 0x00;
+        } else {
+            out[len++] = 0x01;
+        }
+        out[len++] = 0x00;
+    }
+    return len;
+}
+
 /* vim: set ts=4 sw=4 tw=0 noet expandtab: */
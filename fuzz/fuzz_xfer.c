@@ -7,6 +7,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <libcacard.h>
 
 #include "fuzzer.h"
@@ -184,4 +185,37 @@ int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size)
     return 0;
 }
 
+/* the depth is the number of chained SIGN DECRYPT commands to the first PKI
+ * applet, the final one releases the chained data */
+size_t fuzz_perf_generate(unsigned int depth, uint8_t *out, size_t max_size)
+{
+    static const uint8_t select_pki[] = {
+        0x0c, 0x00, 0xa4, 0x04, 0x00, 0x07,
+        0xa0, 0x00, 0x00, 0x00, 0x79, 0x01, 0x00
+    };
+    static const uint8_t last[] = {
+        0x06, 0x80, 0x42, 0x00, 0x00, 0x01, 0x00
+    };
+    const size_t chunk = 0xf0;
+    size_t len = sizeof(select_pki);
+    unsigned int i;
+
+    if (len + depth * (6 + chunk) + sizeof(last) > max_size) {
+        return 0;
+    }
+    memcpy(out, select_pki, len);
+    for (i = 0; i < depth; i++) {
+        out[len++] = 5 + chunk;
+        out[len++] = 0x80;
+        out[len++] = 0x42;
+        out[len++] = 0x80; /* more data follows */
+        out[len++] = 0x00;
+        out[len++] = chunk;
+        memset(&out[len], 0xff, chunk);
+        len += chunk;
+    }
+    memcpy(&out[len], last, sizeof(last));
+    return len + sizeof(last);
+}
+
 /* vim: set ts=4 sw=4 tw=0 noet expandtab: */
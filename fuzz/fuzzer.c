@@ -1,28 +1,236 @@
-/* Simpler gnu89 version of StandaloneFuzzTargetMain.c from LLVM */
+/* Simpler gnu89 version of StandaloneFuzzTargetMain.c from LLVM
+ *
+ * The inputs can be files or directories, in which case all the files in
+ * them are run.
+ *
+ * With -perf OUTDIR, the cost of the inputs is measured as well. The inputs
+ * of the corpus which cost much more per byte than the rest are reported.
+ * When the target provides fuzz_perf_generate(), inputs of growing
+ * structural depth (nesting, chain length, number of members) are generated
+ * as well, and the depths at which the time grows faster than the size^1.5
+ * are reported. The reported inputs are written to OUTDIR as slow-* files,
+ * from which they can be committed to fuzz/corpora/<target> as regression
+ * cases.
+ */
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 int LLVMFuzzerTestOneInput (const unsigned char *data, size_t size);
 __attribute__((weak)) int LLVMFuzzerInitialize(int *argc, char ***argv);
+__attribute__((weak)) size_t fuzz_perf_generate(unsigned int depth,
+                                                unsigned char *out,
+                                                size_t max_size);
 
-int
-main (int argc, char **argv)
+/* number of runs of each measurement, the fastest is taken */
+#define PERF_RUNS 5
+/* the growth and the cost per byte are checked only above this time */
+#define PERF_MIN_NS 200000.0
+/* cost per byte compared to the median of the corpus */
+#define PERF_MAX_RATIO 20.0
+#define PERF_MAX_INPUTS 4096
+/* the generated inputs double their depth up to these limits */
+#define PERF_MAX_DEPTH 4096
+#define PERF_MAX_SIZE (256 * 1024)
+
+struct perf_result {
+    char *name;
+    unsigned char *data;
+    size_t len;
+    double ns;          /* time of the input alone */
+    double ns_per_byte;
+    double growth;      /* generated: time ratio over size ratio to the
+                         * previous depth, 1 for linear cost */
+    int slow;
+};
+
+static const char *perf_outdir;
+static struct perf_result perf_results[PERF_MAX_INPUTS];
+static int perf_count;
+
+static double
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double
+perf_measure (const unsigned char *buf, size_t len)
+{
+    double best = -1;
+    int i;
+
+    for (i = 0; i < PERF_RUNS; i++) {
+        double start = now_ns ();
+        double elapsed;
+
+        LLVMFuzzerTestOneInput (buf, len);
+        elapsed = now_ns () - start;
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+static struct perf_result *
+perf_run (const char *name, const unsigned char *buf, size_t len)
+{
+    struct perf_result *r;
+
+    if (perf_count == PERF_MAX_INPUTS) {
+        fprintf (stderr, "Too many inputs, %s not measured\n", name);
+        return NULL;
+    }
+    r = &perf_results[perf_count++];
+    r->name = strdup (name);
+    r->data = (unsigned char *) malloc (len ? len : 1);
+    memcpy (r->data, buf, len);
+    r->len = len;
+    r->ns = perf_measure (buf, len);
+    r->ns_per_byte = r->ns / (len ? len : 1);
+    r->growth = 0;
+    r->slow = 0;
+    return r;
+}
+
+/*
+ * Generate the inputs of depth 1, 2, 4, ... and flag the depths where the
+ * time grows faster than size^1.5 compared to the previous one
+ */
+static void
+perf_grow (void)
 {
+    unsigned char *buf = (unsigned char *) malloc (PERF_MAX_SIZE);
+    struct perf_result *prev = NULL;
+    unsigned int depth;
+
+    for (depth = 1; depth <= PERF_MAX_DEPTH; depth *= 2) {
+        struct perf_result *r;
+        char name[32];
+        size_t len;
+
+        len = fuzz_perf_generate (depth, buf, PERF_MAX_SIZE);
+        if (len == 0) {
+            break;
+        }
+        sprintf (name, "depth-%u", depth);
+        r = perf_run (name, buf, len);
+        if (r == NULL) {
+            break;
+        }
+        if (prev && prev->ns > 0 && r->len > prev->len) {
+            double time_ratio = r->ns / prev->ns;
+            double size_ratio = (double) r->len / prev->len;
+
+            r->growth = time_ratio / size_ratio;
+            /* time_ratio > size_ratio^1.5 */
+            r->slow = r->ns >= PERF_MIN_NS &&
+                time_ratio * time_ratio > size_ratio * size_ratio * size_ratio;
+        }
+        prev = r;
+    }
+    free (buf);
+}
+
+static int
+compare_double (const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static int
+perf_save (const struct perf_result *r)
+{
+    const char *name = strrchr (r->name, '/');
+    char *out;
     FILE *f;
-    size_t n_read, len;
-    unsigned char *buf;
 
-    if (argc < 2) {
-        return 1;
+    name = name ? name + 1 : r->name;
+    /* inputs coming from the corpus are regression cases already */
+    if (strncmp (name, "slow-", 5) == 0) {
+        return 0;
+    }
+    out = (char *) malloc (strlen (perf_outdir) + strlen (name) + 7);
+    sprintf (out, "%s/slow-%s", perf_outdir, name);
+    f = fopen (out, "w");
+    if (f == NULL || fwrite (r->data, 1, r->len, f) != r->len) {
+        fprintf (stderr, "Can not save %s to %s\n", r->name, out);
+        if (f)
+            fclose (f);
+        free (out);
+        return -1;
     }
+    fclose (f);
+    printf ("Saved %s\n", out);
+    free (out);
+    return 0;
+}
 
-    if (LLVMFuzzerInitialize) {
-        LLVMFuzzerInitialize(&argc, &argv);
+static int
+perf_report (void)
+{
+    double *costs, median = 0;
+    int i, corpus = 0, flagged = 0;
+
+    if (perf_count == 0) {
+        return 0;
+    }
+    /* the median cost per byte of the corpus, without the generated inputs */
+    costs = (double *) malloc (perf_count * sizeof (double));
+    for (i = 0; i < perf_count; i++) {
+        if (strncmp (perf_results[i].name, "depth-", 6) != 0) {
+            costs[corpus++] = perf_results[i].ns_per_byte;
+        }
+    }
+    if (corpus > 0) {
+        qsort (costs, corpus, sizeof (double), compare_double);
+        median = costs[corpus / 2];
     }
+    free (costs);
+
+    printf ("%-40s %8s %12s %10s %8s\n",
+            "input", "bytes", "ns", "ns/byte", "growth");
+    for (i = 0; i < perf_count; i++) {
+        struct perf_result *r = &perf_results[i];
+        int slow = r->slow ||
+            (r->growth == 0 && median > 0 && r->ns >= PERF_MIN_NS &&
+             r->ns_per_byte > median * PERF_MAX_RATIO);
+
+        printf ("%-40s %8lu %12.0f %10.1f %8.2f%s\n", r->name,
+                (unsigned long) r->len, r->ns, r->ns_per_byte, r->growth,
+                slow ? "  SLOW" : "");
+        if (slow) {
+            flagged++;
+            perf_save (r);
+        }
+        free (r->name);
+        free (r->data);
+    }
+    printf ("%d of %d inputs flagged\n", flagged, perf_count);
+    return flagged;
+}
+
+static void
+run_file (const char *path)
+{
+    FILE *f;
+    size_t n_read, len;
+    unsigned char *buf;
 
-    f = fopen (argv[1], "r");
+    f = fopen (path, "r");
     assert (f);
     fseek (f, 0, SEEK_END);
     len = ftell (f);
@@ -30,9 +238,76 @@ main (int argc, char **argv)
     buf = (unsigned char*) malloc (len);
     n_read = fread (buf, 1, len, f);
     assert (n_read == len);
-    LLVMFuzzerTestOneInput (buf, len);
+    fclose (f);
+    if (perf_outdir) {
+        perf_run (path, buf, len);
+    } else {
+        LLVMFuzzerTestOneInput (buf, len);
+    }
 
     free (buf);
+}
+
+static void
+run_path (const char *path)
+{
+    struct stat st;
+    struct dirent *entry;
+    DIR *dir;
+
+    if (stat (path, &st) != 0 || !S_ISDIR (st.st_mode)) {
+        run_file (path);
+        return;
+    }
+    dir = opendir (path);
+    assert (dir);
+    while ((entry = readdir (dir)) != NULL) {
+        char *child;
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        child = (char *) malloc (strlen (path) + strlen (entry->d_name) + 2);
+        sprintf (child, "%s/%s", path, entry->d_name);
+        run_path (child);
+        free (child);
+    }
+    closedir (dir);
+}
+
+int
+main (int argc, char **argv)
+{
+    int i;
+
+    if (argc > 2 && strcmp (argv[1], "-perf") == 0) {
+        perf_outdir = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+        if (mkdir (perf_outdir, 0777) != 0 && errno != EEXIST) {
+            perror (perf_outdir);
+            return 1;
+        }
+    }
+    if (argc < 2) {
+        return 1;
+    }
+
+    if (LLVMFuzzerInitialize) {
+        LLVMFuzzerInitialize(&argc, &argv);
+    }
+
+    for (i = 1; i < argc; i++) {
+        run_path (argv[i]);
+    }
+    if (perf_outdir) {
+        if (fuzz_perf_generate) {
+            perf_grow ();
+        }
+        perf_report ();
+    }
+
     printf ("Done!\n");
     return 0;
 }
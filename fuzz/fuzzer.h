@@ -10,4 +10,7 @@
 G_BEGIN_DECLS
 int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
 int LLVMFuzzerInitialize(int *argc, char ***argv);
+/* used by the -perf mode of the standalone driver: write the input of the
+ * given structural depth to out, return its size or 0 past the deepest one */
+size_t fuzz_perf_generate(unsigned int depth, uint8_t *out, size_t max_size);
 G_END_DECLS
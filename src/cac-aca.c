@@ -19,6 +19,7 @@
 #include "common.h"
 #include "cac-aca.h"
 #include "simpletlv.h"
+#include "vcard_lookup.h"
 
 #include <string.h>
 
@@ -803,36 +804,40 @@ static struct simpletlv_member *
 cac_aca_get_applet_acr_coid(unsigned int pki_applets, unsigned char *coid)
 {
     struct simpletlv_member *r = NULL;
-    size_t i, j;
+    const VCardLookupCoid *known;
+    unsigned int buffer_len = ACR_MAX_INSTRUCTIONS * 6 + 2;
+    unsigned char *p = NULL;
+    int index = vcard_lookup_coid(coid);
+    int i, j;
 
-    r = g_malloc(sizeof(struct simpletlv_member));
+    if (index < 0) {
+        return NULL;
+    }
+    known = &vcard_lookup_coids[index];
+    /* Skip unused PKI applets */
+    if (known->pki_applet >= 0 &&
+        (unsigned int)known->pki_applet < pki_applets) {
+        i = known->pki_applet;
+        j = known->pki_object;
+    } else if (known->static_applet >= 0) {
+        i = known->static_applet;
+        j = known->static_object;
+    } else {
+        return NULL;
+    }
 
-    for (i = 0; i < applets_table.num_applets; i++) {
-        /* Skip unused PKI applets */
-        if (i >= pki_applets && i < 10)
-            continue;
+    r = g_malloc(sizeof(struct simpletlv_member));
+    r->type = SIMPLETLV_TYPE_LEAF;
+    r->tag = CAC_ACR_OBJECT_ACR;
+    r->value.value = g_malloc_n(buffer_len, sizeof(unsigned char));
+    p = acr_applet_object_encode(&applets_table.applets[i].objects[j],
+                                 r->value.value, buffer_len, &r->length);
+    /* return the record on success */
+    if (p)
+        return r;
 
-        for (j = 0; j < applets_table.applets[i].num_objects; j++) {
-            if (memcmp(&applets_table.applets[i].objects[j].id, coid, 2) == 0) {
-                unsigned int buffer_len = ACR_MAX_INSTRUCTIONS * 6 + 2;
-                unsigned char *p = NULL;
-
-                r->type = SIMPLETLV_TYPE_LEAF;
-                r->tag = CAC_ACR_OBJECT_ACR;
-                r->value.value = g_malloc_n(buffer_len, sizeof(unsigned char));
-                p = acr_applet_object_encode(
-                    &applets_table.applets[i].objects[j],
-                    r->value.value, buffer_len, &r->length);
-                /* return the record on success */
-                if (p)
-                    return r;
-
-                /* clean up on failure */
-                g_free(r->value.value);
-            }
-        }
-    }
-    /* Failure */
+    /* clean up on failure */
+    g_free(r->value.value);
     g_free(r);
     return NULL;
 }
@@ -840,12 +845,15 @@ cac_aca_get_applet_acr_coid(unsigned int pki_applets, unsigned char *coid)
 static unsigned char
 aid_to_applet_id(unsigned int pki_applets, unsigned char *aid, unsigned int aid_len)
 {
-    unsigned int i;
-    for (i = 0; i < service_table.num_entries; i++) {
-        if ((i < pki_applets || i >= 10)
-            && aid_len == service_table.entries[i].applet_aid_len
-            && memcmp(aid, service_table.entries[i].applet_aid, aid_len) == 0)
-            return service_table.entries[i].applet_id;
+    int index = vcard_lookup_aid(aid, aid_len);
+    int i;
+
+    if (index < 0 || vcard_lookup_aids[index].aca_entry < 0) {
+        return 0x00;
+    }
+    i = vcard_lookup_aids[index].aca_entry;
+    if ((unsigned int)i < pki_applets || i >= VCARD_LOOKUP_ACA_PKI_APPLETS) {
+        return service_table.entries[i].applet_id;
     }
     return 0x00;
 }
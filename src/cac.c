@@ -25,10 +25,12 @@
 #include "cac.h"
 #include "cac-aca.h"
 #include "vcard.h"
+#include "vcard_cache.h"
 #include "vcard_emul.h"
 #include "vcardt_internal.h"
 #include "card_7816.h"
 #include "simpletlv.h"
+#include "vcard_lookup.h"
 #include "common.h"
 
 static const unsigned char cac_aca_aid[] = {
@@ -61,8 +63,9 @@ static const unsigned char cac_personnel_aid[] = {
 
 /* private data for PKI applets */
 typedef struct CACPKIAppletDataStruct {
-    unsigned char *sign_buffer;
-    int sign_buffer_len;
+    /* the channels which selected the applet sign independently */
+    unsigned char *sign_buffer[MAX_CHANNEL];
+    int sign_buffer_len[MAX_CHANNEL];
     VCardKey *key;
 } CACPKIAppletData;
 
@@ -103,6 +106,14 @@ struct VCardAppletPrivateStruct {
      */
     struct coid *coids;
     unsigned int coids_len;
+    /* the COIDs above as bits of their index in the generated lookup table,
+     * set on the first SELECT. Only the unknown ones have to be searched */
+    guint64 coids_known;
+    gboolean coids_unknown;
+    gboolean coids_indexed;
+    /* registration of the TAG and VALUE buffers in the memory budget, if
+     * the applet is able to rebuild them */
+    VCardCacheEntry *cache;
     /* applet-specific */
     union {
         CACPKIAppletData pki_data;
@@ -249,6 +260,42 @@ cleanup:
     return r;
 }
 
+G_STATIC_ASSERT(VCARD_LOOKUP_COID_COUNT <= 64);
+
+/* does the applet have the card object */
+static gboolean
+cac_applet_has_coid(VCardAppletPrivate *applet_private,
+                    const unsigned char *coid)
+{
+    unsigned int i;
+    int index;
+
+    if (!applet_private->coids_indexed) {
+        for (i = 0; i < applet_private->coids_len; i++) {
+            index = vcard_lookup_coid(applet_private->coids[i].v);
+            if (index < 0) {
+                applet_private->coids_unknown = TRUE;
+                continue;
+            }
+            applet_private->coids_known |= G_GUINT64_CONSTANT(1) << index;
+        }
+        applet_private->coids_indexed = TRUE;
+    }
+    index = vcard_lookup_coid(coid);
+    if (index >= 0) {
+        return (applet_private->coids_known >> index) & 1;
+    }
+    if (!applet_private->coids_unknown) {
+        return FALSE;
+    }
+    for (i = 0; i < applet_private->coids_len; i++) {
+        if (memcmp(coid, applet_private->coids[i].v, 2) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
 /*
  * handle all the APDU's that are common to all CAC applets
  */
@@ -257,8 +304,6 @@ cac_common_process_apdu(VCard *card, VCardAPDU *apdu, VCardResponse **response)
 {
     VCardAppletPrivate *applet_private;
     VCardStatus ret = VCARD_FAIL;
-    int found = 0;
-    unsigned int i;
 
     applet_private = vcard_get_current_applet_private(card, apdu->a_channel);
     g_assert(applet_private);
@@ -348,12 +393,7 @@ cac_common_process_apdu(VCard *card, VCardAPDU *apdu, VCardResponse **response)
         /* CAC 2 Card Object ID needs to match one of the COID defined
          * in the applet
          */
-        for (i = 0; i < applet_private->coids_len; i++) {
-            if (memcmp(apdu->a_body, applet_private->coids[i].v, 2) == 0) {
-                found = 1;
-            }
-        }
-        if (!found) {
+        if (!cac_applet_has_coid(applet_private, apdu->a_body)) {
             *response = vcard_make_response(
                 VCARD7816_STATUS_ERROR_FILE_NOT_FOUND);
             ret = VCARD_DONE;
@@ -458,6 +498,84 @@ cac_common_process_apdu_read(VCard *card, VCardAPDU *apdu,
 }
 
 
+/*
+ * Encode the certificate into the TAG and VALUE buffers of the PKI applet.
+ * Called when the applet is created and when the buffers are needed again
+ * after they were released by the idle policy.
+ */
+static int
+cac_pki_create_buffers(VCardAppletPrivate *applet_private,
+                       const unsigned char *cert, int cert_len)
+{
+    /* if this would be 1, the certificate would be compressed */
+    unsigned char certinfo[] = "\x00";
+    struct simpletlv_member buffer[] = {
+        {CAC_PKI_TAG_CERTINFO, 1, {/*.value = certinfo*/},
+            SIMPLETLV_TYPE_LEAF},
+        {CAC_PKI_TAG_CERTIFICATE, cert_len, {/*.value = cert*/},
+            SIMPLETLV_TYPE_LEAF},
+        {CAC_PKI_TAG_MSCUID, 0, {/*.value = NULL*/}, SIMPLETLV_TYPE_LEAF},
+        {CAC_PKI_TAG_ERROR_DETECTION_CODE, 0, {/*.value = NULL*/},
+            SIMPLETLV_TYPE_LEAF},
+    };
+    size_t buffer_len = sizeof(buffer)/sizeof(struct simpletlv_member);
+
+    /*
+     * if we want to support compression, then we simply change the 0 to a 1
+     * in certinfo and compress the cert data with libz
+     */
+
+    /* prepare the buffers to when READ_BUFFER will be called.
+     * Assuming VM card with (LSB first if > 255)
+     * separate Tag+Length, Value buffers as described in 8.4:
+     *    2 B       1 B     1-3 B     1 B    1-3 B
+     * [ T-Len ] [ Tag1 ] [ Len1 ] [ Tag2] [ Len2 ] [...]
+     *
+     *    2 B       Len1 B      Len2 B
+     * [ V-Len ] [ Value 1 ] [ Value 2 ] [...]
+     * */
+
+    /* Tag+Len buffer */
+    buffer[0].value.value = certinfo;
+    buffer[1].value.value = (unsigned char *)cert;
+    buffer[2].value.value = NULL;
+    buffer[3].value.value = NULL;
+    /* Ex:
+     * 0A 00     Length of whole buffer
+     * 71        Tag: CertInfo
+     * 01        Length: 1B
+     * 70        Tag: Certificate
+     * FF B2 03  Length: (\x03 << 8) || \xB2
+     * 72        Tag: MSCUID
+     * 26        Length
+     */
+    applet_private->tag_buffer_len = cac_create_tl_file(buffer, buffer_len,
+        &applet_private->tag_buffer);
+    if (applet_private->tag_buffer_len == 0) {
+        return -1;
+    }
+    g_debug("%s: applet_private->tag_buffer = %s", __func__,
+        hex_dump(applet_private->tag_buffer, applet_private->tag_buffer_len));
+
+    /* Value buffer */
+    /* Ex:
+     * DA 03      Length of complete buffer
+     * 01         Value of CertInfo
+     * 78 [..] 6C Cert Value
+     * 7B 63 37 35 62 62 61 64 61 2D 35 32 39 38 2D 31
+     * 37 35 62 2D 39 32 64 63 2D 39 38 35 30 36 62 65
+     * 30 30 30 30 30 7D          MSCUID Value
+     */
+    applet_private->val_buffer_len = cac_create_val_file(buffer, buffer_len,
+        &applet_private->val_buffer);
+    if (applet_private->val_buffer_len == 0) {
+        return -1;
+    }
+    g_debug("%s: applet_private->val_buffer = %s", __func__,
+        hex_dump(applet_private->val_buffer, applet_private->val_buffer_len));
+    return 0;
+}
+
 /*
  *  reset the inter call state between applet selects
  */
@@ -470,34 +588,70 @@ cac_applet_pki_reset(VCard *card, int channel)
     g_assert(applet_private);
     pki_applet = &(applet_private->u.pki_data);
 
-    g_free(pki_applet->sign_buffer);
-    pki_applet->sign_buffer = NULL;
-    pki_applet->sign_buffer_len = 0;
+    g_free(pki_applet->sign_buffer[channel]);
+    pki_applet->sign_buffer[channel] = NULL;
+    pki_applet->sign_buffer_len[channel] = 0;
     return VCARD_DONE;
 }
 
-static VCardStatus
-cac_applet_passthrough_reset(VCard *card, int channel)
+/*
+ * release the TAG and VALUE buffers. The applets which call this rebuild
+ * them on the next READ BUFFER
+ */
+static void
+cac_release_buffers(VCardAppletPrivate *applet_private)
 {
-    VCardAppletPrivate *applet_private;
-    applet_private = vcard_get_current_applet_private(card, channel);
-    g_assert(applet_private);
-
     g_free(applet_private->tag_buffer);
     applet_private->tag_buffer = NULL;
     applet_private->tag_buffer_len = 0;
     g_free(applet_private->val_buffer);
     applet_private->val_buffer = NULL;
     applet_private->val_buffer_len = 0;
+}
+
+/* eviction callback of the memory budget */
+static void
+cac_evict_buffers(void *opaque)
+{
+    cac_release_buffers((VCardAppletPrivate *)opaque);
+}
+
+/* account the rebuilt TAG and VALUE buffers in the memory budget */
+static void
+cac_charge_buffers(VCardAppletPrivate *applet_private)
+{
+    vcard_cache_entry_charge(applet_private->cache,
+        applet_private->tag_buffer_len + applet_private->val_buffer_len);
+}
+
+static VCardStatus
+cac_applet_passthrough_reset(VCard *card, int channel)
+{
+    VCardAppletPrivate *applet_private;
+    applet_private = vcard_get_current_applet_private(card, channel);
+    g_assert(applet_private);
+
+    vcard_cache_entry_evict(applet_private->cache);
     return VCARD_DONE;
 }
 
+/*
+ * release the reconstructible data of the applet while the card is idle
+ */
+static void
+cac_applet_release(VCardAppletPrivate *applet_private)
+{
+    /* only the applets registered in the budget can rebuild the buffers */
+    vcard_cache_entry_evict(applet_private->cache);
+}
+
 static VCardStatus
 cac_applet_pki_process_apdu(VCard *card, VCardAPDU *apdu,
                             VCardResponse **response)
 {
     CACPKIAppletData *pki_applet;
     VCardAppletPrivate *applet_private;
+    int channel = apdu->a_channel;
     int size;
     unsigned char *sign_buffer = NULL;
     bool retain_sign_buffer = FALSE;
@@ -523,16 +677,17 @@ cac_applet_pki_process_apdu(VCard *card, VCardAPDU *apdu,
         }
         size = apdu->a_Lc;
 
-        sign_buffer = g_realloc(pki_applet->sign_buffer,
-                                pki_applet->sign_buffer_len + size);
-        memcpy(sign_buffer + pki_applet->sign_buffer_len, apdu->a_body, size);
-        size += pki_applet->sign_buffer_len;
+        sign_buffer = g_realloc(pki_applet->sign_buffer[channel],
+                                pki_applet->sign_buffer_len[channel] + size);
+        memcpy(sign_buffer + pki_applet->sign_buffer_len[channel],
+               apdu->a_body, size);
+        size += pki_applet->sign_buffer_len[channel];
         switch (apdu->a_p1) {
         case  0x80:
             /* p1 == 0x80 means we haven't yet sent the whole buffer, wait for
              * the rest */
-            pki_applet->sign_buffer = sign_buffer;
-            pki_applet->sign_buffer_len = size;
+            pki_applet->sign_buffer[channel] = sign_buffer;
+            pki_applet->sign_buffer_len[channel] = size;
             *response = vcard_make_response(VCARD7816_STATUS_SUCCESS);
             retain_sign_buffer = TRUE;
             break;
@@ -559,11 +714,34 @@ cac_applet_pki_process_apdu(VCard *card, VCardAPDU *apdu,
         }
         if (!retain_sign_buffer) {
             g_free(sign_buffer);
-            pki_applet->sign_buffer = NULL;
-            pki_applet->sign_buffer_len = 0;
+            pki_applet->sign_buffer[channel] = NULL;
+            pki_applet->sign_buffer_len[channel] = 0;
         }
         ret = VCARD_DONE;
         break;
+    case CAC_READ_BUFFER:
+        /* The buffers might have been released to save memory -- rebuild them */
+        vcard_cache_entry_pin(applet_private->cache);
+        if (applet_private->tag_buffer == NULL || applet_private->val_buffer == NULL) {
+            unsigned char *cert;
+            int cert_len;
+
+            cac_release_buffers(applet_private);
+            cert = vcard_emul_get_cert(pki_applet->key, &cert_len);
+            if (cert == NULL ||
+                cac_pki_create_buffers(applet_private, cert, cert_len) < 0) {
+                cac_release_buffers(applet_private);
+                vcard_cache_entry_unpin(applet_private->cache);
+                *response = vcard_make_response(
+                                VCARD7816_STATUS_EXC_ERROR_MEMORY_FAILURE);
+                ret = VCARD_DONE;
+                break;
+            }
+            cac_charge_buffers(applet_private);
+        }
+        ret = cac_common_process_apdu_read(card, apdu, response);
+        vcard_cache_entry_unpin(applet_private->cache);
+        break;
     default:
         ret = cac_common_process_apdu_read(card, apdu, response);
         break;
@@ -716,7 +894,9 @@ cac_passthrough_container_process_apdu(VCard *card, VCardAPDU *apdu,
 
     switch (apdu->a_ins) {
     case CAC_READ_BUFFER:
-        /* The data were not yet retrieved from the card -- do it now */
+        /* The data were not yet retrieved from the card or were released
+         * to save memory -- do it now */
+        vcard_cache_entry_pin(applet_private->cache);
         if (applet_private->tag_buffer == NULL || applet_private->val_buffer == NULL) {
             unsigned char *data;
             unsigned int data_len;
@@ -744,8 +924,11 @@ cac_passthrough_container_process_apdu(VCard *card, VCardAPDU *apdu,
                 applet_private->val_buffer_len = cac_create_empty_file(
                     &applet_private->val_buffer);
             }
+            cac_charge_buffers(applet_private);
         }
-        /* fallthrough */
+        ret = cac_common_process_apdu_read(card, apdu, response);
+        vcard_cache_entry_unpin(applet_private->cache);
+        break;
     default:
         ret = cac_common_process_apdu_read(card, apdu, response);
         break;
@@ -760,12 +943,16 @@ static void
 cac_delete_pki_applet_private(VCardAppletPrivate *applet_private)
 {
     CACPKIAppletData *pki_applet_data;
+    int i;
 
     if (applet_private == NULL) {
         return;
     }
     pki_applet_data = &(applet_private->u.pki_data);
-    g_free(pki_applet_data->sign_buffer);
+    vcard_cache_entry_delete(applet_private->cache);
+    for (i = 0; i < MAX_CHANNEL; i++) {
+        g_free(pki_applet_data->sign_buffer[i]);
+    }
     g_free(applet_private->tag_buffer);
     g_free(applet_private->val_buffer);
     g_free(applet_private->coids);
@@ -822,6 +1009,7 @@ cac_delete_passthrough_applet_private(VCardAppletPrivate *applet_private)
         return;
     }
     pt_applet_data = &(applet_private->u.pt_data);
+    vcard_cache_entry_delete(applet_private->cache);
     g_free(pt_applet_data->label);
     g_free(applet_private->tag_buffer);
     g_free(applet_private->val_buffer);
@@ -831,13 +1019,101 @@ cac_delete_passthrough_applet_private(VCardAppletPrivate *applet_private)
     g_free(applet_private);
 }
 
+/*
+ * report the memory used by the private data of the applets. The TAG and
+ * VALUE buffers can be evicted by the memory budget of the other cards, so
+ * they are looked at under the cache lock
+ */
+typedef struct CACMemUsageStruct {
+    VCardMemStats *stats;
+    VCardMemSubsystem val_subsystem;
+} CACMemUsage;
+
+static void
+cac_buffers_mem_usage(void *opaque, void *user_data)
+{
+    VCardAppletPrivate *applet_private = opaque;
+    CACMemUsage *usage = user_data;
+
+    if (applet_private->tag_buffer) {
+        vcard_mem_stats_add(usage->stats, VCARD_MEM_TLV,
+                            applet_private->tag_buffer_len);
+    }
+    if (applet_private->val_buffer) {
+        vcard_mem_stats_add(usage->stats, usage->val_subsystem,
+                            applet_private->val_buffer_len);
+    }
+}
+
+static void
+cac_common_mem_usage(VCardAppletPrivate *applet_private, VCardMemStats *stats,
+                     VCardMemSubsystem val_subsystem, bool own_properties)
+{
+    CACMemUsage usage = { stats, val_subsystem };
+
+    vcard_mem_stats_add(stats, VCARD_MEM_CARD, sizeof(VCardAppletPrivate));
+    if (applet_private->coids) {
+        vcard_mem_stats_add(stats, VCARD_MEM_CARD,
+                            applet_private->coids_len * sizeof(struct coid));
+    }
+    vcard_cache_entry_peek(applet_private->cache, applet_private,
+                           cac_buffers_mem_usage, &usage);
+    /* some of the applets use static properties */
+    if (own_properties && applet_private->properties) {
+        stats->subsystem[VCARD_MEM_TLV].bytes += simpletlv_mem_size(
+            applet_private->properties, applet_private->long_properties_len,
+            &stats->subsystem[VCARD_MEM_TLV].objects);
+    }
+}
+
+static void
+cac_pki_mem_usage(VCardAppletPrivate *applet_private, VCardMemStats *stats)
+{
+    CACPKIAppletData *pki_applet_data = &(applet_private->u.pki_data);
+    int i;
+
+    /* the VALUE buffer holds the certificate, the TAG buffer only its TLV */
+    cac_common_mem_usage(applet_private, stats, VCARD_MEM_CERT, TRUE);
+    for (i = 0; i < MAX_CHANNEL; i++) {
+        if (pki_applet_data->sign_buffer[i]) {
+            vcard_mem_stats_add(stats, VCARD_MEM_APDU,
+                                pki_applet_data->sign_buffer_len[i]);
+        }
+    }
+}
+
+static void
+cac_static_mem_usage(VCardAppletPrivate *applet_private, VCardMemStats *stats)
+{
+    cac_common_mem_usage(applet_private, stats, VCARD_MEM_TLV, FALSE);
+}
+
+static void
+cac_empty_mem_usage(VCardAppletPrivate *applet_private, VCardMemStats *stats)
+{
+    cac_common_mem_usage(applet_private, stats, VCARD_MEM_TLV, TRUE);
+}
+
+static void
+cac_passthrough_mem_usage(VCardAppletPrivate *applet_private,
+                          VCardMemStats *stats)
+{
+    CACPTAppletData *pt_applet_data = &(applet_private->u.pt_data);
+
+    cac_common_mem_usage(applet_private, stats, VCARD_MEM_TLV, TRUE);
+    if (pt_applet_data->label) {
+        vcard_mem_stats_add(stats, VCARD_MEM_CARD,
+                            strlen(pt_applet_data->label) + 1);
+    }
+}
+
 static VCardAppletPrivate *
 cac_new_pki_applet_private(int i, const unsigned char *cert,
                            int cert_len, VCardKey *key)
 {
     CACPKIAppletData *pki_applet_data = NULL;
     VCardAppletPrivate *applet_private = NULL;
-    int bits;
+    int bits, key_cert_len;
 
     /* PKI applet Properies ex.:
      * 01  Tag: Applet Information
@@ -912,74 +1188,13 @@ cac_new_pki_applet_private(int i, const unsigned char *cert,
       {0x3A, 0x07, {/*.child = aca_aid*/}, SIMPLETLV_TYPE_LEAF},
     };
     size_t properties_len = sizeof(properties)/sizeof(struct simpletlv_member);
-    /* if this would be 1, the certificate would be compressed */
-    unsigned char certinfo[] = "\x00";
-    struct simpletlv_member buffer[] = {
-        {CAC_PKI_TAG_CERTINFO, 1, {/*.value = certinfo*/},
-            SIMPLETLV_TYPE_LEAF},
-        {CAC_PKI_TAG_CERTIFICATE, cert_len, {/*.value = cert*/},
-            SIMPLETLV_TYPE_LEAF},
-        {CAC_PKI_TAG_MSCUID, 0, {/*.value = NULL*/}, SIMPLETLV_TYPE_LEAF},
-        {CAC_PKI_TAG_ERROR_DETECTION_CODE, 0, {/*.value = NULL*/},
-            SIMPLETLV_TYPE_LEAF},
-    };
-    size_t buffer_len = sizeof(buffer)/sizeof(struct simpletlv_member);
 
     applet_private = g_new0(VCardAppletPrivate, 1);
     pki_applet_data = &(applet_private->u.pki_data);
-    /*
-     * if we want to support compression, then we simply change the 0 to a 1
-     * in certinfo and compress the cert data with libz
-     */
-
-    /* prepare the buffers to when READ_BUFFER will be called.
-     * Assuming VM card with (LSB first if > 255)
-     * separate Tag+Length, Value buffers as described in 8.4:
-     *    2 B       1 B     1-3 B     1 B    1-3 B
-     * [ T-Len ] [ Tag1 ] [ Len1 ] [ Tag2] [ Len2 ] [...]
-     *
-     *    2 B       Len1 B      Len2 B
-     * [ V-Len ] [ Value 1 ] [ Value 2 ] [...]
-     * */
-
-    /* Tag+Len buffer */
-    buffer[0].value.value = certinfo;
-    buffer[1].value.value = (unsigned char *)cert;
-    buffer[2].value.value = NULL;
-    buffer[3].value.value = NULL;
-    /* Ex:
-     * 0A 00     Length of whole buffer
-     * 71        Tag: CertInfo
-     * 01        Length: 1B
-     * 70        Tag: Certificate
-     * FF B2 03  Length: (\x03 << 8) || \xB2
-     * 72        Tag: MSCUID
-     * 26        Length
-     */
-    applet_private->tag_buffer_len = cac_create_tl_file(buffer, buffer_len,
-        &applet_private->tag_buffer);
-    if (applet_private->tag_buffer_len == 0) {
-        goto failure;
-    }
-    g_debug("%s: applet_private->tag_buffer = %s", __func__,
-        hex_dump(applet_private->tag_buffer, applet_private->tag_buffer_len));
 
-    /* Value buffer */
-    /* Ex:
-     * DA 03      Length of complete buffer
-     * 01         Value of CertInfo
-     * 78 [..] 6C Cert Value
-     * 7B 63 37 35 62 62 61 64 61 2D 35 32 39 38 2D 31
-     * 37 35 62 2D 39 32 64 63 2D 39 38 35 30 36 62 65
-     * 30 30 30 30 30 7D          MSCUID Value
-     */
-    applet_private->val_buffer_len = cac_create_val_file(buffer, buffer_len,
-        &applet_private->val_buffer);
-    if (applet_private->val_buffer_len == 0) {
+    if (cac_pki_create_buffers(applet_private, cert, cert_len) < 0) {
         goto failure;
     }
-    g_debug("%s: applet_private->val_buffer = %s", __func__,
-        hex_dump(applet_private->val_buffer, applet_private->val_buffer_len));
 
     /* Inject Object ID */
     object_id[1] = i;
@@ -1019,6 +1234,13 @@ cac_new_pki_applet_private(int i, const unsigned char *cert,
         goto failure;
     }
     pki_applet_data->key = key;
+
+    /* The buffers can be rebuilt only if we have the certificate */
+    if (vcard_emul_get_cert(key, &key_cert_len) != NULL) {
+        applet_private->cache = vcard_cache_entry_new(cac_evict_buffers,
+                                                      applet_private);
+        cac_charge_buffers(applet_private);
+    }
     return applet_private;
 
 failure:
@@ -1776,6 +1998,7 @@ cac_new_ccc_applet(int cert_count)
     }
     vcard_set_applet_private(applet, applet_private,
                              cac_delete_ccc_applet_private);
+    vcard_set_applet_mem_usage(applet, cac_static_mem_usage);
     applet_private = NULL;
 
     return applet;
@@ -2081,6 +2304,10 @@ cac_new_passthrough_applet_private(G_GNUC_UNUSED VCard *card, const char *label,
     if (applet_private->properties == NULL)
         goto failure;
 
+    /* The data read from the token can be read again when needed */
+    applet_private->cache = vcard_cache_entry_new(cac_evict_buffers,
+                                                  applet_private);
+
     return applet_private;
 
 failure:
@@ -2110,6 +2337,7 @@ cac_new_aca_applet(int cert_count)
     }
     vcard_set_applet_private(applet, applet_private,
                              cac_delete_aca_applet_private);
+    vcard_set_applet_mem_usage(applet, cac_static_mem_usage);
     applet_private = NULL;
 
     return applet;
@@ -2149,6 +2377,8 @@ cac_new_pki_applet(int i, const unsigned char *cert,
     }
     vcard_set_applet_private(applet, applet_private,
                              cac_delete_pki_applet_private);
+    vcard_set_applet_mem_usage(applet, cac_pki_mem_usage);
+    vcard_set_applet_release(applet, cac_applet_release);
     applet_private = NULL;
 
     return applet;
@@ -2180,6 +2410,7 @@ cac_new_empty_applet(const unsigned char *aid, unsigned int aid_len,
 
     vcard_set_applet_private(applet, applet_private,
                              cac_delete_empty_applet_private);
+    vcard_set_applet_mem_usage(applet, cac_empty_mem_usage);
     applet_private = NULL;
 
     return applet;
@@ -2212,13 +2443,15 @@ cac_new_passthrough_applet(VCard *card, const char *label,
 
     vcard_set_applet_private(applet, applet_private,
                              cac_delete_passthrough_applet_private);
+    vcard_set_applet_mem_usage(applet, cac_passthrough_mem_usage);
+    vcard_set_applet_release(applet, cac_applet_release);
     applet_private = NULL;
 
     return applet;
 
 failure:
     if (applet_private != NULL) {
-        cac_delete_empty_applet_private(applet_private);
+        cac_delete_passthrough_applet_private(applet_private);
     }
     return NULL;
 }
@@ -15,6 +15,8 @@
 #include "capcsc.h"
 #include "vreader.h"
 #include "vevent.h"
+#include "vcard_lock_internal.h"
+#include "vcardt_internal.h"
 
 #include <PCSC/wintypes.h>
 #include <PCSC/winscard.h>
@@ -24,7 +26,7 @@ typedef struct _PCSCContext PCSCContext;
 
 typedef struct {
     PCSCContext *context;
-    int index;
+    int index;              /* in context->readers and context->states */
     char *name;
     DWORD protocol;
     DWORD state;
@@ -33,73 +35,160 @@ typedef struct {
     DWORD atrlen;
     int card_connected;
     unsigned long request_count;
+    guint64 scan;           /* last scan which listed the reader */
+    /* card state seen by the event thread, applied by the card worker */
+    int card_present;
+    BYTE card_atr[MAX_ATR_SIZE];
+    DWORD card_atrlen;
+    guint64 card_changes;
+    int worker_busy;
+    int deleted;            /* freed by the worker when it is done */
+    int has_vreader;        /* its vreader was not freed yet */
+    int removing;           /* freed by scan_for_readers() when it is done */
+    /* sharing the card with other processes, see send_receive_shared() */
+    VCardLock share_lock;   /* held while exchanging with the card */
+    int in_transaction;
+    int chaining;           /* the card expects the rest of a chain */
+    int verified;           /* a VERIFY succeeded in this transaction */
+    gint64 transaction_start;
+    gint64 last_apdu;
+    gint64 yield_until;
+    BYTE select[5 + 255];   /* last SELECT by AID of the guest */
+    DWORD select_len;
 } SCardReader;
 
+/*
+ * The readers are tracked in three structures, all protected by the lock:
+ * the readers array, an index by name, and the SCARD_READERSTATE array given
+ * to SCardGetStatusChange(), which has the state of readers[i] at index i,
+ * followed by the PnP notification entry. The state array is only changed
+ * by the event thread, so it can be used without the lock while waiting for
+ * the changes; readers are appended to it, and a deleted reader is replaced
+ * by the last one, so the other entries keep their current state.
+ */
 typedef struct _PCSCContext {
     SCARDCONTEXT context;
-    SCardReader readers[CAPCSC_MAX_READERS];
-    int reader_count;
+    GPtrArray *readers;         /* SCardReader */
+    GHashTable *reader_names;   /* name -> SCardReader */
+    GArray *states;             /* SCARD_READERSTATE */
+    GPtrArray *deleted;         /* deleted readers, still in the arrays */
+    guint64 scan;
     int readers_changed;
     GThread *thread;
-    GMutex lock;
+    GThreadPool *workers;       /* connect and insert or remove the cards */
+    int t0_local;               /* resolve 61xx and 6Cxx of T=0 cards here */
+    int share;                  /* use transactions, the card is shared */
+    VCardLock lock;
 } PCSCContext;
 
+static void card_worker(gpointer data, gpointer user_data);
 
-static void delete_reader(PCSCContext *pc, int i)
+/*
+ * Take the reader out of the arrays and the index. Called from the event
+ * thread, with the lock held.
+ */
+static void detach_reader(PCSCContext *pc, SCardReader *r)
 {
-    SCardReader *r = &pc->readers[i];
-    g_free(r->name);
-    r->name = NULL;
+    guint n = pc->readers->len;
+    guint i = r->index;
+
+    g_ptr_array_remove_index_fast(pc->readers, i);
+    if (i != n - 1) {
+        SCardReader *last = g_ptr_array_index(pc->readers, i);
 
-    if (i < (pc->reader_count - 1)) {
-        int rem = pc->reader_count - i - 1;
-        memmove(&pc->readers[i], &pc->readers[i + 1],
-                sizeof(SCardReader) * rem);
+        last->index = i;
+        g_array_index(pc->states, SCARD_READERSTATE, i) =
+            g_array_index(pc->states, SCARD_READERSTATE, n - 1);
     }
+    /* the PnP notification entry moves down */
+    g_array_index(pc->states, SCARD_READERSTATE, n - 1) =
+        g_array_index(pc->states, SCARD_READERSTATE, n);
+    g_array_set_size(pc->states, n);
 
-    pc->reader_count--;
+    if (g_hash_table_lookup(pc->reader_names, r->name) == r) {
+        g_hash_table_remove(pc->reader_names, r->name);
+    }
+    r->index = -1;
 }
 
+/* called with the lock held */
+static void delete_reader(SCardReader *r)
+{
+    if (r->worker_busy) {
+        r->deleted = 1;
+        return;
+    }
+    vcard_lock_clear(&r->share_lock);
+    g_free(r->name);
+    g_free(r);
+}
+
+static void flush_deleted_readers(PCSCContext *pc)
+{
+    guint i;
+
+    for (i = 0; i < pc->deleted->len; i++) {
+        SCardReader *r = g_ptr_array_index(pc->deleted, i);
+
+        detach_reader(pc, r);
+        delete_reader(r);
+    }
+    g_ptr_array_set_size(pc->deleted, 0);
+}
+
+/*
+ * The vreader can be freed from any thread. A reader still in the state
+ * array is only queued here, the event thread takes it out and frees it.
+ */
 static void delete_reader_cb(VReaderEmul *ve)
 {
     SCardReader *r = (SCardReader *) ve;
+    PCSCContext *pc = r->context;
 
-    g_mutex_lock(&r->context->lock);
-    delete_reader(r->context, r->index);
-    g_mutex_unlock(&r->context->lock);
+    vcard_lock_lock(&pc->lock);
+    r->has_vreader = 0;
+    if (r->index < 0) {
+        if (!r->removing) {
+            delete_reader(r);
+        }
+    } else {
+        g_ptr_array_add(pc->deleted, r);
+        pc->readers_changed = 1;
+    }
+    vcard_lock_unlock(&pc->lock);
 }
 
-static int new_reader(PCSCContext *pc, const char *name, G_GNUC_UNUSED DWORD state)
+static SCardReader *new_reader(PCSCContext *pc, const char *name)
 {
+    SCARD_READERSTATE state;
     SCardReader *r;
     VReader *vreader;
 
-    if (pc->reader_count >= CAPCSC_MAX_READERS - 1) {
-        return 1;
-    }
-
-    r = &pc->readers[pc->reader_count];
-    memset(r, 0, sizeof(*r));
-    r->index = pc->reader_count++;
+    r = g_new0(SCardReader, 1);
+    r->index = pc->readers->len;
     r->context = pc;
     r->name = g_strdup(name);
+    r->has_vreader = 1;
+    vcard_lock_init(&r->share_lock, "pcsc-share");
+    g_ptr_array_add(pc->readers, r);
+    g_hash_table_insert(pc->reader_names, r->name, r);
+
+    /* before the PnP notification entry */
+    memset(&state, 0, sizeof(state));
+    state.szReader = r->name;
+    state.dwCurrentState = SCARD_STATE_UNAWARE;
+    g_array_insert_val(pc->states, r->index, state);
 
     vreader = vreader_new(name, (VReaderEmul *) r, delete_reader_cb);
     vreader_add_reader(vreader);
     vreader_free(vreader);
 
-    return 0;
+    return r;
 }
 
-static int find_reader(PCSCContext *pc, const char *name)
+static SCardReader *find_reader(PCSCContext *pc, const char *name)
 {
-    int i;
-    for (i = 0; i < pc->reader_count; i++)
-        if (strcmp(pc->readers[i].name, name) == 0) {
-            return i;
-        }
-
-    return -1;
+    return g_hash_table_lookup(pc->reader_names, name);
 }
 
 
@@ -107,18 +196,19 @@ static int scan_for_readers(PCSCContext *pc)
 {
     LONG rc;
 
-    int i;
-    char buf[8192];
-    DWORD buflen = sizeof(buf);
+    guint i;
+    char *buf = NULL;
+    DWORD buflen = SCARD_AUTOALLOCATE;
 
     char *p;
-    int matches[CAPCSC_MAX_READERS] = { 0, };
+    GPtrArray *gone = g_ptr_array_new();
 
-    g_mutex_lock(&pc->lock);
+    vcard_lock_lock(&pc->lock);
 
+    flush_deleted_readers(pc);
     pc->readers_changed = 1;
-    memset(buf, 0, sizeof(buf));
-    rc = SCardListReaders(pc->context, NULL, buf, &buflen);
+    pc->scan++;
+    rc = SCardListReaders(pc->context, NULL, (LPSTR) &buf, &buflen);
     if (rc == SCARD_E_NO_READERS_AVAILABLE) {
         rc = 0;
         goto exit;
@@ -127,47 +217,76 @@ static int scan_for_readers(PCSCContext *pc)
     if (rc != SCARD_S_SUCCESS) {
         fprintf(stderr, "SCardListReaders failed: %s (0x%lX)\n",
             pcsc_stringify_error(rc), rc);
-        goto exit;
+        /* keep the readers we know of */
+        vcard_lock_unlock(&pc->lock);
+        g_ptr_array_free(gone, TRUE);
+        return rc;
     }
 
-    for (p = buf; p && p < buf + sizeof(buf); p += (strlen(p) + 1)) {
-        if (strlen(p) > 0) {
-            i = find_reader(pc, p);
-            if (i >= 0) {
-                matches[i]++;
-            } else {
-                if (!new_reader(pc, p, SCARD_STATE_UNAWARE)) {
-                    matches[pc->reader_count - 1]++;
-                }
-            }
+    for (p = buf; p && p < buf + buflen && *p; p += (strlen(p) + 1)) {
+        SCardReader *r = find_reader(pc, p);
+
+        if (r == NULL) {
+            r = new_reader(pc, p);
         }
+        r->scan = pc->scan;
     }
+    SCardFreeMemory(pc->context, buf);
 
     rc = 0;
 
 exit:
-    i = pc->reader_count - 1;
-    g_mutex_unlock(&pc->lock);
-
-    for (; i >= 0; i--) {
-        if (!matches[i]) {
-            VReader *reader = vreader_get_reader_by_name(pc->readers[i].name);
-            if (reader) {
-                vreader_free(reader);
-                vreader_remove_reader(reader);
-            }
+    /* the readers which went away leave the state array right away, their
+       vreaders may live a bit longer */
+    for (i = pc->readers->len; i-- > 0; ) {
+        SCardReader *r = g_ptr_array_index(pc->readers, i);
+
+        if (r->scan != pc->scan) {
+            r->removing = 1;
+            g_ptr_array_add(gone, r);
+            detach_reader(pc, r);
         }
     }
+    vcard_lock_unlock(&pc->lock);
+
+    for (i = 0; i < gone->len; i++) {
+        SCardReader *r = g_ptr_array_index(gone, i);
+        VReader *reader = vreader_get_reader_by_name(r->name);
 
+        if (reader) {
+            vreader_free(reader);
+            vreader_remove_reader(reader);
+        }
+        /* without a vreader left, nothing else frees the reader */
+        vcard_lock_lock(&pc->lock);
+        r->removing = 0;
+        if (!r->has_vreader) {
+            delete_reader(r);
+        }
+        vcard_lock_unlock(&pc->lock);
+    }
+    g_ptr_array_free(gone, TRUE);
 
     return rc;
 }
 
 static int init_pcsc(PCSCContext *pc)
 {
+    SCARD_READERSTATE *pnp;
     LONG rc;
 
     memset(pc, 0, sizeof(*pc));
+    vcard_lock_init(&pc->lock, "pcsc");
+    pc->readers = g_ptr_array_new();
+    pc->reader_names = g_hash_table_new(g_str_hash, g_str_equal);
+    pc->deleted = g_ptr_array_new();
+
+    /* Leave a space to be notified of new readers */
+    pc->states = g_array_sized_new(FALSE, TRUE, sizeof(SCARD_READERSTATE), 16);
+    g_array_set_size(pc->states, 1);
+    pnp = &g_array_index(pc->states, SCARD_READERSTATE, 0);
+    pnp->szReader = "\\\\?PnP?\\Notification";
+    pnp->dwCurrentState = SCARD_STATE_UNAWARE;
 
     rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &pc->context);
     if (rc != SCARD_S_SUCCESS) {
@@ -176,34 +295,13 @@ static int init_pcsc(PCSCContext *pc)
         return rc;
     }
 
-    return 0;
-}
-
-
-static void prepare_reader_states(PCSCContext *pc, SCARD_READERSTATE **states,
-                                  DWORD *reader_count)
-{
-    SCARD_READERSTATE *state;
-    int i;
-
-    if (*states) {
-        g_free(*states);
-    }
-
-    *reader_count = pc->reader_count;
-
-    (*reader_count)++;
-    *states = g_malloc((*reader_count) * sizeof(**states));
-    memset(*states, 0, sizeof((*reader_count) * sizeof(**states)));
-
-    for (i = 0, state = *states; i < pc->reader_count; i++, state++) {
-        state->szReader = pc->readers[i].name;
-        state->dwCurrentState = pc->readers[i].state;
+    /* no limit on the threads, a slow card must not delay the others */
+    pc->workers = g_thread_pool_new(card_worker, pc, -1, FALSE, NULL);
+    if (pc->workers == NULL) {
+        return 1;
     }
 
-    /* Leave a space to be notified of new readers */
-    state->szReader = "\\\\?PnP?\\Notification";
-    state->dwCurrentState = SCARD_STATE_UNAWARE;
+    return 0;
 }
 
 static int connect_card(SCardReader *r)
@@ -260,6 +358,236 @@ static LONG send_receive(SCardReader *r, BYTE *transmit, DWORD transmit_len,
     return 0;
 }
 
+/*
+ * With a T=0 card, the card answers 61xx when it has a response waiting for
+ * a GET RESPONSE, and 6Cxx when Le is not the length of the response. The
+ * guest would send the follow-up command through the whole stack again; this
+ * sends it right away and returns the assembled response, up to a short APDU
+ * response. What does not fit is left for the guest to fetch with 61xx.
+ */
+static LONG send_receive_t0(SCardReader *r, BYTE *transmit, DWORD transmit_len,
+                            BYTE *receive, DWORD *receive_len)
+{
+    BYTE command[5];
+    BYTE *cmd = transmit;
+    DWORD cmd_len = transmit_len;
+    DWORD size = *receive_len;
+    DWORD total = 0;
+    DWORD len;
+    int resent = 0;
+    int exchanges = 0;
+    LONG rc;
+
+    for (;;) {
+        BYTE sw1, sw2;
+
+        len = size - total;
+        rc = send_receive(r, cmd, cmd_len, receive + total, &len);
+        if (rc || len < 2) {
+            break;
+        }
+        sw1 = receive[total + len - 2];
+        sw2 = receive[total + len - 1];
+        exchanges++;
+
+        if (sw1 == 0x6C && cmd_len == 5 && cmd[4] != sw2 && !resent) {
+            /* send the command again, with the Le of the card */
+            memcpy(command, cmd, 5);
+            command[4] = sw2;
+            cmd = command;
+            resent = 1;
+            continue;
+        }
+        if (sw1 == 0x61 && exchanges < 16) {
+            DWORD data_len = total + len - 2;
+            DWORD next = sw2 ? sw2 : 256;
+
+            if (data_len + next <= CAPCSC_T0_MAX_RESPONSE &&
+                data_len + next + 2 <= size) {
+                /* GET RESPONSE on the logical channel of the command */
+                command[0] = (transmit[0] & 0x40) ?
+                    0x40 | (transmit[0] & 0x0F) : transmit[0] & 0x03;
+                command[1] = 0xC0;
+                command[2] = 0x00;
+                command[3] = 0x00;
+                command[4] = sw2;
+                cmd = command;
+                cmd_len = 5;
+                resent = 0;
+                total = data_len;
+                continue;
+            }
+        }
+        break;
+    }
+
+    if (exchanges > 1) {
+        g_debug("%s: %d exchanges with the card for one APDU", __func__,
+                exchanges);
+    }
+    *receive_len = total + len;
+    return rc;
+}
+
+static LONG send_receive_guest(SCardReader *r, BYTE *transmit,
+                               DWORD transmit_len, BYTE *receive,
+                               DWORD *receive_len)
+{
+    if (r->context->t0_local && r->protocol == SCARD_PROTOCOL_T0) {
+        return send_receive_t0(r, transmit, transmit_len, receive, receive_len);
+    }
+    return send_receive(r, transmit, transmit_len, receive, receive_len);
+}
+
+/*
+ * With hw_params=share, the card is used by the guests of several processes
+ * (one vscclient per VM, for example), each connected to it in shared mode.
+ * The exchanges of the guest are grouped in PC/SC transactions, so that the
+ * others can not come in between: a transaction starts with the first APDU
+ * and ends when the guest is idle for CAPCSC_SHARE_IDLE, or once it had the
+ * card for CAPCSC_SHARE_QUANTUM, after which it lets the others in for
+ * CAPCSC_SHARE_YIELD. A transaction never ends in the middle of a command or
+ * response chain. Since another guest may have selected another applet
+ * meanwhile, the last SELECT by AID of the guest is sent again at the start
+ * of every transaction. The security status is not restored that way: a
+ * transaction in which the guest verified a PIN ends with a reset of the
+ * card, so that the other processes never get it logged in, and the guest
+ * has to verify the PIN again in its next transaction.
+ *
+ * Called with the share lock held.
+ */
+static LONG share_begin(SCardReader *r)
+{
+    gint64 now = g_get_monotonic_time();
+    LONG rc;
+
+    if (now < r->yield_until) {
+        g_usleep(r->yield_until - now);
+    }
+    if (!r->card_connected) {
+        rc = connect_card(r);
+        if (rc) {
+            return rc;
+        }
+    }
+
+    rc = SCardBeginTransaction(r->card);
+    if (rc == SCARD_W_RESET_CARD) {
+        /* another process reset the card, which is fine, the applet is
+           selected again below */
+        rc = SCardReconnect(r->card, SCARD_SHARE_SHARED,
+                            SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
+                            SCARD_LEAVE_CARD, &r->protocol);
+        if (rc == SCARD_S_SUCCESS) {
+            rc = SCardBeginTransaction(r->card);
+        }
+    }
+    if (rc != SCARD_S_SUCCESS) {
+        fprintf(stderr, "Failed to begin a transaction: %s (0x%lX)\n",
+            pcsc_stringify_error(rc), rc);
+        return rc;
+    }
+    r->in_transaction = 1;
+    r->transaction_start = g_get_monotonic_time();
+
+    if (r->select_len > 0) {
+        BYTE outbuf[258];
+        DWORD outlen = sizeof(outbuf);
+
+        rc = send_receive(r, r->select, r->select_len, outbuf, &outlen);
+        if (rc == 0 && outlen >= 2 && outbuf[outlen - 2] != 0x90 &&
+            outbuf[outlen - 2] != 0x61) {
+            g_debug("%s: %s: applet not selected again: %02X%02X", __func__,
+                    r->name, outbuf[outlen - 2], outbuf[outlen - 1]);
+        }
+    }
+    return 0;
+}
+
+/* called with the share lock held */
+static void share_end(SCardReader *r)
+{
+    LONG rc;
+
+    rc = SCardEndTransaction(r->card,
+                             r->verified ? SCARD_RESET_CARD : SCARD_LEAVE_CARD);
+    if (rc != SCARD_S_SUCCESS) {
+        fprintf(stderr, "Non fatal info:"
+                        "failed to end a transaction: %s (0x%lX)\n",
+            pcsc_stringify_error(rc), rc);
+    }
+    r->in_transaction = 0;
+    r->verified = 0;
+}
+
+static LONG send_receive_shared(SCardReader *r, BYTE *transmit,
+                                DWORD transmit_len, BYTE *receive,
+                                DWORD *receive_len)
+{
+    gint64 now;
+    BYTE sw1;
+    LONG rc;
+
+    vcard_lock_lock(&r->share_lock);
+    if (!r->in_transaction) {
+        rc = share_begin(r);
+        if (rc) {
+            vcard_lock_unlock(&r->share_lock);
+            return rc;
+        }
+    }
+
+    rc = send_receive_guest(r, transmit, transmit_len, receive, receive_len);
+    if (rc || *receive_len < 2) {
+        vcard_lock_unlock(&r->share_lock);
+        return rc;
+    }
+    sw1 = receive[*receive_len - 2];
+
+    /* SELECT by AID on the basic channel */
+    if (transmit_len >= 5 && transmit_len <= sizeof(r->select) &&
+        (transmit[0] & 0x43) == 0 && transmit[1] == 0xA4 &&
+        transmit[2] == 0x04 && (sw1 == 0x90 || sw1 == 0x61)) {
+        memcpy(r->select, transmit, transmit_len);
+        r->select_len = transmit_len;
+    }
+    /* the card now holds the PIN verified by the guest */
+    if (transmit_len >= 4 && transmit[1] == 0x20 && sw1 == 0x90) {
+        r->verified = 1;
+    }
+    /* a response waiting for GET RESPONSE, or command chaining */
+    r->chaining = sw1 == 0x61 || (transmit[0] & 0x90) == 0x10;
+
+    now = g_get_monotonic_time();
+    r->last_apdu = now;
+    if (!r->chaining &&
+        now - r->transaction_start >= CAPCSC_SHARE_QUANTUM * 1000) {
+        share_end(r);
+        r->yield_until = now + CAPCSC_SHARE_YIELD * 1000;
+    }
+    vcard_lock_unlock(&r->share_lock);
+    return rc;
+}
+
+/*
+ * Called from the event thread, which must not wait for the guest, with the
+ * context lock held.
+ */
+static void share_check_idle(SCardReader *r)
+{
+    gint64 idle;
+
+    if (!vcard_lock_trylock(&r->share_lock)) {
+        return;
+    }
+    idle = g_get_monotonic_time() - r->last_apdu;
+    /* a guest which leaves a chain unfinished does not keep the card */
+    if (r->in_transaction && idle >= CAPCSC_SHARE_IDLE * 1000 &&
+        (!r->chaining || idle >= CAPCSC_SHARE_QUANTUM * 1000)) {
+        share_end(r);
+    }
+    vcard_lock_unlock(&r->share_lock);
+}
 
 static VCardStatus apdu_cb(VCard *card, VCardAPDU *apdu,
                            VCardResponse **response)
@@ -270,7 +598,13 @@ static VCardStatus apdu_cb(VCard *card, VCardAPDU *apdu,
     DWORD outlen = sizeof(outbuf);
     LONG rc;
 
-    rc = send_receive(r, apdu->a_data, apdu->a_len, outbuf, &outlen);
+    if (r->context->share) {
+        rc = send_receive_shared(r, apdu->a_data, apdu->a_len,
+                                 outbuf, &outlen);
+    } else {
+        rc = send_receive_guest(r, apdu->a_data, apdu->a_len,
+                                outbuf, &outlen);
+    }
     if (rc || outlen < 2) {
         ret = VCARD_FAIL;
     } else {
@@ -290,6 +624,19 @@ static VCardStatus reset_cb(VCard *card, G_GNUC_UNUSED int channel)
     SCardReader *r = (SCardReader *) vcard_get_private(card);
     LONG rc;
 
+    /* resetting a shared card would reset it for the other guests as well,
+       only the applet of this guest is forgotten, and its PIN by ending a
+       transaction in which it was verified */
+    if (r->context->share) {
+        vcard_lock_lock(&r->share_lock);
+        r->select_len = 0;
+        if (r->in_transaction && r->verified) {
+            share_end(r);
+        }
+        vcard_lock_unlock(&r->share_lock);
+        return VCARD_DONE;
+    }
+
     /* vreader_power_on is a bit too free with it's resets.
        And a reconnect is expensive; as much as 10-20 seconds.
        Hence, we discard any initial reconnect request. */
@@ -322,14 +669,14 @@ static void delete_card_cb(G_GNUC_UNUSED VCardEmul *ve)
     fprintf(stderr, "TODO, got a delete_card_cb\n");
 }
 
-static void insert_card(SCardReader *r, SCARD_READERSTATE *s)
+static void insert_card(SCardReader *r, const BYTE *atr, DWORD atrlen)
 {
     VReader *reader;
     VCardApplet *applet;
     VCard *card;
 
-    memcpy(r->atr, s->rgbAtr, MIN(sizeof(r->atr), sizeof(s->rgbAtr)));
-    r->atrlen = s->cbAtr;
+    memcpy(r->atr, atr, atrlen);
+    r->atrlen = atrlen;
 
     reader = vreader_get_reader_by_name(r->name);
     if (!reader) {
@@ -337,6 +684,7 @@ static void insert_card(SCardReader *r, SCARD_READERSTATE *s)
     }
 
     if (connect_card(r)) {
+        vreader_free(reader);
         return;
     }
 
@@ -346,6 +694,7 @@ static void insert_card(SCardReader *r, SCARD_READERSTATE *s)
                          (const unsigned char *)CAPCSC_APPLET,
                          strlen(CAPCSC_APPLET));
     if (!applet) {
+        vreader_free(reader);
         return;
     }
 
@@ -372,6 +721,14 @@ static void remove_card(SCardReader *r)
     memset(r->atr, 0, sizeof(r->atr));
     r->atrlen = 0;
 
+    /* the transaction ends with the connection */
+    vcard_lock_lock(&r->share_lock);
+    r->in_transaction = 0;
+    r->chaining = 0;
+    r->verified = 0;
+    r->select_len = 0;
+    vcard_lock_unlock(&r->share_lock);
+
     rc = SCardDisconnect(r->card, SCARD_LEAVE_CARD);
     if (rc != SCARD_S_SUCCESS) {
         fprintf(stderr, "Non fatal info:"
@@ -389,18 +746,77 @@ static void remove_card(SCardReader *r)
     vreader_free(reader);
 }
 
+/*
+ * Connecting a card and building its VCard can take seconds, so it is done by
+ * a card worker for each reader, off the event thread. There is at most one
+ * worker per reader at a time, which applies the last state recorded by the
+ * event thread until it is up to date; the state changes in between are
+ * merged.
+ */
+static void card_worker(gpointer data, gpointer user_data)
+{
+    SCardReader *r = (SCardReader *) data;
+    PCSCContext *pc = (PCSCContext *) user_data;
+    guint64 done = 0;
+
+    vcard_lock_lock(&pc->lock);
+    while (!r->deleted && done != r->card_changes) {
+        int present = r->card_present;
+        BYTE atr[MAX_ATR_SIZE];
+        DWORD atrlen = r->card_atrlen;
+
+        memcpy(atr, r->card_atr, atrlen);
+        done = r->card_changes;
+        vcard_lock_unlock(&pc->lock);
+
+        if (r->card_connected) {
+            remove_card(r);
+        }
+        if (present) {
+            insert_card(r, atr, atrlen);
+        }
+
+        vcard_lock_lock(&pc->lock);
+    }
+    r->worker_busy = 0;
+    if (r->deleted) {
+        delete_reader(r);
+    }
+    vcard_lock_unlock(&pc->lock);
+}
+
+/* called from the event thread, with the lock held */
 static void process_reader_change(SCardReader *r, SCARD_READERSTATE *s)
 {
+    DWORD atrlen = MIN(s->cbAtr, sizeof(r->card_atr));
+    DWORD state = r->state;
+
+    r->state = s->dwEventState & ~SCARD_STATE_CHANGED;
     if (s->dwEventState & SCARD_STATE_PRESENT) {
-        insert_card(r, s);
+        /* only the other flags changed, like SCARD_STATE_INUSE */
+        if (r->card_present && r->card_atrlen == atrlen &&
+            memcmp(r->card_atr, s->rgbAtr, atrlen) == 0) {
+            return;
+        }
+        r->card_present = 1;
+        r->card_atrlen = atrlen;
+        memcpy(r->card_atr, s->rgbAtr, atrlen);
     } else if (s->dwEventState & SCARD_STATE_EMPTY) {
-        remove_card(r);
+        if (!r->card_present) {
+            return;
+        }
+        r->card_present = 0;
     } else {
         fprintf(stderr, "Unexpected card state change from %lx to %lx:\n",
-                        r->state, s->dwEventState);
+                        state, s->dwEventState);
+        return;
     }
 
-    r->state = s->dwEventState & ~SCARD_STATE_CHANGED;
+    r->card_changes++;
+    if (!r->worker_busy) {
+        r->worker_busy = 1;
+        g_thread_pool_push(r->context->workers, r, NULL);
+    }
 }
 
 /*
@@ -410,35 +826,38 @@ static void process_reader_change(SCardReader *r, SCARD_READERSTATE *s)
 static gpointer event_thread(gpointer arg)
 {
     PCSCContext *pc = (PCSCContext *) arg;
-    DWORD reader_count = 0;
-    SCARD_READERSTATE *reader_states = NULL;
     LONG rc;
 
     scan_for_readers(pc);
 
     do {
+        SCARD_READERSTATE *reader_states, *pnp;
+        DWORD reader_count;
         DWORD i;
         DWORD timeout = INFINITE;
 
-        g_mutex_lock(&pc->lock);
-        if (pc->readers_changed) {
-            prepare_reader_states(pc, &reader_states, &reader_count);
-            timeout = 0;
-        } else if (reader_count > 1) {
+        vcard_lock_lock(&pc->lock);
+        flush_deleted_readers(pc);
+        if (pc->readers_changed || pc->readers->len > 0) {
             timeout = 0;
         }
-
         pc->readers_changed = 0;
-        g_mutex_unlock(&pc->lock);
+        reader_states = (SCARD_READERSTATE *) pc->states->data;
+        reader_count = pc->states->len;
+        vcard_lock_unlock(&pc->lock);
 
         rc = SCardGetStatusChange(pc->context, timeout, reader_states,
                                   reader_count);
 
         /* If we have a new reader, or an unknown reader,
            rescan and go back and do it again */
-        if ((rc == SCARD_S_SUCCESS && (reader_states[reader_count - 1].dwEventState & SCARD_STATE_CHANGED))
+        pnp = &reader_states[reader_count - 1];
+        if ((rc == SCARD_S_SUCCESS && (pnp->dwEventState & SCARD_STATE_CHANGED))
                       ||
              rc == SCARD_E_UNKNOWN_READER) {
+            if (rc == SCARD_S_SUCCESS) {
+                pnp->dwCurrentState = pnp->dwEventState & ~SCARD_STATE_CHANGED;
+            }
             scan_for_readers(pc);
             continue;
         }
@@ -449,16 +868,24 @@ static gpointer event_thread(gpointer arg)
             continue;
         }
 
-        g_mutex_lock(&pc->lock);
+        vcard_lock_lock(&pc->lock);
 
-        for (i = 0; i < reader_count; i++) {
+        for (i = 0; i < reader_count - 1; i++) {
             if (reader_states[i].dwEventState & SCARD_STATE_CHANGED) {
-                process_reader_change(&pc->readers[i], &reader_states[i]);
+                SCardReader *r = g_ptr_array_index(pc->readers, i);
+
+                process_reader_change(r, &reader_states[i]);
+                reader_states[i].dwCurrentState = r->state;
                 pc->readers_changed++;
             }
 
         }
-        g_mutex_unlock(&pc->lock);
+        if (pc->share) {
+            for (i = 0; i < pc->readers->len; i++) {
+                share_check_idle(g_ptr_array_index(pc->readers, i));
+            }
+        }
+        vcard_lock_unlock(&pc->lock);
 
         /* libpcsclite is only thread safe at a high level.  If we constantly
            hold long calls into SCardGetStatusChange, we'll starve any running
@@ -486,15 +913,15 @@ static int new_event_thread(PCSCContext *pc)
 
 static PCSCContext context;
 
-int capcsc_init(void)
+int capcsc_init(const char *params)
 {
     g_debug("%s: called", __func__);
 
-    g_mutex_init(&context.lock);
-
     if (init_pcsc(&context)) {
         return -1;
     }
+    context.t0_local = vcard_params_has_flag(params, "t0_local");
+    context.share = vcard_params_has_flag(params, "share");
 
     if (new_event_thread(&context)) {
         return -1;
@@ -8,11 +8,22 @@
 #define CAPCSC_POLL_TIME            50      /* ms  - Time we will poll for */
                                             /*       card change when a    */
                                             /*       reader is connected */
-#define CAPCSC_MAX_READERS          16
 
 #define CAPCSC_APPLET               "CAPCSC APPLET"
 
-int capcsc_init(void);
+/* Sharing the card with other processes (hw_params=share) */
+#define CAPCSC_SHARE_IDLE           50      /* ms  - Idle time after which */
+                                            /*       the card is released */
+#define CAPCSC_SHARE_QUANTUM        500     /* ms  - Longest a guest keeps */
+                                            /*       the card in a row */
+#define CAPCSC_SHARE_YIELD          150     /* ms  - Pause after a full */
+                                            /*       quantum, longer than */
+                                            /*       the pcsc-lite lock poll */
+
+/* Largest response assembled from the GET RESPONSEs of a T=0 card */
+#define CAPCSC_T0_MAX_RESPONSE      256
+
+int capcsc_init(const char *params);
 
 
 #endif
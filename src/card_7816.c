@@ -13,6 +13,9 @@
 #include "vcard_emul.h"
 #include "card_7816.h"
 #include "common.h"
+#include "piv.h"
+#include "vcardt_internal.h"
+#include "vcard_lookup.h"
 
 
 /* Global Platform Card Manager applet AID */
@@ -24,6 +27,11 @@ static const unsigned char gp_response[] = {
     0x03, 0x00, 0x00, 0x00, 0xA5, 0x0D, 0x9F, 0x6E,
     0x06, 0x12, 0x91, 0x51, 0x81, 0x01, 0x00, 0x9F,
     0x65, 0x01, 0xFF};
+/* PIV Application Property Template returned on select applet */
+static const unsigned char piv_response[] = {
+    0x61, 0x11, 0x4F, 0x06, 0x00, 0x00, 0x10, 0x00,
+    0x01, 0x00, 0x79, 0x07, 0x4F, 0x05, 0xA0, 0x00,
+    0x00, 0x03, 0x08};
 
 
 /*
@@ -75,28 +83,50 @@ vcard_response_new_data(const unsigned char *buf, int len)
     return new_response;
 }
 
+/*
+ * The 61 xx response of a long response carries the response buffer, which
+ * vcard_process_apdu() hands to the channel the APDU came from. The buffer is
+ * kept in this private wrapper, so that VCardResponse keeps its public layout;
+ * the status bytes are in the wrapper too, which tells it from the other
+ * status responses, whose b_data points to their b_sw1.
+ */
+typedef struct {
+    VCardResponse response;
+    unsigned char sw[2];
+    VCardBufferResponse *buffer;
+} VCardLongResponse;
+
 static VCardResponse *
-vcard_init_buffer_response(VCard *card, const unsigned char *buf, int len)
+vcard_init_buffer_response(const unsigned char *buf, int len)
 {
-    VCardResponse *response;
+    VCardLongResponse *long_response;
     VCardBufferResponse *buffer_response;
 
-    buffer_response = vcard_get_buffer_response(card);
-    if (buffer_response) {
-        vcard_set_buffer_response(card, NULL);
-        vcard_buffer_response_delete(buffer_response);
-    }
     buffer_response = vcard_buffer_response_new(buf, len);
     if (buffer_response == NULL) {
         return NULL;
     }
-    response = vcard_response_new_status_bytes(VCARD7816_SW1_RESPONSE_BYTES,
-                                               len > 255 ? 0 : len);
-    if (response == NULL) {
+    long_response = g_new(VCardLongResponse, 1);
+    long_response->response.b_data = long_response->sw;
+    long_response->response.b_len = 0;
+    long_response->response.b_total_len = 2;
+    long_response->response.b_type = VCARD_MALLOC_STRUCT;
+    long_response->buffer = buffer_response;
+    vcard_response_set_status_bytes(&long_response->response,
+                                    VCARD7816_SW1_RESPONSE_BYTES,
+                                    len > 255 ? 0 : len);
+    return &long_response->response;
+}
+
+/* the response buffer of a long response, NULL for any other response */
+static VCardBufferResponse **
+vcard_response_get_buffer(VCardResponse *response)
+{
+    if (response->b_type != VCARD_MALLOC_STRUCT ||
+        response->b_data == &response->b_sw1) {
         return NULL;
     }
-    vcard_set_buffer_response(card, buffer_response);
-    return response;
+    return &((VCardLongResponse *)response)->buffer;
 }
 
 /*
@@ -110,7 +140,7 @@ vcard_response_new(VCard *card, const unsigned char *buf,
 
     g_debug("%s: Sending response (len = %d, Le = %d)", __func__, len, Le);
     if (len > Le) {
-        return vcard_init_buffer_response(card, buf, len);
+        return vcard_init_buffer_response(buf, len);
     }
     new_response = vcard_response_new_data(buf, len);
     if (new_response == NULL) {
@@ -131,7 +161,7 @@ vcard_response_new_bytes(VCard *card, unsigned char *buf, int len, int Le,
 
     g_debug("%s: Sending response (len = %d, Le = %d)", __func__, len, Le);
     if (len > Le) {
-        return vcard_init_buffer_response(card, buf, len);
+        return vcard_init_buffer_response(buf, len);
     }
     new_response = vcard_response_new_data(buf, len);
     if (new_response == NULL) {
@@ -183,6 +213,8 @@ vcard_response_new_status_bytes(unsigned char sw1, unsigned char sw2)
 void
 vcard_response_delete(VCardResponse *response)
 {
+    VCardBufferResponse **buffer;
+
     if (response == NULL) {
         return;
     }
@@ -198,6 +230,10 @@ vcard_response_delete(VCardResponse *response)
         break;
     case VCARD_MALLOC_STRUCT:
         /* only the structure was malloc'ed */
+        buffer = vcard_response_get_buffer(response);
+        if (buffer) {
+            vcard_buffer_response_delete(*buffer);
+        }
         g_free(response);
         break;
     case VCARD_STATIC:
@@ -226,7 +262,8 @@ vcard_apdu_set_class(VCardAPDU *apdu) {
     case 0x90:
     case 0xa0:
         apdu->a_channel = apdu->a_cla & 3;
-        apdu->a_secure_messaging = apdu->a_cla & 0xe;
+        /* b4-b3, b2-b1 are the channel */
+        apdu->a_secure_messaging = apdu->a_cla & 0xc;
         break;
     case 0xb0:
     case 0xc0:
@@ -379,48 +416,16 @@ vcard_apdu_delete(VCardAPDU *apdu)
 
 
 /*
- * declare response buffers for all the 7816 defined error codes
+ * declare response buffers for all the 7816 defined error codes, in the order
+ * of the generated status lookup table
  */
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_SUCCESS)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_WARNING)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_WARNING_RET_CORUPT)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_WARNING_BUF_END_BEFORE_LE)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_WARNING_INVALID_FILE_SELECTED)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_WARNING_FCI_FORMAT_INVALID)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_WARNING_CHANGE)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_WARNING_FILE_FILLED)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_EXC_ERROR)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_EXC_ERROR_CHANGE)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_EXC_ERROR_MEMORY_FAILURE)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_WRONG_LENGTH)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_CLA_NOT_SUPPORTED)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_CHANNEL_NOT_SUPPORTED)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_SECURE_NOT_SUPPORTED)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_COMMAND_NOT_SUPPORTED)
-VCARD_RESPONSE_NEW_STATIC_STATUS(
-                    VCARD7816_STATUS_ERROR_COMMAND_INCOMPATIBLE_WITH_FILE)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_SECURITY_NOT_SATISFIED)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_AUTHENTICATION_BLOCKED)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_DATA_INVALID)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_DATA_NO_EF)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_SM_OBJECT_MISSING)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_SM_OBJECT_INCORRECT)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_WRONG_PARAMETERS)
-VCARD_RESPONSE_NEW_STATIC_STATUS(
-                            VCARD7816_STATUS_ERROR_WRONG_PARAMETERS_IN_DATA)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_FUNCTION_NOT_SUPPORTED)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_FILE_NOT_FOUND)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_RECORD_NOT_FOUND)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_NO_SPACE_FOR_FILE)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_LC_TLV_INCONSISTENT)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_P1_P2_INCORRECT)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_LC_P1_P2_INCONSISTENT)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_DATA_NOT_FOUND)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_WRONG_PARAMETERS_2)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_INS_CODE_INVALID)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_CLA_INVALID)
-VCARD_RESPONSE_NEW_STATIC_STATUS(VCARD7816_STATUS_ERROR_GENERAL)
+#define VCARD_STATUS_RESPONSE(index, stat) \
+        {(unsigned char *)&vcard_status_response[index].b_sw1, (stat), \
+         ((stat) >> 8), ((stat) & 0xff), 0, 2, VCARD_STATIC},
+
+static const VCardResponse vcard_status_response[] = {
+    VCARD_LOOKUP_STATUS_LIST(VCARD_STATUS_RESPONSE)
+};
 
 /*
  * return a single response code. This function cannot fail. It will always
@@ -430,134 +435,19 @@ VCardResponse *
 vcard_make_response(vcard_7816_status_t status)
 {
     VCardResponse *response;
+    int index = vcard_lookup_status(status);
 
-    switch (status) {
-    /* known 7816 response codes */
-    case VCARD7816_STATUS_SUCCESS:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_SUCCESS);
-    case VCARD7816_STATUS_WARNING:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_WARNING);
-    case VCARD7816_STATUS_WARNING_RET_CORUPT:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_WARNING_RET_CORUPT);
-    case VCARD7816_STATUS_WARNING_BUF_END_BEFORE_LE:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_WARNING_BUF_END_BEFORE_LE);
-    case VCARD7816_STATUS_WARNING_INVALID_FILE_SELECTED:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_WARNING_INVALID_FILE_SELECTED);
-    case VCARD7816_STATUS_WARNING_FCI_FORMAT_INVALID:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_WARNING_FCI_FORMAT_INVALID);
-    case VCARD7816_STATUS_WARNING_CHANGE:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_WARNING_CHANGE);
-    case VCARD7816_STATUS_WARNING_FILE_FILLED:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_WARNING_FILE_FILLED);
-    case VCARD7816_STATUS_EXC_ERROR:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_EXC_ERROR);
-    case VCARD7816_STATUS_EXC_ERROR_CHANGE:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_EXC_ERROR_CHANGE);
-    case VCARD7816_STATUS_EXC_ERROR_MEMORY_FAILURE:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_EXC_ERROR_MEMORY_FAILURE);
-    case VCARD7816_STATUS_ERROR_WRONG_LENGTH:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_WRONG_LENGTH);
-    case VCARD7816_STATUS_ERROR_CLA_NOT_SUPPORTED:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_CLA_NOT_SUPPORTED);
-    case VCARD7816_STATUS_ERROR_CHANNEL_NOT_SUPPORTED:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_CHANNEL_NOT_SUPPORTED);
-    case VCARD7816_STATUS_ERROR_SECURE_NOT_SUPPORTED:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_SECURE_NOT_SUPPORTED);
-    case VCARD7816_STATUS_ERROR_COMMAND_NOT_SUPPORTED:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_COMMAND_NOT_SUPPORTED);
-    case VCARD7816_STATUS_ERROR_COMMAND_INCOMPATIBLE_WITH_FILE:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_COMMAND_INCOMPATIBLE_WITH_FILE);
-    case VCARD7816_STATUS_ERROR_SECURITY_NOT_SATISFIED:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_SECURITY_NOT_SATISFIED);
-    case VCARD7816_STATUS_ERROR_AUTHENTICATION_BLOCKED:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_AUTHENTICATION_BLOCKED);
-    case VCARD7816_STATUS_ERROR_DATA_INVALID:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_DATA_INVALID);
-    case VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED);
-    case VCARD7816_STATUS_ERROR_DATA_NO_EF:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_DATA_NO_EF);
-    case VCARD7816_STATUS_ERROR_SM_OBJECT_MISSING:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_SM_OBJECT_MISSING);
-    case VCARD7816_STATUS_ERROR_SM_OBJECT_INCORRECT:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_SM_OBJECT_INCORRECT);
-    case VCARD7816_STATUS_ERROR_WRONG_PARAMETERS:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_WRONG_PARAMETERS);
-    case VCARD7816_STATUS_ERROR_WRONG_PARAMETERS_IN_DATA:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_WRONG_PARAMETERS_IN_DATA);
-    case VCARD7816_STATUS_ERROR_FUNCTION_NOT_SUPPORTED:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_FUNCTION_NOT_SUPPORTED);
-    case VCARD7816_STATUS_ERROR_FILE_NOT_FOUND:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_FILE_NOT_FOUND);
-    case VCARD7816_STATUS_ERROR_RECORD_NOT_FOUND:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_RECORD_NOT_FOUND);
-    case VCARD7816_STATUS_ERROR_NO_SPACE_FOR_FILE:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_NO_SPACE_FOR_FILE);
-    case VCARD7816_STATUS_ERROR_LC_TLV_INCONSISTENT:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_LC_TLV_INCONSISTENT);
-    case VCARD7816_STATUS_ERROR_P1_P2_INCORRECT:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_P1_P2_INCORRECT);
-    case VCARD7816_STATUS_ERROR_LC_P1_P2_INCONSISTENT:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_LC_P1_P2_INCONSISTENT);
-    case VCARD7816_STATUS_ERROR_DATA_NOT_FOUND:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_DATA_NOT_FOUND);
-    case VCARD7816_STATUS_ERROR_WRONG_PARAMETERS_2:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_WRONG_PARAMETERS_2);
-    case VCARD7816_STATUS_ERROR_INS_CODE_INVALID:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_INS_CODE_INVALID);
-    case VCARD7816_STATUS_ERROR_CLA_INVALID:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_CLA_INVALID);
-    case VCARD7816_STATUS_ERROR_GENERAL:
-        return VCARD_RESPONSE_GET_STATIC(
-                    VCARD7816_STATUS_ERROR_GENERAL);
-    default:
-        /* we don't know this status code, create a response buffer to
-         * hold it */
-        response = vcard_response_new_status(status);
-        if (response == NULL) {
-            /* couldn't allocate the buffer, return memmory error */
-            return VCARD_RESPONSE_GET_STATIC(
-                        VCARD7816_STATUS_EXC_ERROR_MEMORY_FAILURE);
-        }
-        return response;
+    /* cast away the const, callers need may need to 'free' the result */
+    if (index >= 0) {
+        return (VCardResponse *)&vcard_status_response[index];
     }
+    /* we don't know this status code, create a response buffer to hold it */
+    response = vcard_response_new_status(status);
+    if (response == NULL) {
+        /* couldn't allocate the buffer, return memmory error */
+        return vcard_make_response(VCARD7816_STATUS_EXC_ERROR_MEMORY_FAILURE);
+    }
+    return response;
 }
 
 /*
@@ -575,6 +465,46 @@ vcard7816_file_system_process_apdu(G_GNUC_UNUSED VCard *card,
     return VCARD_DONE;
 }
 
+/*
+ * MANAGE CHANNEL. P1 00 opens the channel P2, or the lowest closed one if P2
+ * is 00, which is returned. P1 80 closes the channel P2.
+ */
+static VCardResponse *
+vcard7816_manage_channel(VCard *card, VCardAPDU *apdu)
+{
+    unsigned char channel;
+    int opened;
+
+    switch (apdu->a_p1) {
+    case 0x00:
+        if (apdu->a_p2 != 0) {
+            /* the basic channel is always open */
+            opened = vcard_channel_open(card, apdu->a_p2, apdu->a_channel);
+            return vcard_make_response(opened < 0 ?
+                        VCARD7816_STATUS_ERROR_P1_P2_INCORRECT :
+                        VCARD7816_STATUS_SUCCESS);
+        }
+        opened = vcard_channel_open(card, 0, apdu->a_channel);
+        if (opened < 0) {
+            return vcard_make_response(
+                        VCARD7816_STATUS_ERROR_FUNCTION_NOT_SUPPORTED);
+        }
+        channel = opened;
+        return vcard_response_new_bytes(card, &channel, 1, 1,
+                                        VCARD7816_SW1_SUCCESS, 0x00);
+    case 0x80:
+        if (!vcard_channel_close(card, apdu->a_channel, apdu->a_p2)) {
+            return vcard_make_response(apdu->a_p2 == 0 ?
+                        VCARD7816_STATUS_ERROR_P1_P2_INCORRECT :
+                        VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED);
+        }
+        return vcard_make_response(VCARD7816_STATUS_SUCCESS);
+    default:
+        break;
+    }
+    return vcard_make_response(VCARD7816_STATUS_ERROR_P1_P2_INCORRECT);
+}
+
 /*
  * VM card (including java cards)
  */
@@ -612,7 +542,6 @@ vcard7816_vm_process_apdu(VCard *card, VCardAPDU *apdu,
 
     /* now parse the instruction */
     switch (apdu->a_ins) {
-    case  VCARD7816_INS_MANAGE_CHANNEL: /* secure channel op */
     case  VCARD7816_INS_EXTERNAL_AUTHENTICATE: /* secure channel op */
     case  VCARD7816_INS_GET_CHALLENGE: /* secure channel op */
     case  VCARD7816_INS_INTERNAL_AUTHENTICATE: /* secure channel op */
@@ -661,6 +590,19 @@ vcard7816_vm_process_apdu(VCard *card, VCardAPDU *apdu,
                  */
                 *response = vcard_response_new(card, gp_response,
                     sizeof(gp_response), apdu->a_Le, VCARD7816_STATUS_SUCCESS);
+            } else if (current_applet == vcard_find_applet(card,
+                           piv_aid, PIV_AID_LEN)) {
+                /* the PIV applet returns its property template (SP 800-73-4
+                 * part 2, 3.1.1):
+                 *
+                 * 61 11 : Application Property Template
+                 *  4F 06 : Application identifier (PIX)
+                 *   00 00 10 00 01 00
+                 *  79 07 : Coexistent tag allocation authority
+                 *   4F 05 A0 00 00 03 08
+                 */
+                *response = vcard_response_new(card, piv_response,
+                    sizeof(piv_response), apdu->a_Le, VCARD7816_STATUS_SUCCESS);
             } else {
                 unsigned char fci_template[] = {
                     0x6F, 0x0B, /* Outer lenght to be replaced later */
@@ -731,7 +673,8 @@ vcard7816_vm_process_apdu(VCard *card, VCardAPDU *apdu,
         break;
 
     case VCARD7816_INS_GET_RESPONSE:
-        buffer_response = vcard_get_buffer_response(card);
+        buffer_response = vcard_get_channel_buffer_response(card,
+                                                            apdu->a_channel);
         if (!buffer_response) {
             *response = vcard_make_response(
                             VCARD7816_STATUS_ERROR_DATA_NOT_FOUND);
@@ -749,7 +692,7 @@ vcard7816_vm_process_apdu(VCard *card, VCardAPDU *apdu,
         buffer_response->current += bytes_to_copy;
         buffer_response->len -= bytes_to_copy;
         if (*response == NULL || (next_byte_count == 0)) {
-            vcard_set_buffer_response(card, NULL);
+            vcard_set_channel_buffer_response(card, apdu->a_channel, NULL);
             vcard_buffer_response_delete(buffer_response);
         }
         if (*response == NULL) {
@@ -758,6 +701,10 @@ vcard7816_vm_process_apdu(VCard *card, VCardAPDU *apdu,
         }
         break;
 
+    case VCARD7816_INS_MANAGE_CHANNEL:
+        *response = vcard7816_manage_channel(card, apdu);
+        break;
+
     case VCARD7816_INS_GET_DATA:
         *response =
             vcard_make_response(VCARD7816_STATUS_ERROR_COMMAND_NOT_SUPPORTED);
@@ -784,6 +731,8 @@ vcard_process_apdu(VCard *card, VCardAPDU *apdu, VCardResponse **response)
 {
     VCardStatus status;
     VCardBufferResponse *buffer_response;
+    VCardBufferResponse **buffer;
+    int channel = apdu->a_channel;
 
     /* first handle any PTS commands, which aren't really APDU's */
     if (apdu->a_type == VCARD_7816_PTS) {
@@ -793,22 +742,35 @@ vcard_process_apdu(VCard *card, VCardAPDU *apdu, VCardResponse **response)
         (*response)->b_total_len = (*response)->b_len;
         return VCARD_DONE;
     }
-    buffer_response = vcard_get_buffer_response(card);
+    /* the other channels of the card are processed in parallel */
+    vcard_channel_lock(card, channel);
+    /* a passthru card checks the channels itself */
+    if (vcard_get_type(card) != VCARD_DIRECT &&
+        !vcard_channel_is_open(card, channel)) {
+        *response = vcard_make_response(
+                        VCARD7816_STATUS_ERROR_CHANNEL_NOT_SUPPORTED);
+        vcard_channel_unlock(card, channel);
+        return VCARD_DONE;
+    }
+    vcard_diag_count_apdu(card, apdu);
+    buffer_response = vcard_get_channel_buffer_response(card, channel);
     if (buffer_response && apdu->a_ins != VCARD7816_INS_GET_RESPONSE) {
         /* clear out buffer_response, do not return an error */
-        vcard_set_buffer_response(card, NULL);
+        vcard_set_channel_buffer_response(card, channel, NULL);
         vcard_buffer_response_delete(buffer_response);
     }
 
     status = vcard_process_applet_apdu(card, apdu, response);
     if (status != VCARD_NEXT) {
-        return status;
+        goto done;
     }
     switch (vcard_get_type(card)) {
     case VCARD_FILE_SYSTEM:
-        return vcard7816_file_system_process_apdu(card, apdu, response);
+        status = vcard7816_file_system_process_apdu(card, apdu, response);
+        goto done;
     case VCARD_VM:
-        return vcard7816_vm_process_apdu(card, apdu, response);
+        status = vcard7816_vm_process_apdu(card, apdu, response);
+        goto done;
     case VCARD_DIRECT:
         /* if we are type direct, then the applet should handle everything */
         g_assert(!"VCARD_DIRECT: applet failure");
@@ -818,7 +780,17 @@ vcard_process_apdu(VCard *card, VCardAPDU *apdu, VCardResponse **response)
     }
     *response =
         vcard_make_response(VCARD7816_STATUS_ERROR_COMMAND_NOT_SUPPORTED);
-    return VCARD_DONE;
+    status = VCARD_DONE;
+
+done:
+    /* the rest of a long response waits for GET RESPONSE on this channel */
+    buffer = *response ? vcard_response_get_buffer(*response) : NULL;
+    if (buffer && *buffer) {
+        vcard_set_channel_buffer_response(card, channel, *buffer);
+        *buffer = NULL;
+    }
+    vcard_channel_unlock(card, channel);
+    return status;
 }
 
 /* vim: set ts=4 sw=4 tw=0 noet expandtab: */
@@ -0,0 +1,184 @@
+/*
+ * Proprietary diagnostic applet. It returns the counters the card collects
+ * about itself (instructions, backend operation times, cache and GET RESPONSE
+ * chains) so the tools in the guest can correlate their behaviour with the
+ * cost on the emulator side.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "diag.h"
+#include "vcard.h"
+#include "vcard_cache.h"
+#include "card_7816.h"
+#include "vcardt_internal.h"
+
+/* "libcacd" in the proprietary (non registered) AID range */
+static unsigned char diag_aid[] = {
+    0xF0, 0x6C, 0x69, 0x62, 0x63, 0x61, 0x63, 0x64 };
+
+static const struct {
+    VCardDiagOp op;
+    unsigned char id;
+} diag_ops[] = {
+    { VCARD_DIAG_RSA_OP, DIAG_OP_RSA },
+    { VCARD_DIAG_LOGIN, DIAG_OP_LOGIN },
+};
+
+/* big endian, saturated to 32b */
+static void
+diag_append_u32(GByteArray *out, guint64 value)
+{
+    guint32 v = MIN(value, G_MAXUINT32);
+    unsigned char buf[4] = { v >> 24, v >> 16, v >> 8, v };
+
+    g_byte_array_append(out, buf, sizeof(buf));
+}
+
+/* BER tag and length */
+static void
+diag_append_tl(GByteArray *out, unsigned int tag, unsigned int len)
+{
+    unsigned char buf[5];
+    int n = 0;
+
+    if (tag > 0xff) {
+        buf[n++] = tag >> 8;
+    }
+    buf[n++] = tag & 0xff;
+    if (len < 0x80) {
+        buf[n++] = len;
+    } else if (len <= 0xff) {
+        buf[n++] = 0x81;
+        buf[n++] = len;
+    } else {
+        buf[n++] = 0x82;
+        buf[n++] = len >> 8;
+        buf[n++] = len & 0xff;
+    }
+    g_byte_array_append(out, buf, n);
+}
+
+static void
+diag_append_item(GByteArray *out, unsigned int tag, GByteArray *value)
+{
+    diag_append_tl(out, tag, value->len);
+    g_byte_array_append(out, value->data, value->len);
+    g_byte_array_set_size(value, 0);
+}
+
+static GByteArray *
+diag_encode_counters(VCardDiagStats *diag)
+{
+    GByteArray *body = g_byte_array_new();
+    GByteArray *value = g_byte_array_new();
+    GByteArray *out;
+    VCardCacheStats cache;
+    unsigned int i;
+
+    for (i = 0; i < G_N_ELEMENTS(diag->ins_count); i++) {
+        unsigned char ins = i;
+
+        if (diag->ins_count[i] == 0) {
+            continue;
+        }
+        g_byte_array_append(value, &ins, 1);
+        diag_append_u32(value, diag->ins_count[i]);
+    }
+    diag_append_item(body, DIAG_TAG_INS, value);
+
+    for (i = 0; i < G_N_ELEMENTS(diag_ops); i++) {
+        VCardDiagOp op = diag_ops[i].op;
+
+        g_byte_array_append(value, &diag_ops[i].id, 1);
+        diag_append_u32(value, diag->op[op].count);
+        diag_append_u32(value, diag->op[op].total);
+        diag_append_u32(value, diag->op[op].max);
+    }
+    diag_append_item(body, DIAG_TAG_BACKEND, value);
+
+    vcard_cache_get_stats(&cache);
+    diag_append_u32(value, cache.hits);
+    diag_append_u32(value, cache.misses);
+    diag_append_u32(value, cache.evictions);
+    diag_append_u32(value, cache.used);
+    diag_append_item(body, DIAG_TAG_CACHE, value);
+
+    diag_append_u32(value, diag->chains);
+    diag_append_u32(value, diag->chains_abandoned);
+    diag_append_u32(value, diag->get_responses);
+    diag_append_u32(value, diag->chain_max);
+    diag_append_item(body, DIAG_TAG_GET_RESPONSE, value);
+
+    out = g_byte_array_new();
+    diag_append_item(out, DIAG_TAG_COUNTERS, body);
+    g_byte_array_free(body, TRUE);
+    g_byte_array_free(value, TRUE);
+    return out;
+}
+
+static VCardStatus
+diag_applet_process_apdu(VCard *card, VCardAPDU *apdu,
+                         VCardResponse **response)
+{
+    VCardDiagStats diag;
+    GByteArray *counters;
+    unsigned int tag;
+
+    switch (apdu->a_ins) {
+    case DIAG_GET_DATA:
+        tag = (apdu->a_p1 & 0xff) << 8 | (apdu->a_p2 & 0xff);
+        if (tag != DIAG_TAG_COUNTERS ||
+            !vcard_get_diag_snapshot(card, &diag)) {
+            *response = vcard_make_response(
+                VCARD7816_STATUS_ERROR_DATA_NOT_FOUND);
+            break;
+        }
+        /* the counters are taken before this response can be chained */
+        counters = diag_encode_counters(&diag);
+        *response = vcard_response_new(card, counters->data, counters->len,
+                                       apdu->a_Le, VCARD7816_STATUS_SUCCESS);
+        g_byte_array_free(counters, TRUE);
+        if (*response == NULL) {
+            *response = vcard_make_response(
+                VCARD7816_STATUS_EXC_ERROR_MEMORY_FAILURE);
+        }
+        break;
+
+    default:
+        /* Let the ISO 7816 code to handle other APDUs */
+        return VCARD_NEXT;
+    }
+    return VCARD_DONE;
+}
+
+
+/*
+ * Initialize the diagnostic applet. This is the only public function in this
+ * file. All the rest are connected through function pointers.
+ */
+VCardStatus
+diag_card_init(G_GNUC_UNUSED VReader *reader, VCard *card)
+{
+    VCardApplet *applet;
+
+    applet = vcard_new_applet(diag_applet_process_apdu,
+                              NULL, diag_aid, sizeof(diag_aid));
+    if (applet == NULL) {
+        goto failure;
+    }
+    vcard_add_applet(card, applet);
+    vcard_diag_enable(card);
+
+    return VCARD_DONE;
+
+failure:
+    return VCARD_FAIL;
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */
@@ -0,0 +1,35 @@
+/*
+ * defines the entry point for the diagnostic applet, which reports the
+ * emulator counters to the guest. Only used by vcard_emul_type.c
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef DIAG_H
+#define DIAG_H 1
+
+#include "vcard.h"
+#include "vreader.h"
+
+#define DIAG_GET_DATA                         0xCA
+
+/* GET DATA P1|P2 of the counters template */
+#define DIAG_TAG_COUNTERS                     0xFF70
+/* tags inside the template, all the values are 4B big endian */
+#define DIAG_TAG_INS                          0x81 /* INS, count */
+#define DIAG_TAG_BACKEND                      0x82 /* op, count, total us, max us */
+#define DIAG_TAG_CACHE                        0x83 /* hits, misses, evictions, bytes */
+#define DIAG_TAG_GET_RESPONSE                 0x84 /* chains, abandoned, APDUs, max */
+
+#define DIAG_OP_RSA                           0x01
+#define DIAG_OP_LOGIN                         0x02
+
+/*
+ * Initialize the diagnostic applet and start counting on the card. This is
+ * the only public function in this file. All the rest are connected through
+ * function pointers.
+ */
+VCardStatus
+diag_card_init(VReader *reader, VCard *card);
+
+#endif
@@ -10,6 +10,9 @@
 #include "vcard.h"
 #include "vreader.h"
 #include "vevent.h"
+#include "vcardt_internal.h"
+#include "vcard_lock_internal.h"
+#include "vcard_probes.h"
 
 VEvent *
 vevent_new(VEventType type, VReader *reader, VCard *card)
@@ -42,19 +45,116 @@ vevent_delete(VEvent *vevent)
 
 static VEvent *vevent_queue_head;
 static VEvent *vevent_queue_tail;
-static GMutex vevent_queue_lock;
+static unsigned int vevent_queue_length;
+static VCardLock vevent_queue_lock = VCARD_LOCK_INIT("event-queue");
 static GCond vevent_queue_condition;
+static gboolean vevent_queue_default = TRUE;
+
+/* the subscriptions are protected by the queue lock too */
+struct VEventSubscriptionStruct {
+    unsigned int mask;
+    unsigned int max_queued;
+    GPtrArray *readers;     /* filter, all the readers if empty */
+    VEvent *head;
+    VEvent *tail;
+    unsigned int queued;
+    unsigned int dropped;
+    GCond condition;
+};
+
+static GList *vevent_subscriptions;
 
 void vevent_queue_init(void)
 {
     vevent_queue_head = vevent_queue_tail = NULL;
+    vevent_queue_length = 0;
+}
+
+void
+vevent_queue_set_default(gboolean enabled)
+{
+    VEvent *vevent = NULL;
+
+    vcard_lock_lock(&vevent_queue_lock);
+    vevent_queue_default = enabled;
+    /* the default queue has no consumer, drop what it holds */
+    if (!enabled) {
+        vevent = vevent_queue_head;
+        vevent_queue_head = vevent_queue_tail = NULL;
+        vevent_queue_length = 0;
+    }
+    vcard_lock_unlock(&vevent_queue_lock);
+
+    while (vevent) {
+        VEvent *next = vevent->next;
+
+        vevent_delete(vevent);
+        vevent = next;
+    }
+}
+
+/* must have lock */
+static gboolean
+vevent_subscription_match(VEventSubscription *subscription, VEvent *vevent)
+{
+    guint i;
+
+    if ((subscription->mask & VEVENT_MASK(vevent->type)) == 0) {
+        return FALSE;
+    }
+    /* the events without a reader are for everyone */
+    if (subscription->readers->len == 0 || vevent->reader == NULL) {
+        return TRUE;
+    }
+    for (i = 0; i < subscription->readers->len; i++) {
+        if (g_ptr_array_index(subscription->readers, i) == vevent->reader) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* must have lock */
+static void
+vevent_subscription_queue(VEventSubscription *subscription, VEvent *vevent)
+{
+    VEvent *copy;
+
+    if (subscription->max_queued &&
+        subscription->queued >= subscription->max_queued) {
+        /* the consumer is behind, it has to check the readers again */
+        subscription->dropped++;
+        VCARD_PROBE3(event_drop, subscription, vevent->type, vevent->reader);
+        return;
+    }
+    copy = vevent_new(vevent->type, vevent->reader, vevent->card);
+    if (subscription->head) {
+        subscription->tail->next = copy;
+    } else {
+        subscription->head = copy;
+    }
+    subscription->tail = copy;
+    subscription->queued++;
+    g_cond_signal(&subscription->condition);
 }
 
 void
 vevent_queue_vevent(VEvent *vevent)
 {
+    GList *l;
+
     vevent->next = NULL;
-    g_mutex_lock(&vevent_queue_lock);
+    vcard_lock_lock(&vevent_queue_lock);
+    for (l = vevent_subscriptions; l; l = l->next) {
+        if (vevent_subscription_match(l->data, vevent)) {
+            vevent_subscription_queue(l->data, vevent);
+        }
+    }
+    if (!vevent_queue_default) {
+        vcard_lock_unlock(&vevent_queue_lock);
+        vevent_delete(vevent);
+        return;
+    }
     if (vevent_queue_head) {
         assert(vevent_queue_tail);
         vevent_queue_tail->next = vevent;
@@ -62,8 +162,10 @@ vevent_queue_vevent(VEvent *vevent)
         vevent_queue_head = vevent;
     }
     vevent_queue_tail = vevent;
+    vevent_queue_length++;
+    VCARD_PROBE3(event_enqueue, vevent, vevent->type, vevent->reader);
     g_cond_signal(&vevent_queue_condition);
-    g_mutex_unlock(&vevent_queue_lock);
+    vcard_lock_unlock(&vevent_queue_lock);
 }
 
 /* must have lock */
@@ -75,6 +177,8 @@ vevent_dequeue_vevent(void)
         vevent = vevent_queue_head;
         vevent_queue_head = vevent->next;
         vevent->next = NULL;
+        vevent_queue_length--;
+        VCARD_PROBE3(event_dequeue, vevent, vevent->type, vevent->reader);
     }
     return vevent;
 }
@@ -83,11 +187,11 @@ VEvent *vevent_wait_next_vevent(void)
 {
     VEvent *vevent;
 
-    g_mutex_lock(&vevent_queue_lock);
+    vcard_lock_lock(&vevent_queue_lock);
     while ((vevent = vevent_dequeue_vevent()) == NULL) {
-        g_cond_wait(&vevent_queue_condition, &vevent_queue_lock);
+        vcard_lock_cond_wait(&vevent_queue_condition, &vevent_queue_lock);
     }
-    g_mutex_unlock(&vevent_queue_lock);
+    vcard_lock_unlock(&vevent_queue_lock);
     return vevent;
 }
 
@@ -95,9 +199,156 @@ VEvent *vevent_get_next_vevent(void)
 {
     VEvent *vevent;
 
-    g_mutex_lock(&vevent_queue_lock);
+    vcard_lock_lock(&vevent_queue_lock);
     vevent = vevent_dequeue_vevent();
-    g_mutex_unlock(&vevent_queue_lock);
+    vcard_lock_unlock(&vevent_queue_lock);
+    return vevent;
+}
+
+/*
+ * VEvent subscriptions
+ */
+VEventSubscription *
+vevent_subscribe(unsigned int mask, unsigned int max_queued)
+{
+    VEventSubscription *subscription;
+
+    subscription = g_new0(VEventSubscription, 1);
+    subscription->mask = mask;
+    subscription->max_queued = max_queued;
+    subscription->readers = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)vreader_free);
+    g_cond_init(&subscription->condition);
+
+    vcard_lock_lock(&vevent_queue_lock);
+    vevent_subscriptions = g_list_append(vevent_subscriptions, subscription);
+    vcard_lock_unlock(&vevent_queue_lock);
+    return subscription;
+}
+
+void
+vevent_subscription_add_reader(VEventSubscription *subscription,
+                               VReader *reader)
+{
+    g_return_if_fail(subscription != NULL && reader != NULL);
+
+    vcard_lock_lock(&vevent_queue_lock);
+    g_ptr_array_add(subscription->readers, vreader_reference(reader));
+    vcard_lock_unlock(&vevent_queue_lock);
+}
+
+/* nobody may be waiting on the subscription */
+void
+vevent_unsubscribe(VEventSubscription *subscription)
+{
+    VEvent *vevent;
+
+    if (subscription == NULL) {
+        return;
+    }
+    vcard_lock_lock(&vevent_queue_lock);
+    vevent_subscriptions = g_list_remove(vevent_subscriptions, subscription);
+    vcard_lock_unlock(&vevent_queue_lock);
+
+    while ((vevent = subscription->head) != NULL) {
+        subscription->head = vevent->next;
+        vevent_delete(vevent);
+    }
+    g_ptr_array_free(subscription->readers, TRUE);
+    g_cond_clear(&subscription->condition);
+    g_free(subscription);
+}
+
+/* must have lock */
+static VEvent *
+vevent_subscription_dequeue(VEventSubscription *subscription)
+{
+    VEvent *vevent = subscription->head;
+
+    if (vevent) {
+        subscription->head = vevent->next;
+        if (subscription->head == NULL) {
+            subscription->tail = NULL;
+        }
+        vevent->next = NULL;
+        subscription->queued--;
+        VCARD_PROBE3(event_dequeue, vevent, vevent->type, vevent->reader);
+    }
+    return vevent;
+}
+
+VEvent *
+vevent_subscription_wait(VEventSubscription *subscription)
+{
+    VEvent *vevent;
+
+    vcard_lock_lock(&vevent_queue_lock);
+    while ((vevent = vevent_subscription_dequeue(subscription)) == NULL) {
+        vcard_lock_cond_wait(&subscription->condition, &vevent_queue_lock);
+    }
+    vcard_lock_unlock(&vevent_queue_lock);
     return vevent;
 }
 
+VEvent *
+vevent_subscription_get(VEventSubscription *subscription)
+{
+    VEvent *vevent;
+
+    vcard_lock_lock(&vevent_queue_lock);
+    vevent = vevent_subscription_dequeue(subscription);
+    vcard_lock_unlock(&vevent_queue_lock);
+    return vevent;
+}
+
+/* number of the events dropped because the queue was full */
+unsigned int
+vevent_subscription_get_dropped(VEventSubscription *subscription)
+{
+    unsigned int dropped;
+
+    vcard_lock_lock(&vevent_queue_lock);
+    dropped = subscription->dropped;
+    vcard_lock_unlock(&vevent_queue_lock);
+    return dropped;
+}
+
+unsigned int
+vevent_queue_get_length(void)
+{
+    unsigned int length;
+    GList *l;
+
+    vcard_lock_lock(&vevent_queue_lock);
+    length = vevent_queue_length;
+    for (l = vevent_subscriptions; l; l = l->next) {
+        length += ((VEventSubscription *)l->data)->queued;
+    }
+    vcard_lock_unlock(&vevent_queue_lock);
+    return length;
+}
+
+void
+vevent_queue_collect_mem_stats(VReader *reader, VCardMemStats *stats)
+{
+    VEvent *vevent;
+    GList *l;
+
+    vcard_lock_lock(&vevent_queue_lock);
+    for (vevent = vevent_queue_head; vevent; vevent = vevent->next) {
+        if (vevent->reader == reader) {
+            vcard_mem_stats_add(stats, VCARD_MEM_EVENT, sizeof(VEvent));
+        }
+    }
+    for (l = vevent_subscriptions; l; l = l->next) {
+        VEventSubscription *subscription = l->data;
+
+        for (vevent = subscription->head; vevent; vevent = vevent->next) {
+            if (vevent->reader == reader) {
+                vcard_mem_stats_add(stats, VCARD_MEM_EVENT, sizeof(VEvent));
+            }
+        }
+    }
+    vcard_lock_unlock(&vevent_queue_lock);
+}
+
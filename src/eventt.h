@@ -10,6 +10,7 @@
 #include "vcardt.h"
 
 typedef struct VEventStruct VEvent;
+typedef struct VEventSubscriptionStruct VEventSubscription;
 
 typedef enum {
     VEVENT_READER_INSERT,
@@ -19,6 +20,10 @@ typedef enum {
     VEVENT_LAST,
 } VEventType;
 
+/* event masks of the subscriptions */
+#define VEVENT_MASK(type) (1U << (type))
+#define VEVENT_MASK_ALL   (VEVENT_MASK(VEVENT_LAST + 1) - 1)
+
 struct VEventStruct {
     VEvent *next;
     VEventType type;
@@ -18,6 +18,8 @@ G_BEGIN_DECLS
 #include "vcard_emul.h"
 #include "vcard_emul_type.h"
 #include "vcard.h"
+#include "vcard_cache.h"
+#include "vcard_lock.h"
 #include "vcardt.h"
 #include "vevent.h"
 #include "vreader.h"
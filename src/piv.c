@@ -0,0 +1,565 @@
+/*
+ * PIV card emulation (NIST SP 800-73-4). The certificates and keys of the
+ * card are the same as for the CAC emulation, but every data object is read
+ * with one GET DATA (with an extended Le, or GET RESPONSE otherwise) and the
+ * keys are used with GENERAL AUTHENTICATE, instead of the GSC-IS containers
+ * which take a SELECT, GET PROPERTIES and several READ BUFFER per object.
+ *
+ * Only the RSA keys and the application PIN are implemented. There is no
+ * card management key, so the card is read-only.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "piv.h"
+#include "vcard.h"
+#include "vcard_emul.h"
+#include "card_7816.h"
+#include "vcardt_internal.h"
+
+/* PIV application AID with the version (PIX 00 00 10 00 01 00); the
+ * middleware usually selects it without the version, right-truncated */
+const unsigned char piv_aid[PIV_AID_LEN] = {
+    0xA0, 0x00, 0x00, 0x03, 0x08, 0x00, 0x00, 0x10, 0x00, 0x01, 0x00 };
+
+/* key references and the tags of their certificate objects (5F C1 xx) */
+static const unsigned char piv_key_refs[PIV_MAX_KEYS] = {
+    0x9A, 0x9C, 0x9D, 0x9E,
+    0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x8B,
+    0x8C, 0x8D, 0x8E, 0x8F, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95 };
+static const unsigned char piv_cert_tags[PIV_MAX_KEYS] = {
+    0x05, 0x0A, 0x0B, 0x01,
+    0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16,
+    0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20 };
+
+#define PIV_TAG_CHUID       0x02
+#define PIV_TAG_CCC         0x07
+#define PIV_TAG_KEY_HISTORY 0x0C
+#define PIV_TAG_DISCOVERY   0x7E
+
+/* FASC-N of a non-federal issuer (agency, system and credential 9999) */
+static const unsigned char piv_fascn[] = {
+    0xD4, 0xE7, 0x39, 0xDA, 0x73, 0x9C, 0xED, 0x39, 0xCE, 0x73, 0x9D, 0x83,
+    0x68, 0x58, 0x21, 0x08, 0x42, 0x10, 0x84, 0x21, 0xC8, 0x42, 0x10, 0xC3,
+    0xEB };
+
+/* Discovery object: the full AID, and only the application PIN */
+static const unsigned char piv_discovery[] = {
+    0x7E, 0x12,
+      0x4F, 0x0B, /* PIV AID */
+        0xA0, 0x00, 0x00, 0x03, 0x08, 0x00, 0x00, 0x10, 0x00, 0x01, 0x00,
+      0x5F, 0x2F, 0x02, /* PIN usage policy */
+        0x40, 0x00 };
+
+typedef struct {
+    unsigned char tag;      /* last byte of 5F C1 xx */
+    unsigned char *data;    /* the complete 53 TLV */
+    int len;
+} PIVObject;
+
+struct VCardAppletPrivateStruct {
+    PIVObject objects[PIV_MAX_KEYS + 3];
+    int object_count;
+    VCardKey *keys[PIV_MAX_KEYS];
+    int key_count;
+    /* command chaining of GENERAL AUTHENTICATE, per channel */
+    unsigned char *chain_buffer[MAX_CHANNEL];
+    int chain_len[MAX_CHANNEL];
+};
+
+static void
+piv_put_length(GByteArray *buf, int len)
+{
+    unsigned char b[3];
+
+    if (len < 0x80) {
+        b[0] = len;
+        g_byte_array_append(buf, b, 1);
+    } else if (len < 0x100) {
+        b[0] = 0x81;
+        b[1] = len;
+        g_byte_array_append(buf, b, 2);
+    } else {
+        b[0] = 0x82;
+        b[1] = (len >> 8) & 0xff;
+        b[2] = len & 0xff;
+        g_byte_array_append(buf, b, 3);
+    }
+}
+
+static void
+piv_put_tlv(GByteArray *buf, unsigned char tag,
+            const unsigned char *value, int len)
+{
+    g_byte_array_append(buf, &tag, 1);
+    piv_put_length(buf, len);
+    if (len > 0) {
+        g_byte_array_append(buf, value, len);
+    }
+}
+
+/* parse a BER length, return FALSE if it does not fit in the buffer */
+static gboolean
+piv_get_length(const unsigned char **p, const unsigned char *end, int *len)
+{
+    const unsigned char *q = *p;
+
+    if (q >= end) {
+        return FALSE;
+    }
+    if (*q < 0x80) {
+        *len = *q++;
+    } else if (*q == 0x81 && end - q >= 2) {
+        *len = q[1];
+        q += 2;
+    } else if (*q == 0x82 && end - q >= 3) {
+        *len = q[1] << 8 | q[2];
+        q += 3;
+    } else {
+        return FALSE;
+    }
+    if (*len > end - q) {
+        return FALSE;
+    }
+    *p = q;
+    return TRUE;
+}
+
+/* wrap the value in the 53 TLV of the data objects and add it to the card */
+static void
+piv_add_object(VCardAppletPrivate *applet_private, unsigned char tag,
+               GByteArray *value)
+{
+    GByteArray *buf = g_byte_array_sized_new(value->len + 4);
+    PIVObject *object = &applet_private->objects[applet_private->object_count++];
+
+    piv_put_tlv(buf, 0x53, value->data, value->len);
+    object->tag = tag;
+    object->len = buf->len;
+    object->data = g_byte_array_free(buf, FALSE);
+}
+
+static void
+piv_add_cert_object(VCardAppletPrivate *applet_private, unsigned char tag,
+                    const unsigned char *cert, int cert_len)
+{
+    GByteArray *value = g_byte_array_sized_new(cert_len + 10);
+    static const unsigned char cert_info = 0x00; /* not compressed */
+
+    piv_put_tlv(value, 0x70, cert, cert_len);
+    piv_put_tlv(value, 0x71, &cert_info, 1);
+    piv_put_tlv(value, 0xFE, NULL, 0);
+    piv_add_object(applet_private, tag, value);
+    g_byte_array_free(value, TRUE);
+}
+
+static void
+piv_add_chuid(VCardAppletPrivate *applet_private, VCard *card)
+{
+    GByteArray *value = g_byte_array_new();
+    unsigned char guid[16] = { 0 };
+    int serial_len = 0;
+    unsigned char *serial = vcard_get_serial(card, &serial_len);
+    static const unsigned char expiry[] = "20991231";
+
+    /* the GUID identifies the card for the caches of the middleware */
+    if (serial) {
+        memcpy(guid, serial, MIN(serial_len, (int)sizeof(guid)));
+    }
+    piv_put_tlv(value, 0x30, piv_fascn, sizeof(piv_fascn));
+    piv_put_tlv(value, 0x34, guid, sizeof(guid));
+    piv_put_tlv(value, 0x35, expiry, sizeof(expiry) - 1);
+    /* no issuer signature */
+    piv_put_tlv(value, 0x3E, NULL, 0);
+    piv_put_tlv(value, 0xFE, NULL, 0);
+    piv_add_object(applet_private, PIV_TAG_CHUID, value);
+    g_byte_array_free(value, TRUE);
+}
+
+static void
+piv_add_ccc(VCardAppletPrivate *applet_private, VCard *card)
+{
+    GByteArray *value = g_byte_array_new();
+    unsigned char card_id[21] = {
+        0xA0, 0x00, 0x00, 0x01, 0x16, /* GSC-RID */
+        0xFF, /* manufacturer */
+        0x02, /* card type: Java card */
+    };
+    int serial_len = 0;
+    unsigned char *serial = vcard_get_serial(card, &serial_len);
+    static const unsigned char version = 0x21;
+    static const unsigned char zero = 0x00;
+    static const unsigned char data_model = 0x10; /* PIV data model */
+
+    if (serial) {
+        memcpy(card_id + 7, serial, MIN(serial_len, 14));
+    }
+    piv_put_tlv(value, 0xF0, card_id, sizeof(card_id));
+    piv_put_tlv(value, 0xF1, &version, 1);
+    piv_put_tlv(value, 0xF2, &version, 1);
+    piv_put_tlv(value, 0xF3, NULL, 0);
+    piv_put_tlv(value, 0xF4, &zero, 1);
+    piv_put_tlv(value, 0xF5, &data_model, 1);
+    piv_put_tlv(value, 0xF6, NULL, 0);
+    piv_put_tlv(value, 0xF7, NULL, 0);
+    piv_put_tlv(value, 0xFA, NULL, 0);
+    piv_put_tlv(value, 0xFB, NULL, 0);
+    piv_put_tlv(value, 0xFC, NULL, 0);
+    piv_put_tlv(value, 0xFD, NULL, 0);
+    piv_put_tlv(value, 0xFE, NULL, 0);
+    piv_add_object(applet_private, PIV_TAG_CCC, value);
+    g_byte_array_free(value, TRUE);
+}
+
+static void
+piv_add_key_history(VCardAppletPrivate *applet_private)
+{
+    GByteArray *value = g_byte_array_new();
+    unsigned char retired = MAX(applet_private->key_count - 4, 0);
+    static const unsigned char zero = 0x00;
+
+    piv_put_tlv(value, 0xC1, &retired, 1); /* with a certificate on card */
+    piv_put_tlv(value, 0xC2, &zero, 1);    /* with a certificate off card */
+    piv_put_tlv(value, 0xFE, NULL, 0);
+    piv_add_object(applet_private, PIV_TAG_KEY_HISTORY, value);
+    g_byte_array_free(value, TRUE);
+}
+
+static void
+piv_delete_applet_private(VCardAppletPrivate *applet_private)
+{
+    int i;
+
+    if (applet_private == NULL) {
+        return;
+    }
+    for (i = 0; i < applet_private->object_count; i++) {
+        g_free(applet_private->objects[i].data);
+    }
+    for (i = 0; i < applet_private->key_count; i++) {
+        if (applet_private->keys[i] != NULL) {
+            vcard_emul_delete_key(applet_private->keys[i]);
+        }
+    }
+    for (i = 0; i < MAX_CHANNEL; i++) {
+        g_free(applet_private->chain_buffer[i]);
+    }
+    g_free(applet_private);
+}
+
+static void
+piv_chain_reset(VCardAppletPrivate *applet_private, int channel)
+{
+    g_free(applet_private->chain_buffer[channel]);
+    applet_private->chain_buffer[channel] = NULL;
+    applet_private->chain_len[channel] = 0;
+}
+
+/* GET DATA: the data field is the tag list 5C 03 5F C1 xx (or 5C 01 7E) */
+static VCardResponse *
+piv_get_data(VCard *card, VCardAppletPrivate *applet_private, VCardAPDU *apdu)
+{
+    int i;
+
+    if (apdu->a_p1 != 0x3F || apdu->a_p2 != 0xFF) {
+        return vcard_make_response(VCARD7816_STATUS_ERROR_P1_P2_INCORRECT);
+    }
+    if (apdu->a_Lc == 3 && apdu->a_body[0] == 0x5C &&
+        apdu->a_body[1] == 0x01 && apdu->a_body[2] == PIV_TAG_DISCOVERY) {
+        return vcard_response_new(card, piv_discovery, sizeof(piv_discovery),
+                                  apdu->a_Le, VCARD7816_STATUS_SUCCESS);
+    }
+    if (apdu->a_Lc != 5 || apdu->a_body[0] != 0x5C ||
+        apdu->a_body[1] != 0x03 || apdu->a_body[2] != 0x5F ||
+        apdu->a_body[3] != 0xC1) {
+        return vcard_make_response(
+            VCARD7816_STATUS_ERROR_WRONG_PARAMETERS_IN_DATA);
+    }
+    for (i = 0; i < applet_private->object_count; i++) {
+        PIVObject *object = &applet_private->objects[i];
+
+        if (object->tag == apdu->a_body[4]) {
+            /* the whole object fits in one extended length response */
+            return vcard_response_new(card, object->data, object->len,
+                                      apdu->a_Le, VCARD7816_STATUS_SUCCESS);
+        }
+    }
+    return vcard_make_response(VCARD7816_STATUS_ERROR_FILE_NOT_FOUND);
+}
+
+static VCardResponse *
+piv_verify(VCard *card, VCardAPDU *apdu)
+{
+    int count;
+
+    if ((apdu->a_p1 != 0x00 && apdu->a_p1 != 0xFF) ||
+        apdu->a_p2 != PIV_PIN_APPLICATION) {
+        return vcard_make_response(VCARD7816_STATUS_ERROR_DATA_NOT_FOUND);
+    }
+    /* P1 = FF resets the security status */
+    if (apdu->a_p1 == 0xFF) {
+        vcard_emul_logout(card);
+        return vcard_make_response(VCARD7816_STATUS_SUCCESS);
+    }
+    if (apdu->a_Lc != 0) {
+        /* the PIN is padded with FF to 8 bytes, as for CAC */
+        return vcard_make_response(
+            vcard_emul_login(card, apdu->a_body, apdu->a_Lc));
+    }
+    if (vcard_emul_is_logged_in(card)) {
+        return vcard_make_response(VCARD7816_STATUS_SUCCESS);
+    }
+    count = vcard_get_login_count(card);
+    if (count < 0) {
+        return vcard_make_response(VCARD7816_STATUS_ERROR_DATA_NOT_FOUND);
+    }
+    return vcard_response_new_status_bytes(VCARD7816_SW1_WARNING_CHANGE,
+                                           0xc0 | MIN(count, 0xf));
+}
+
+/* bits of the RSA key for the algorithm identifier in P1 (SP 800-78) */
+static int
+piv_rsa_bits(unsigned char algorithm)
+{
+    switch (algorithm) {
+    case 0x06:
+        return 1024;
+    case 0x07:
+        return 2048;
+    case 0x05:
+        return 3072;
+    case 0x16:
+        return 4096;
+    }
+    return 0;
+}
+
+/*
+ * largest dynamic authentication template for the algorithm in P1: 7C, then
+ * 82 00 and 81 with a challenge of the modulus size, each length taking up to
+ * 3 bytes
+ */
+static int
+piv_template_max_len(unsigned char algorithm)
+{
+    return 4 + 2 + 4 + piv_rsa_bits(algorithm) / 8;
+}
+
+/*
+ * GENERAL AUTHENTICATE with the dynamic authentication template
+ * 7C { 82 00, 81 <challenge> }, answered with 7C { 82 <response> }
+ */
+static VCardResponse *
+piv_general_authenticate(VCard *card, VCardAppletPrivate *applet_private,
+                         VCardAPDU *apdu, unsigned char *data, int data_len)
+{
+    const unsigned char *p = data, *end = data + data_len;
+    const unsigned char *challenge = NULL;
+    unsigned char *buffer;
+    GByteArray *template, *out;
+    VCardResponse *response;
+    VCardKey *key = NULL;
+    vcard_7816_status_t status;
+    int len, challenge_len = 0;
+    gboolean response_requested = FALSE;
+    int i;
+
+    for (i = 0; i < applet_private->key_count; i++) {
+        if (piv_key_refs[i] == apdu->a_p2) {
+            key = applet_private->keys[i];
+            break;
+        }
+    }
+    if (key == NULL) {
+        return vcard_make_response(VCARD7816_STATUS_ERROR_DATA_NOT_FOUND);
+    }
+    if (piv_rsa_bits(apdu->a_p1) != vcard_emul_rsa_bits(key)) {
+        return vcard_make_response(VCARD7816_STATUS_ERROR_P1_P2_INCORRECT);
+    }
+    /* the card authentication key is the only one usable without the PIN */
+    if (apdu->a_p2 != 0x9E && !vcard_emul_is_logged_in(card)) {
+        return vcard_make_response(
+            VCARD7816_STATUS_ERROR_SECURITY_NOT_SATISFIED);
+    }
+
+    if (p >= end || *p++ != 0x7C || !piv_get_length(&p, end, &len)) {
+        return vcard_make_response(
+            VCARD7816_STATUS_ERROR_WRONG_PARAMETERS_IN_DATA);
+    }
+    end = p + len;
+    while (p < end) {
+        unsigned char tag = *p++;
+
+        if (!piv_get_length(&p, end, &len)) {
+            return vcard_make_response(
+                VCARD7816_STATUS_ERROR_WRONG_PARAMETERS_IN_DATA);
+        }
+        if (tag == 0x82 && len == 0) {
+            response_requested = TRUE;
+        } else if (tag == 0x81) {
+            challenge = p;
+            challenge_len = len;
+        }
+        p += len;
+    }
+    if (!response_requested || challenge == NULL) {
+        return vcard_make_response(
+            VCARD7816_STATUS_ERROR_WRONG_PARAMETERS_IN_DATA);
+    }
+
+    /* the operation happens in place */
+    buffer = g_malloc(challenge_len);
+    memcpy(buffer, challenge, challenge_len);
+    status = vcard_emul_rsa_op(card, key, buffer, challenge_len);
+    if (status != VCARD7816_STATUS_SUCCESS) {
+        g_free(buffer);
+        return vcard_make_response(status);
+    }
+    template = g_byte_array_sized_new(challenge_len + 4);
+    piv_put_tlv(template, 0x82, buffer, challenge_len);
+    out = g_byte_array_sized_new(template->len + 4);
+    piv_put_tlv(out, 0x7C, template->data, template->len);
+    response = vcard_response_new(card, out->data, out->len, apdu->a_Le,
+                                  VCARD7816_STATUS_SUCCESS);
+    g_byte_array_free(template, TRUE);
+    g_byte_array_free(out, TRUE);
+    g_free(buffer);
+    return response;
+}
+
+static VCardStatus
+piv_applet_process_apdu(VCard *card, VCardAPDU *apdu,
+                        VCardResponse **response)
+{
+    VCardAppletPrivate *applet_private;
+    int channel = apdu->a_channel;
+    unsigned char *data;
+    int data_len;
+
+    applet_private = vcard_get_current_applet_private(card, apdu->a_channel);
+    g_assert(applet_private);
+
+    /* a command chain is only continued by the same command */
+    if (applet_private->chain_buffer[channel] &&
+        apdu->a_ins != PIV_GENERAL_AUTHENTICATE) {
+        piv_chain_reset(applet_private, channel);
+    }
+
+    switch (apdu->a_ins) {
+    case PIV_GET_DATA:
+        *response = piv_get_data(card, applet_private, apdu);
+        break;
+    case PIV_VERIFY:
+        *response = piv_verify(card, apdu);
+        break;
+    case PIV_GENERAL_AUTHENTICATE:
+        data = apdu->a_body;
+        data_len = apdu->a_Lc;
+        if (applet_private->chain_buffer[channel] || (apdu->a_cla & 0x10)) {
+            if (applet_private->chain_len[channel] + apdu->a_Lc >
+                piv_template_max_len(apdu->a_p1)) {
+                piv_chain_reset(applet_private, channel);
+                *response = vcard_make_response(
+                    VCARD7816_STATUS_ERROR_WRONG_LENGTH);
+                break;
+            }
+            applet_private->chain_buffer[channel] = g_realloc(
+                applet_private->chain_buffer[channel],
+                applet_private->chain_len[channel] + apdu->a_Lc);
+            memcpy(applet_private->chain_buffer[channel] +
+                   applet_private->chain_len[channel],
+                   apdu->a_body, apdu->a_Lc);
+            applet_private->chain_len[channel] += apdu->a_Lc;
+            if (apdu->a_cla & 0x10) {
+                /* wait for the rest */
+                *response = vcard_make_response(VCARD7816_STATUS_SUCCESS);
+                break;
+            }
+            data = applet_private->chain_buffer[channel];
+            data_len = applet_private->chain_len[channel];
+        }
+        *response = piv_general_authenticate(card, applet_private, apdu,
+                                             data, data_len);
+        piv_chain_reset(applet_private, channel);
+        break;
+    case VCARD7816_INS_SELECT_FILE:
+    case VCARD7816_INS_GET_RESPONSE:
+        /* let the 7816 code handle these */
+        return VCARD_NEXT;
+    default:
+        *response = vcard_make_response(
+            VCARD7816_STATUS_ERROR_INS_CODE_INVALID);
+        break;
+    }
+    if (*response == NULL) {
+        *response = vcard_make_response(
+            VCARD7816_STATUS_EXC_ERROR_MEMORY_FAILURE);
+    }
+    return VCARD_DONE;
+}
+
+static VCardStatus
+piv_applet_reset(VCard *card, int channel)
+{
+    VCardAppletPrivate *applet_private;
+
+    applet_private = vcard_get_current_applet_private(card, channel);
+    if (applet_private) {
+        piv_chain_reset(applet_private, channel);
+    }
+    return VCARD_DONE;
+}
+
+/*
+ * Initialize the PIV card. This is the only public function in this file.
+ * All the rest are connected through function pointers.
+ */
+VCardStatus
+piv_card_init(G_GNUC_UNUSED VReader *reader, VCard *card,
+              unsigned char * const *cert, int cert_len[],
+              VCardKey *key[] /* adopt the keys */, int cert_count)
+{
+    VCardAppletPrivate *applet_private;
+    VCardApplet *applet;
+    int i;
+
+    g_debug("%s: called", __func__);
+
+    if (cert_count > PIV_MAX_KEYS) {
+        g_debug("%s: Too many keys", __func__);
+        return VCARD_FAIL;
+    }
+
+    applet_private = g_new0(VCardAppletPrivate, 1);
+    for (i = 0; i < cert_count; i++) {
+        applet_private->keys[i] = key[i];
+        piv_add_cert_object(applet_private, piv_cert_tags[i],
+                            cert[i], cert_len[i]);
+    }
+    applet_private->key_count = cert_count;
+    piv_add_chuid(applet_private, card);
+    piv_add_ccc(applet_private, card);
+    piv_add_key_history(applet_private);
+
+    applet = vcard_new_applet(piv_applet_process_apdu, piv_applet_reset,
+                              piv_aid, PIV_AID_LEN);
+    if (applet == NULL) {
+        piv_delete_applet_private(applet_private);
+        return VCARD_FAIL;
+    }
+    vcard_set_applet_private(applet, applet_private,
+                             piv_delete_applet_private);
+
+    /* the ISO 7816 code selects the applet */
+    vcard_set_type(card, VCARD_VM);
+    vcard_add_applet(card, applet);
+
+    return VCARD_DONE;
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */
@@ -0,0 +1,39 @@
+/*
+ * defines the entry point for the PIV card emulation (NIST SP 800-73-4).
+ * Only used by vcard_emul_type.c, and card_7816.c for the AID
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef PIV_H
+#define PIV_H 1
+
+#include "vcard.h"
+#include "vreader.h"
+
+#define PIV_GET_DATA                0xCB
+#define PIV_VERIFY                  0x20
+#define PIV_GENERAL_AUTHENTICATE    0x87
+
+/* the PIV application AID, registered for the applet */
+#define PIV_AID_LEN                 11
+extern const unsigned char piv_aid[PIV_AID_LEN];
+
+/* the application PIN, the only one implemented */
+#define PIV_PIN_APPLICATION         0x80
+
+/* the four standard key references, then the 20 retired key slots */
+#define PIV_MAX_KEYS                24
+
+/*
+ * Initialize the PIV card. The certificates are presented in the order of
+ * the key references 9A, 9C, 9D, 9E, then in the retired key slots 82-95.
+ * The keys are adopted. This is the only public function in this file. All
+ * the rest are connected through function pointers.
+ */
+VCardStatus
+piv_card_init(VReader *reader, VCard *card,
+              unsigned char * const *cert, int cert_len[],
+              VCardKey *key[], int cert_count);
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ * Replay card. The card answers from an APDU transcript recorded with a real
+ * card (see vscclient -r), optionally taking as long as the real card took,
+ * so the emulated cards can be compared with the hardware without it.
+ *
+ * The transcript is a text file with one exchange per line:
+ *
+ *   <command hex> <response hex, with the status word> [<card time in us>]
+ *
+ * Empty lines and lines starting with '#' are ignored, and a line
+ * "atr <hex>" gives the ATR of the card.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+#include "vcard.h"
+#include "vcard_emul.h"
+#include "card_7816.h"
+#include "vcardt_internal.h"
+
+/* "libcacr" in the proprietary (non registered) AID range */
+static unsigned char replay_aid[] = {
+    0xF0, 0x6C, 0x69, 0x62, 0x63, 0x61, 0x63, 0x72 };
+
+typedef struct {
+    GBytes *command;
+    GBytes *response;
+    gint64 card_time;   /* us, 0 if not recorded */
+} ReplayEntry;
+
+struct VCardAppletPrivateStruct {
+    GArray *entries;        /* ReplayEntry, in the recorded order */
+    GHashTable *index;      /* command -> GArray of the entry indexes */
+    GBytes *atr;
+    gboolean timing;
+    guint next;             /* the entry expected next */
+    guint64 served;
+    guint64 missed;
+};
+
+static GBytes *
+replay_parse_hex(const char *hex)
+{
+    size_t len = strlen(hex);
+    unsigned char *data;
+    size_t i;
+
+    if (len % 2 != 0) {
+        return NULL;
+    }
+    data = g_malloc(len / 2 + 1);
+    for (i = 0; i < len / 2; i++) {
+        int hi = g_ascii_xdigit_value(hex[2 * i]);
+        int lo = g_ascii_xdigit_value(hex[2 * i + 1]);
+
+        if (hi < 0 || lo < 0) {
+            g_free(data);
+            return NULL;
+        }
+        data[i] = hi << 4 | lo;
+    }
+    return g_bytes_new_take(data, len / 2);
+}
+
+static void
+replay_entry_clear(ReplayEntry *entry)
+{
+    g_bytes_unref(entry->command);
+    g_bytes_unref(entry->response);
+}
+
+static void
+replay_delete_applet_private(VCardAppletPrivate *applet_private)
+{
+    if (applet_private == NULL) {
+        return;
+    }
+    g_hash_table_destroy(applet_private->index);
+    g_array_free(applet_private->entries, TRUE);
+    if (applet_private->atr) {
+        g_bytes_unref(applet_private->atr);
+    }
+    g_free(applet_private);
+}
+
+static gboolean
+replay_parse_line(VCardAppletPrivate *applet_private, char *line)
+{
+    char **fields;
+    ReplayEntry entry = { NULL, NULL, 0 };
+    gboolean ret = FALSE;
+    guint i, n;
+
+    line = g_strstrip(line);
+    if (line[0] == 0 || line[0] == '#') {
+        return TRUE;
+    }
+    fields = g_strsplit_set(line, " \t", -1);
+    /* drop the empty fields between repeated blanks */
+    for (i = 0, n = 0; fields[i] != NULL; i++) {
+        if (fields[i][0] == 0) {
+            g_free(fields[i]);
+        } else {
+            fields[n++] = fields[i];
+        }
+    }
+    fields[n] = NULL;
+
+    if (g_ascii_strcasecmp(fields[0], "atr") == 0) {
+        if (n == 2 && applet_private->atr == NULL) {
+            applet_private->atr = replay_parse_hex(fields[1]);
+            ret = applet_private->atr != NULL;
+        }
+        goto exit;
+    }
+    if (n < 2 || n > 3) {
+        goto exit;
+    }
+    entry.command = replay_parse_hex(fields[0]);
+    entry.response = replay_parse_hex(fields[1]);
+    if (n == 3) {
+        entry.card_time = g_ascii_strtoll(fields[2], NULL, 10);
+    }
+    /* the response has at least the status word */
+    if (entry.command == NULL || entry.response == NULL ||
+        g_bytes_get_size(entry.response) < 2) {
+        if (entry.command) {
+            g_bytes_unref(entry.command);
+        }
+        if (entry.response) {
+            g_bytes_unref(entry.response);
+        }
+        goto exit;
+    }
+    g_array_append_val(applet_private->entries, entry);
+    ret = TRUE;
+
+exit:
+    g_strfreev(fields);
+    return ret;
+}
+
+static VCardAppletPrivate *
+replay_new_applet_private(const char *path, gboolean timing)
+{
+    VCardAppletPrivate *applet_private;
+    char *contents = NULL;
+    char **lines = NULL;
+    GError *err = NULL;
+    guint i;
+
+    if (!g_file_get_contents(path, &contents, NULL, &err)) {
+        g_warning("%s: %s", __func__, err->message);
+        g_error_free(err);
+        return NULL;
+    }
+
+    applet_private = g_new0(VCardAppletPrivate, 1);
+    applet_private->entries = g_array_new(FALSE, FALSE, sizeof(ReplayEntry));
+    g_array_set_clear_func(applet_private->entries,
+                           (GDestroyNotify)replay_entry_clear);
+    applet_private->index = g_hash_table_new_full(g_bytes_hash,
+        g_bytes_equal, NULL, (GDestroyNotify)g_array_unref);
+    applet_private->timing = timing;
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++) {
+        if (!replay_parse_line(applet_private, lines[i])) {
+            g_warning("%s: %s:%u: invalid line", __func__, path, i + 1);
+            goto failure;
+        }
+    }
+
+    /* the commands can repeat, with different responses */
+    for (i = 0; i < applet_private->entries->len; i++) {
+        ReplayEntry *entry =
+            &g_array_index(applet_private->entries, ReplayEntry, i);
+        GArray *indexes = g_hash_table_lookup(applet_private->index,
+                                              entry->command);
+
+        if (indexes == NULL) {
+            indexes = g_array_new(FALSE, FALSE, sizeof(guint));
+            g_hash_table_insert(applet_private->index, entry->command,
+                                indexes);
+        }
+        g_array_append_val(indexes, i);
+    }
+    g_debug("%s: %u exchanges from %s", __func__,
+            applet_private->entries->len, path);
+
+    g_strfreev(lines);
+    g_free(contents);
+    return applet_private;
+
+failure:
+    g_strfreev(lines);
+    g_free(contents);
+    replay_delete_applet_private(applet_private);
+    return NULL;
+}
+
+/*
+ * The exchanges are replayed in the recorded order. When the guest deviates
+ * from it, the next recording of the same command is taken, or the first one
+ * if there is none left.
+ */
+static ReplayEntry *
+replay_find(VCardAppletPrivate *applet_private, GBytes *command)
+{
+    GArray *entries = applet_private->entries;
+    GArray *indexes;
+    guint i, found;
+
+    if (applet_private->next < entries->len) {
+        ReplayEntry *entry = &g_array_index(entries, ReplayEntry,
+                                            applet_private->next);
+
+        if (g_bytes_equal(entry->command, command)) {
+            applet_private->next++;
+            return entry;
+        }
+    }
+
+    indexes = g_hash_table_lookup(applet_private->index, command);
+    if (indexes == NULL) {
+        return NULL;
+    }
+    found = g_array_index(indexes, guint, 0);
+    for (i = 0; i < indexes->len; i++) {
+        if (g_array_index(indexes, guint, i) >= applet_private->next) {
+            found = g_array_index(indexes, guint, i);
+            break;
+        }
+    }
+    applet_private->next = found + 1;
+    return &g_array_index(entries, ReplayEntry, found);
+}
+
+static VCardStatus
+replay_applet_process_apdu(VCard *card, VCardAPDU *apdu,
+                           VCardResponse **response)
+{
+    VCardAppletPrivate *applet_private;
+    ReplayEntry *entry;
+    GBytes *command;
+    const unsigned char *data;
+    gsize len;
+    gint64 start = g_get_monotonic_time();
+
+    applet_private = vcard_get_current_applet_private(card, apdu->a_channel);
+    g_assert(applet_private);
+
+    command = g_bytes_new_static(apdu->a_data, apdu->a_len);
+    entry = replay_find(applet_private, command);
+    g_bytes_unref(command);
+    if (entry == NULL) {
+        g_debug("%s: INS=0x%x not in the transcript", __func__, apdu->a_ins);
+        applet_private->missed++;
+        *response = vcard_make_response(
+            VCARD7816_STATUS_ERROR_COMMAND_NOT_SUPPORTED);
+        return VCARD_DONE;
+    }
+    applet_private->served++;
+
+    data = g_bytes_get_data(entry->response, &len);
+    *response = vcard_response_new_data(data, len - 2);
+    if (*response == NULL) {
+        return VCARD_FAIL;
+    }
+    vcard_response_set_status_bytes(*response, data[len - 2], data[len - 1]);
+
+    if (applet_private->timing && entry->card_time > 0) {
+        gint64 left = entry->card_time - (g_get_monotonic_time() - start);
+
+        if (left > 0) {
+            g_usleep(left);
+        }
+    }
+    return VCARD_DONE;
+}
+
+/* a new session starts from the beginning of the transcript */
+static VCardStatus
+replay_applet_reset(VCard *card, int channel)
+{
+    VCardAppletPrivate *applet_private;
+
+    applet_private = vcard_get_current_applet_private(card, channel);
+    if (applet_private) {
+        g_debug("%s: %" G_GUINT64_FORMAT " served, %" G_GUINT64_FORMAT
+                " not found", __func__, applet_private->served,
+                applet_private->missed);
+        applet_private->next = 0;
+    }
+    return VCARD_DONE;
+}
+
+static void
+replay_get_atr(VCard *card, unsigned char *atr, int *atr_len)
+{
+    VCardAppletPrivate *applet_private;
+    const unsigned char *data;
+    gsize len;
+
+    applet_private = vcard_get_current_applet_private(card, 0);
+    if (applet_private == NULL || applet_private->atr == NULL) {
+        vcard_emul_get_atr(card, atr, atr_len);
+        return;
+    }
+    data = g_bytes_get_data(applet_private->atr, &len);
+    len = MIN(len, (gsize)*atr_len);
+    if (atr) {
+        memcpy(atr, data, len);
+    }
+    *atr_len = len;
+}
+
+static void
+replay_mem_usage(VCardAppletPrivate *applet_private, VCardMemStats *stats)
+{
+    guint i;
+
+    vcard_mem_stats_add(stats, VCARD_MEM_CARD, sizeof(VCardAppletPrivate) +
+        applet_private->entries->len * sizeof(ReplayEntry));
+    for (i = 0; i < applet_private->entries->len; i++) {
+        ReplayEntry *entry =
+            &g_array_index(applet_private->entries, ReplayEntry, i);
+
+        vcard_mem_stats_add(stats, VCARD_MEM_APDU,
+                            g_bytes_get_size(entry->command) +
+                            g_bytes_get_size(entry->response));
+    }
+}
+
+/*
+ * Initialize the replay card. This is the only public function in this file.
+ * All the rest are connected through function pointers.
+ */
+VCardStatus
+replay_card_init(G_GNUC_UNUSED VReader *reader, VCard *card,
+                 const char *path, gboolean timing)
+{
+    VCardAppletPrivate *applet_private = NULL;
+    VCardApplet *applet;
+
+    if (path == NULL) {
+        g_warning("%s: no transcript given", __func__);
+        goto failure;
+    }
+    applet_private = replay_new_applet_private(path, timing);
+    if (applet_private == NULL) {
+        goto failure;
+    }
+    applet = vcard_new_applet(replay_applet_process_apdu, replay_applet_reset,
+                              replay_aid, sizeof(replay_aid));
+    if (applet == NULL) {
+        goto failure;
+    }
+    vcard_set_applet_private(applet, applet_private,
+                             replay_delete_applet_private);
+    vcard_set_applet_mem_usage(applet, replay_mem_usage);
+
+    /* every APDU goes to the applet, as with a passthru card */
+    vcard_set_type(card, VCARD_DIRECT);
+    vcard_set_atr_func(card, replay_get_atr);
+    vcard_add_applet(card, applet);
+
+    return VCARD_DONE;
+
+failure:
+    replay_delete_applet_private(applet_private);
+    return VCARD_FAIL;
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */
@@ -0,0 +1,24 @@
+/*
+ * defines the entry point for the replay card, which answers from an APDU
+ * transcript of a real card. Only used by vcard_emul_type.c
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef REPLAY_H
+#define REPLAY_H 1
+
+#include "vcard.h"
+#include "vreader.h"
+
+/*
+ * Initialize the replay card from the transcript in path. With timing, every
+ * response takes as long as it took the recorded card. This is the only
+ * public function in this file. All the rest are connected through function
+ * pointers.
+ */
+VCardStatus
+replay_card_init(VReader *reader, VCard *card, const char *path,
+                 gboolean timing);
+
+#endif
@@ -274,6 +274,29 @@ simpletlv_free(struct simpletlv_member *tlv, size_t tlvlen)
     g_free(tlv);
 }
 
+size_t
+simpletlv_mem_size(struct simpletlv_member *tlv, size_t tlvlen,
+                   unsigned int *objects)
+{
+    size_t i, size;
+
+    if (tlv == NULL)
+        return 0;
+
+    size = tlvlen * sizeof(struct simpletlv_member);
+    (*objects)++;
+    for (i = 0; i < tlvlen; i++) {
+        if (tlv[i].type == SIMPLETLV_TYPE_COMPOUND) {
+            size += simpletlv_mem_size(tlv[i].value.child, tlv[i].length,
+                                       objects);
+        } else if (tlv[i].value.value != NULL) {
+            size += tlv[i].length;
+            (*objects)++;
+        }
+    }
+    return size;
+}
+
 struct simpletlv_member *
 simpletlv_clone(struct simpletlv_member *tlv, size_t tlvlen)
 {
@@ -119,6 +119,14 @@ simpletlv_read_tag(unsigned char **buf, size_t buflen,
                    unsigned char *tag_out, size_t *taglen);
 
 
+/* get the memory used by dynamically allocated SimpleTLV structure
+ *
+ * The number of allocated blocks is added to the objects
+ */
+size_t
+simpletlv_mem_size(struct simpletlv_member *tlv, size_t tlvlen,
+                   unsigned int *objects);
+
 /* create a deep copy of the SimpleTLV structure
  *
  * The calling function is responsible for freeing the structure and
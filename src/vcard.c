@@ -13,6 +13,10 @@
 #include "vcard_emul.h"
 #include "card_7816t.h"
 #include "common.h"
+#include "vcardt_internal.h"
+#include "vcard_lock_internal.h"
+#include "vcard_lookup.h"
+#include "vcard_probes.h"
 
 struct VCardAppletStruct {
     VCardApplet   *next;
@@ -22,13 +26,31 @@ struct VCardAppletStruct {
     int aid_len;
     void *applet_private;
     VCardAppletPrivateFree applet_private_free;
+    VCardAppletPrivateRelease applet_private_release;
+    VCardAppletMemUsage applet_mem_usage;
+    VCardLock lock;     /* serializes the channels which selected the applet */
 };
 
+/*
+ * The state of a logical channel. The APDUs of a channel are processed one
+ * at a time, under the channel lock, while the other channels of the card
+ * run in parallel.
+ */
+typedef struct VCardChannelStruct {
+    VCardLock lock;
+    VCardApplet *applet;
+    VCardBufferResponse *buffer_response;
+    unsigned long chain_length;     /* GET RESPONSEs of the current chain */
+    gboolean open;
+} VCardChannel;
+
 struct VCardStruct {
     int reference_count;
     VCardApplet *applet_list;
-    VCardApplet *current_applet[MAX_CHANNEL];
-    VCardBufferResponse *vcard_buffer_response;
+    /* the applets with a well known AID, by their index in the lookup table */
+    VCardApplet *known_applet[VCARD_LOOKUP_AID_COUNT];
+    VCardChannel channel[MAX_CHANNEL];
+    VCardLock lock;     /* the open channels and the diagnostic counters */
     VCardType type;
     VCardEmul *vcard_private;
     VCardEmulFree vcard_private_free;
@@ -36,6 +58,7 @@ struct VCardStruct {
     unsigned int compat;
     unsigned char serial[32]; /* SHA256 of the first certificate */
     int serial_len;
+    VCardDiagStats *diag;
 };
 
 VCardBufferResponse *
@@ -79,16 +102,27 @@ vcard_reset(VCard *card, VCardPower power)
             applet = current_applet;
         }
     }
+    /* wait for the APDUs in processing, always in the channel order */
     for (i = 0; i < MAX_CHANNEL; i++) {
-        card->current_applet[i] = applet;
+        vcard_lock_lock(&card->channel[i].lock);
     }
-    if (card->vcard_buffer_response) {
-        vcard_buffer_response_delete(card->vcard_buffer_response);
-        card->vcard_buffer_response = NULL;
+    for (i = 0; i < MAX_CHANNEL; i++) {
+        VCardChannel *channel = &card->channel[i];
+
+        channel->applet = applet;
+        vcard_buffer_response_delete(channel->buffer_response);
+        channel->buffer_response = NULL;
+        channel->chain_length = 0;
+        channel->open = (i == 0);
     }
     vcard_emul_reset(card, power);
     if (applet) {
+        vcard_lock_lock(&applet->lock);
         applet->reset_applet(card, 0);
+        vcard_lock_unlock(&applet->lock);
+    }
+    for (i = MAX_CHANNEL - 1; i >= 0; i--) {
+        vcard_lock_unlock(&card->channel[i].lock);
     }
 }
 
@@ -111,6 +145,7 @@ vcard_new_applet(VCardProcessAPDU applet_process_function,
 
     applet->aid = g_memdup2(aid, aid_len);
     applet->aid_len = aid_len;
+    vcard_lock_init(&applet->lock, "applet");
     return applet;
 }
 
@@ -124,6 +159,7 @@ vcard_delete_applet(VCardApplet *applet)
     if (applet->applet_private_free) {
         applet->applet_private_free(applet->applet_private);
     }
+    vcard_lock_clear(&applet->lock);
     g_free(applet->aid);
     g_free(applet);
 }
@@ -140,10 +176,24 @@ vcard_set_applet_private(VCardApplet *applet, VCardAppletPrivate *private,
     applet->applet_private_free = private_free;
 }
 
+void
+vcard_set_applet_release(VCardApplet *applet,
+                         VCardAppletPrivateRelease private_release)
+{
+    applet->applet_private_release = private_release;
+}
+
+void
+vcard_set_applet_mem_usage(VCardApplet *applet, VCardAppletMemUsage mem_usage)
+{
+    applet->applet_mem_usage = mem_usage;
+}
+
 VCard *
 vcard_new(VCardEmul *private, VCardEmulFree private_free)
 {
     VCard *new_card;
+    int i;
 
     g_debug("%s: called", __func__);
 
@@ -152,6 +202,11 @@ vcard_new(VCardEmul *private, VCardEmulFree private_free)
     new_card->vcard_private = private;
     new_card->vcard_private_free = private_free;
     new_card->reference_count = 1;
+    vcard_lock_init(&new_card->lock, "card");
+    for (i = 0; i < MAX_CHANNEL; i++) {
+        vcard_lock_init(&new_card->channel[i].lock, "card-channel");
+    }
+    new_card->channel[0].open = TRUE;
     return new_card;
 }
 
@@ -161,7 +216,8 @@ vcard_reference(VCard *vcard)
     if (vcard == NULL) {
         return NULL;
     }
-    vcard->reference_count++;
+    /* the channels of a card can be used by several threads */
+    g_atomic_int_inc(&vcard->reference_count);
     return vcard;
 }
 
@@ -170,12 +226,12 @@ vcard_free(VCard *vcard)
 {
     VCardApplet *current_applet;
     VCardApplet *next_applet;
+    int i;
 
     if (vcard == NULL) {
         return;
     }
-    vcard->reference_count--;
-    if (vcard->reference_count != 0) {
+    if (!g_atomic_int_dec_and_test(&vcard->reference_count)) {
         return;
     }
     if (vcard->vcard_private_free) {
@@ -186,10 +242,80 @@ vcard_free(VCard *vcard)
         next_applet = current_applet->next;
         vcard_delete_applet(current_applet);
     }
-    vcard_buffer_response_delete(vcard->vcard_buffer_response);
+    for (i = 0; i < MAX_CHANNEL; i++) {
+        vcard_buffer_response_delete(vcard->channel[i].buffer_response);
+        vcard_lock_clear(&vcard->channel[i].lock);
+    }
+    vcard_lock_clear(&vcard->lock);
+    g_free(vcard->diag);
     g_free(vcard);
 }
 
+/*
+ * Drop the data the applets can rebuild on their own (encoded buffers,
+ * data fetched from the token, ...). Identity, selected applets and the
+ * login state are kept, so the next APDU continues where the last one
+ * ended. Pending GET RESPONSE data can not be rebuilt and is kept too.
+ */
+void
+vcard_hibernate(VCard *card)
+{
+    VCardApplet *current_applet;
+
+    for (current_applet = card->applet_list; current_applet;
+                                        current_applet = current_applet->next) {
+        if (current_applet->applet_private_release == NULL ||
+            current_applet->applet_private == NULL) {
+            continue;
+        }
+        vcard_lock_lock(&current_applet->lock);
+        current_applet->applet_private_release(current_applet->applet_private);
+        vcard_lock_unlock(&current_applet->lock);
+    }
+}
+
+void
+vcard_collect_mem_stats(VCard *card, VCardMemStats *stats)
+{
+    VCardApplet *current_applet;
+    int i;
+
+    vcard_mem_stats_add(stats, VCARD_MEM_CARD, sizeof(VCard));
+    for (current_applet = card->applet_list; current_applet;
+                                        current_applet = current_applet->next) {
+        vcard_mem_stats_add(stats, VCARD_MEM_CARD,
+                            sizeof(VCardApplet) + current_applet->aid_len);
+        if (current_applet->applet_mem_usage && current_applet->applet_private) {
+            /* the other channels may be processing APDUs in the applet */
+            vcard_lock_lock(&current_applet->lock);
+            current_applet->applet_mem_usage(current_applet->applet_private,
+                                             stats);
+            vcard_lock_unlock(&current_applet->lock);
+        }
+    }
+    for (i = 0; i < MAX_CHANNEL; i++) {
+        VCardBufferResponse *buffer_response;
+
+        vcard_lock_lock(&card->channel[i].lock);
+        buffer_response = card->channel[i].buffer_response;
+        if (buffer_response) {
+            vcard_mem_stats_add(stats, VCARD_MEM_APDU,
+                sizeof(VCardBufferResponse) + buffer_response->buffer_len);
+        }
+        vcard_lock_unlock(&card->channel[i].lock);
+    }
+    if (card->diag) {
+        vcard_mem_stats_add(stats, VCARD_MEM_CARD, sizeof(VCardDiagStats));
+    }
+}
+
+void
+vcard_get_mem_stats(VCard *card, VCardMemStats *stats)
+{
+    memset(stats, 0, sizeof(VCardMemStats));
+    vcard_collect_mem_stats(card, stats);
+}
+
 void
 vcard_get_atr(VCard *vcard, unsigned char *atr, int *atr_len)
 {
@@ -210,16 +336,22 @@ vcard_set_atr_func(VCard *card, VCardGetAtr get_atr)
 VCardStatus
 vcard_add_applet(VCard *card, VCardApplet *applet)
 {
+    int known;
+
     g_debug("%s: called", __func__);
 
     applet->next = card->applet_list;
     card->applet_list = applet;
+    known = vcard_lookup_aid(applet->aid, applet->aid_len);
+    if (known >= 0) {
+        card->known_applet[known] = applet;
+    }
     /* if our card-type is direct, always call the applet */
     if (card->type ==  VCARD_DIRECT) {
         int i;
 
         for (i = 0; i < MAX_CHANNEL; i++) {
-            card->current_applet[i] = applet;
+            card->channel[i].applet = applet;
         }
     }
     return VCARD_DONE;
@@ -232,13 +364,35 @@ VCardApplet *
 vcard_find_applet(VCard *card, const unsigned char *aid, int aid_len)
 {
     VCardApplet *current_applet;
-
+    int known = vcard_lookup_aid(aid, aid_len);
+
+    /* the applets with a well known AID are all indexed, so the list only
+     * needs to be searched for the other ones; a well known AID absent from
+     * this card may still be the partial name of one of its applets */
+    if (known >= 0) {
+        if (card->known_applet[known] != NULL) {
+            return card->known_applet[known];
+        }
+    } else {
+        for (current_applet = card->applet_list; current_applet;
+                                    current_applet = current_applet->next) {
+            if (current_applet->aid_len != aid_len) {
+                continue;
+            }
+            if (memcmp(current_applet->aid, aid, aid_len) == 0) {
+                return current_applet;
+            }
+        }
+    }
+    /* ISO 7816-4 partial DF name: a right-truncated AID, with at least the
+     * 5 bytes of the RID, selects the first applet whose AID starts with it */
+    if (aid_len < 5) {
+        return NULL;
+    }
     for (current_applet = card->applet_list; current_applet;
                                         current_applet = current_applet->next) {
-        if (current_applet->aid_len != aid_len) {
-            continue;
-        }
-        if (memcmp(current_applet->aid, aid, aid_len) == 0) {
+        if (current_applet->aid_len > aid_len &&
+            memcmp(current_applet->aid, aid, aid_len) == 0) {
             break;
         }
     }
@@ -261,17 +415,19 @@ vcard_select_applet(VCard *card, int channel, VCardApplet *applet)
 {
     g_assert(channel >= 0 && channel < MAX_CHANNEL);
 
-    card->current_applet[channel] = applet;
+    card->channel[channel].applet = applet;
     /* reset the applet */
     if (applet && applet->reset_applet) {
+        vcard_lock_lock(&applet->lock);
         applet->reset_applet(card, channel);
+        vcard_lock_unlock(&applet->lock);
     }
 }
 
 VCardAppletPrivate *
 vcard_get_current_applet_private(VCard *card, int channel)
 {
-    VCardApplet *applet = card->current_applet[channel];
+    VCardApplet *applet = card->channel[channel].applet;
 
     if (applet == NULL) {
         return NULL;
@@ -283,27 +439,263 @@ VCardStatus
 vcard_process_applet_apdu(VCard *card, VCardAPDU *apdu,
                           VCardResponse **response)
 {
-    if (card->current_applet[apdu->a_channel]) {
-        return card->current_applet[apdu->a_channel]->process_apdu(
-                                                        card, apdu, response);
+    VCardApplet *applet = card->channel[apdu->a_channel].applet;
+    VCardStatus status;
+
+    if (applet == NULL) {
+        return VCARD_NEXT;
     }
-    return VCARD_NEXT;
+    VCARD_PROBE3(applet_begin, card, apdu->a_channel, apdu->a_ins);
+    /* the applet private data is shared by the channels which selected it */
+    vcard_lock_lock(&applet->lock);
+    status = applet->process_apdu(card, apdu, response);
+    vcard_lock_unlock(&applet->lock);
+    VCARD_PROBE4(applet_end, card, apdu->a_channel, apdu->a_ins, status);
+    return status;
+}
+
+/*
+ * Logical channels. The caller of the channel functions below holds the
+ * lock of the channel, see vcard_channel_lock().
+ */
+void
+vcard_channel_lock(VCard *card, int channel)
+{
+    g_assert(channel >= 0 && channel < MAX_CHANNEL);
+    vcard_lock_lock(&card->channel[channel].lock);
+}
+
+void
+vcard_channel_unlock(VCard *card, int channel)
+{
+    vcard_lock_unlock(&card->channel[channel].lock);
+}
+
+/* the applet of a channel after a reset, NULL if it has to be selected */
+static VCardApplet *
+vcard_default_applet(VCard *card)
+{
+    VCardApplet *applet = NULL;
+    VCardApplet *current_applet;
+
+    if (card->type != VCARD_DIRECT) {
+        return NULL;
+    }
+    /* the last applet */
+    for (current_applet = card->applet_list; current_applet;
+                                       current_applet = current_applet->next) {
+        applet = current_applet;
+    }
+    return applet;
+}
+
+/*
+ * Take the lock of another channel than the current one. The locks of two
+ * channels are never waited for together, a busy channel is not touched.
+ */
+static gboolean
+vcard_channel_trylock(VCard *card, int current, int channel)
+{
+    return channel == current ||
+           vcard_lock_trylock(&card->channel[channel].lock);
+}
+
+static void
+vcard_channel_untrylock(VCard *card, int current, int channel)
+{
+    if (channel != current) {
+        vcard_lock_unlock(&card->channel[channel].lock);
+    }
+}
+
+/*
+ * MANAGE CHANNEL open, from the channel current. The channel 0 asks for the
+ * lowest closed one. Returns the opened channel, or -1. A channel opened from
+ * another one than the basic channel starts with its applet.
+ */
+int
+vcard_channel_open(VCard *card, int channel, int current)
+{
+    VCardChannel *c;
+    int i;
+
+    if (channel < 0 || channel >= MAX_CHANNEL) {
+        return -1;
+    }
+    vcard_lock_lock(&card->lock);
+    if (channel == 0) {
+        for (i = 1; i < MAX_CHANNEL; i++) {
+            if (!card->channel[i].open) {
+                channel = i;
+                break;
+            }
+        }
+    }
+    if (channel == 0 || card->channel[channel].open) {
+        vcard_lock_unlock(&card->lock);
+        return -1;
+    }
+    card->channel[channel].open = TRUE;
+    vcard_lock_unlock(&card->lock);
+
+    c = &card->channel[channel];
+    if (!vcard_channel_trylock(card, current, channel)) {
+        /* an APDU sent before the channel was opened is being refused, the
+         * channel keeps the state it got when closed */
+        return channel;
+    }
+    vcard_buffer_response_delete(c->buffer_response);
+    c->buffer_response = NULL;
+    c->chain_length = 0;
+    vcard_select_applet(card, channel, current == 0 ?
+                        vcard_default_applet(card) :
+                        card->channel[current].applet);
+    vcard_channel_untrylock(card, current, channel);
+    return channel;
+}
+
+/* only the basic channel and the channels opened by MANAGE CHANNEL */
+gboolean
+vcard_channel_is_open(VCard *card, int channel)
+{
+    gboolean open;
+
+    vcard_lock_lock(&card->lock);
+    open = card->channel[channel].open;
+    vcard_lock_unlock(&card->lock);
+    return open;
+}
+
+/*
+ * MANAGE CHANNEL close, from the channel current. FALSE if the channel can
+ * not be closed: the basic channel, or another channel processing an APDU.
+ */
+gboolean
+vcard_channel_close(VCard *card, int current, int channel)
+{
+    VCardChannel *c;
+
+    if (channel <= 0 || channel >= MAX_CHANNEL) {
+        return FALSE;
+    }
+    c = &card->channel[channel];
+    if (!vcard_channel_trylock(card, current, channel)) {
+        return FALSE;
+    }
+    c->applet = vcard_default_applet(card);
+    vcard_buffer_response_delete(c->buffer_response);
+    c->buffer_response = NULL;
+    c->chain_length = 0;
+    vcard_lock_lock(&card->lock);
+    c->open = FALSE;
+    vcard_lock_unlock(&card->lock);
+    vcard_channel_untrylock(card, current, channel);
+    return TRUE;
 }
 
 /*
  * Accessor functions
  */
-/* accessor functions for the response buffer */
+/* accessor functions for the response buffer of a channel */
+VCardBufferResponse *
+vcard_get_channel_buffer_response(VCard *card, int channel)
+{
+    return card->channel[channel].buffer_response;
+}
+
+void
+vcard_set_channel_buffer_response(VCard *card, int channel,
+                                  VCardBufferResponse *buffer)
+{
+    card->channel[channel].buffer_response = buffer;
+    card->channel[channel].chain_length = 0;
+    if (buffer && card->diag) {
+        vcard_lock_lock(&card->lock);
+        card->diag->chains++;
+        vcard_lock_unlock(&card->lock);
+    }
+}
+
+/* the basic channel */
 VCardBufferResponse *
 vcard_get_buffer_response(VCard *card)
 {
-    return card->vcard_buffer_response;
+    return vcard_get_channel_buffer_response(card, 0);
 }
 
 void
 vcard_set_buffer_response(VCard *card, VCardBufferResponse *buffer)
 {
-    card->vcard_buffer_response = buffer;
+    vcard_set_channel_buffer_response(card, 0, buffer);
+}
+
+/*
+ * Diagnostic counters
+ */
+void
+vcard_diag_enable(VCard *card)
+{
+    if (card->diag == NULL) {
+        card->diag = g_new0(VCardDiagStats, 1);
+    }
+}
+
+VCardDiagStats *
+vcard_get_diag_stats(VCard *card)
+{
+    return card->diag;
+}
+
+/* a copy of the counters, FALSE if the card does not keep them */
+gboolean
+vcard_get_diag_snapshot(VCard *card, VCardDiagStats *snapshot)
+{
+    if (card->diag == NULL) {
+        return FALSE;
+    }
+    vcard_lock_lock(&card->lock);
+    *snapshot = *card->diag;
+    vcard_lock_unlock(&card->lock);
+    return TRUE;
+}
+
+/* called before the APDU is processed, with the channel lock */
+void
+vcard_diag_count_apdu(VCard *card, VCardAPDU *apdu)
+{
+    VCardDiagStats *diag = card->diag;
+    VCardChannel *channel = &card->channel[apdu->a_channel];
+
+    if (diag == NULL) {
+        return;
+    }
+    vcard_lock_lock(&card->lock);
+    diag->ins_count[apdu->a_ins]++;
+    if (channel->buffer_response != NULL) {
+        if (apdu->a_ins == VCARD7816_INS_GET_RESPONSE) {
+            diag->get_responses++;
+            channel->chain_length++;
+            diag->chain_max = MAX(diag->chain_max, channel->chain_length);
+        } else {
+            diag->chains_abandoned++;
+        }
+    }
+    vcard_lock_unlock(&card->lock);
+}
+
+void
+vcard_diag_record_op(VCard *card, VCardDiagOp op, int64_t elapsed)
+{
+    VCardDiagStats *diag = card->diag;
+
+    if (diag == NULL) {
+        return;
+    }
+    vcard_lock_lock(&card->lock);
+    diag->op[op].count++;
+    diag->op[op].total += elapsed;
+    diag->op[op].max = MAX(diag->op[op].max, (uint64_t)elapsed);
+    vcard_lock_unlock(&card->lock);
 }
 
 
@@ -41,6 +41,12 @@ void vcard_delete_applet(VCardApplet *applet);
 /* accessor - set the card type specific private data */
 void vcard_set_applet_private(VCardApplet *applet, VCardAppletPrivate *_private,
                               VCardAppletPrivateFree private_free);
+/* accessor - set the hook releasing the reconstructible private data */
+void vcard_set_applet_release(VCardApplet *applet,
+                              VCardAppletPrivateRelease private_release);
+/* accessor - set the hook reporting the memory used by the private data */
+void vcard_set_applet_mem_usage(VCardApplet *applet,
+                                VCardAppletMemUsage mem_usage);
 
 /* set type of vcard */
 void vcard_set_type(VCard *card, VCardType type);
@@ -71,6 +77,10 @@ VCard *vcard_new(VCardEmul *_private, VCardEmulFree private_free);
 VCard *vcard_reference(VCard *);
 /* destructor (reference counted) */
 void vcard_free(VCard *);
+/* release the reconstructible state of all the applets on the card */
+void vcard_hibernate(VCard *card);
+/* get the memory used by the card and its applets */
+void vcard_get_mem_stats(VCard *card, VCardMemStats *stats);
 /* get the atr from the card */
 void vcard_get_atr(VCard *card, unsigned char *atr, int *atr_len);
 void vcard_set_atr_func(VCard *card, VCardGetAtr vcard_get_atr);
@@ -0,0 +1,238 @@
+/*
+ * Process-wide memory budget for the data cached by the virtual cards.
+ *
+ * The caches are kept in a single LRU list. When the budget is exceeded,
+ * the least recently used data which are not pinned are evicted through
+ * the callback of their owner.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+
+#include "vcard_cache.h"
+#include "vcard_lock_internal.h"
+
+struct VCardCacheEntryStruct {
+    VCardCacheEntry *next;  /* towards the least recently used */
+    VCardCacheEntry *prev;  /* towards the most recently used */
+    VCardCacheEvict evict;
+    void *opaque;
+    size_t size;
+    int pin_count;
+};
+
+static VCardLock vcard_cache_lock = VCARD_LOCK_INIT("cache");
+static VCardCacheEntry *vcard_cache_head; /* most recently used */
+static VCardCacheEntry *vcard_cache_tail; /* least recently used */
+static VCardCacheStats vcard_cache_stats;
+
+/*
+ * LRU list helpers, called with the lock held
+ */
+static void
+vcard_cache_unlink(VCardCacheEntry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        vcard_cache_head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        vcard_cache_tail = entry->prev;
+    }
+    entry->next = entry->prev = NULL;
+}
+
+static void
+vcard_cache_push_head(VCardCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = vcard_cache_head;
+    if (vcard_cache_head) {
+        vcard_cache_head->prev = entry;
+    } else {
+        vcard_cache_tail = entry;
+    }
+    vcard_cache_head = entry;
+}
+
+static void
+vcard_cache_drop(VCardCacheEntry *entry)
+{
+    g_debug("%s: evicting %" G_GSIZE_FORMAT " bytes", __func__, entry->size);
+    entry->evict(entry->opaque);
+    vcard_cache_stats.used -= entry->size;
+    vcard_cache_stats.evictions++;
+    vcard_cache_stats.evicted_bytes += entry->size;
+    entry->size = 0;
+}
+
+static void
+vcard_cache_shrink(void)
+{
+    VCardCacheEntry *entry, *prev;
+
+    if (vcard_cache_stats.budget == 0) {
+        return;
+    }
+    for (entry = vcard_cache_tail; entry &&
+         vcard_cache_stats.used > vcard_cache_stats.budget; entry = prev) {
+        prev = entry->prev;
+        if (entry->pin_count > 0 || entry->size == 0) {
+            continue;
+        }
+        vcard_cache_drop(entry);
+    }
+}
+
+/*
+ * public API
+ */
+void
+vcard_cache_set_budget(size_t budget)
+{
+    vcard_lock_lock(&vcard_cache_lock);
+    vcard_cache_stats.budget = budget;
+    vcard_cache_shrink();
+    vcard_lock_unlock(&vcard_cache_lock);
+}
+
+size_t
+vcard_cache_get_budget(void)
+{
+    size_t budget;
+
+    vcard_lock_lock(&vcard_cache_lock);
+    budget = vcard_cache_stats.budget;
+    vcard_lock_unlock(&vcard_cache_lock);
+    return budget;
+}
+
+void
+vcard_cache_get_stats(VCardCacheStats *stats)
+{
+    vcard_lock_lock(&vcard_cache_lock);
+    *stats = vcard_cache_stats;
+    vcard_lock_unlock(&vcard_cache_lock);
+}
+
+/*
+ * interface for the owners of the cached data
+ */
+VCardCacheEntry *
+vcard_cache_entry_new(VCardCacheEvict evict, void *opaque)
+{
+    VCardCacheEntry *entry;
+
+    entry = g_new0(VCardCacheEntry, 1);
+    entry->evict = evict;
+    entry->opaque = opaque;
+
+    vcard_lock_lock(&vcard_cache_lock);
+    vcard_cache_push_head(entry);
+    vcard_cache_stats.entries++;
+    vcard_lock_unlock(&vcard_cache_lock);
+    return entry;
+}
+
+void
+vcard_cache_entry_delete(VCardCacheEntry *entry)
+{
+    if (entry == NULL) {
+        return;
+    }
+    vcard_lock_lock(&vcard_cache_lock);
+    vcard_cache_unlink(entry);
+    vcard_cache_stats.used -= entry->size;
+    vcard_cache_stats.entries--;
+    vcard_lock_unlock(&vcard_cache_lock);
+    g_free(entry);
+}
+
+int
+vcard_cache_entry_pin(VCardCacheEntry *entry)
+{
+    int present;
+
+    if (entry == NULL) {
+        return TRUE;
+    }
+    vcard_lock_lock(&vcard_cache_lock);
+    entry->pin_count++;
+    present = entry->size > 0;
+    if (present) {
+        vcard_cache_stats.hits++;
+    } else {
+        vcard_cache_stats.misses++;
+    }
+    vcard_cache_unlink(entry);
+    vcard_cache_push_head(entry);
+    vcard_lock_unlock(&vcard_cache_lock);
+    return present;
+}
+
+void
+vcard_cache_entry_unpin(VCardCacheEntry *entry)
+{
+    if (entry == NULL) {
+        return;
+    }
+    vcard_lock_lock(&vcard_cache_lock);
+    g_assert(entry->pin_count > 0);
+    entry->pin_count--;
+    /* the entry might have been kept over the budget only by the pin */
+    vcard_cache_shrink();
+    vcard_lock_unlock(&vcard_cache_lock);
+}
+
+void
+vcard_cache_entry_charge(VCardCacheEntry *entry, size_t size)
+{
+    if (entry == NULL) {
+        return;
+    }
+    vcard_lock_lock(&vcard_cache_lock);
+    vcard_cache_stats.used -= entry->size;
+    entry->size = size;
+    vcard_cache_stats.used += size;
+    if (vcard_cache_stats.used > vcard_cache_stats.peak) {
+        vcard_cache_stats.peak = vcard_cache_stats.used;
+    }
+    vcard_cache_unlink(entry);
+    vcard_cache_push_head(entry);
+    vcard_cache_shrink();
+    vcard_lock_unlock(&vcard_cache_lock);
+}
+
+void
+vcard_cache_entry_evict(VCardCacheEntry *entry)
+{
+    if (entry == NULL) {
+        return;
+    }
+    vcard_lock_lock(&vcard_cache_lock);
+    if (entry->pin_count == 0 && entry->size > 0) {
+        vcard_cache_drop(entry);
+    }
+    vcard_lock_unlock(&vcard_cache_lock);
+}
+
+void
+vcard_cache_entry_peek(VCardCacheEntry *entry, void *opaque,
+                       VCardCachePeek peek, void *user_data)
+{
+    /* the data of the entries not registered are never evicted */
+    if (entry == NULL) {
+        peek(opaque, user_data);
+        return;
+    }
+    vcard_lock_lock(&vcard_cache_lock);
+    peek(opaque, user_data);
+    vcard_lock_unlock(&vcard_cache_lock);
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */
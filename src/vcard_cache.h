@@ -0,0 +1,63 @@
+/*
+ * Process-wide memory budget for the data cached by the virtual cards.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef VCARD_CACHE_H
+#define VCARD_CACHE_H 1
+
+#include <stddef.h>
+
+typedef struct VCardCacheEntryStruct VCardCacheEntry;
+
+/* called with the cache lock held to free the cached data of the owner */
+typedef void (*VCardCacheEvict) (void *opaque);
+/* called with the cache lock held to look at the cached data of the owner */
+typedef void (*VCardCachePeek) (void *opaque, void *user_data);
+
+typedef struct VCardCacheStatsStruct {
+    size_t budget;          /* 0 means unlimited */
+    size_t used;            /* bytes currently cached */
+    size_t peak;            /* maximum of used */
+    unsigned long entries;  /* registered caches */
+    unsigned long hits;     /* data was present when needed */
+    unsigned long misses;   /* data had to be rebuilt */
+    unsigned long evictions;
+    size_t evicted_bytes;
+} VCardCacheStats;
+
+/*
+ * calls for the applications
+ */
+/* set the budget in bytes for all the cards in the process, 0 disables */
+void vcard_cache_set_budget(size_t budget);
+size_t vcard_cache_get_budget(void);
+void vcard_cache_get_stats(VCardCacheStats *stats);
+
+/*
+ * calls for the card type emulators
+ *
+ * The owner registers the data it can rebuild on its own. Before using the
+ * data it pins the entry. If the pin reports the data are gone, the owner
+ * rebuilds them and charges their size. The data of pinned entries are never
+ * evicted. All the functions accept a NULL entry, which is never evicted.
+ */
+VCardCacheEntry *vcard_cache_entry_new(VCardCacheEvict evict, void *opaque);
+/* unregister the entry. The owner frees the data itself */
+void vcard_cache_entry_delete(VCardCacheEntry *entry);
+/* returns TRUE if the cached data are still present */
+int vcard_cache_entry_pin(VCardCacheEntry *entry);
+void vcard_cache_entry_unpin(VCardCacheEntry *entry);
+/* account size bytes of (re)built data, may evict other entries */
+void vcard_cache_entry_charge(VCardCacheEntry *entry, size_t size);
+/* drop the cached data now, unless the entry is pinned */
+void vcard_cache_entry_evict(VCardCacheEntry *entry);
+/*
+ * look at the cached data without pinning them nor touching the LRU order.
+ * They can not be evicted while peek runs
+ */
+void vcard_cache_entry_peek(VCardCacheEntry *entry, void *opaque,
+                            VCardCachePeek peek, void *user_data);
+
+#endif
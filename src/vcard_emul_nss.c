@@ -32,12 +32,15 @@
 #include <secoid.h>
 #include <secmodt.h>
 #include <sechash.h>
+#include <cryptohi.h>
+#include <secasn1.h>
 
 #include "vcard.h"
 #include "card_7816t.h"
 #include "vcard_emul.h"
 #include "vreader.h"
 #include "vevent.h"
+#include "vcard_probes.h"
 
 #include "vcardt_internal.h"
 #if defined(ENABLE_PCSC)
@@ -55,6 +58,17 @@ struct VCardKeyStruct {
     CERTCertificate *cert;
     PK11SlotInfo *slot;
     VCardEmulTriState failedX509;
+    /* True once the key turned out to be restricted to decrypting: the
+     * PKCS #1 signatures go straight to the raw operation */
+    VCardEmulTriState failedPKCS;
+    SECKEYPrivateKey *priv_key; /* kept by the in-memory tokens */
+    /* the RSA mechanisms of the token, learned when the key is mirrored */
+    PRBool does_x509;
+    PRBool does_pkcs;
+    /* the results of the operations, sized to the modulus. The key is only
+     * used under the lock of its applet */
+    unsigned char *scratch;
+    unsigned scratch_len;
 };
 
 
@@ -94,6 +108,7 @@ struct VCardEmulOptionsStruct {
     VCardEmulType hw_card_type;
     char *hw_type_params;
     int use_hw;
+    int mem_token;
 };
 
 static int nss_emul_init;
@@ -157,6 +172,14 @@ vcard_emul_make_key(PK11SlotInfo *slot, CERTCertificate *cert)
     key->slot = PK11_ReferenceSlot(slot);
     key->cert = CERT_DupCertificate(cert);
     key->failedX509 = VCardEmulUnknown;
+    key->failedPKCS = VCardEmulUnknown;
+    key->priv_key = NULL;
+    /* the slot keeps the mechanism list of the token, no need to ask again
+     * on each operation */
+    key->does_x509 = PK11_DoesMechanism(slot, CKM_RSA_X_509);
+    key->does_pkcs = PK11_DoesMechanism(slot, CKM_RSA_PKCS);
+    key->scratch = NULL;
+    key->scratch_len = 0;
     return key;
 }
 
@@ -173,6 +196,13 @@ vcard_emul_delete_key(VCardKey *key)
     if (key->slot) {
         PK11_FreeSlot(key->slot);
     }
+    if (key->priv_key) {
+        SECKEY_DestroyPrivateKey(key->priv_key);
+    }
+    if (key->scratch) {
+        memset(key->scratch, 0, key->scratch_len);
+    }
+    g_free(key->scratch);
     g_free(key);
 }
 
@@ -236,6 +266,59 @@ vcard_emul_rsa_bits(VCardKey *key)
     return bits;
 }
 
+/* get the certificate DER, the key keeps the reference */
+unsigned char *
+vcard_emul_get_cert(VCardKey *key, int *cert_len)
+{
+    if (key == NULL || key->cert == NULL) {
+        return NULL;
+    }
+    *cert_len = key->cert->derCert.len;
+    return key->cert->derCert.data;
+}
+
+/*
+ * The length of the PKCS #1 signature padding 00 01 ff .. ff 00 which starts
+ * the buffer, or 0 if the buffer does not start with one. The ff bytes are
+ * compared a word at a time.
+ */
+static int
+vcard_emul_pkcs1_sig_pad_len(const unsigned char *buffer, int buffer_size)
+{
+    int i = 2;
+
+    if (buffer_size < 3 || buffer[0] != 0 || buffer[1] != 1) {
+        return 0;
+    }
+    for (; i + (int)sizeof(uint64_t) <= buffer_size; i += sizeof(uint64_t)) {
+        uint64_t word;
+
+        memcpy(&word, &buffer[i], sizeof(word));
+        if (word != UINT64_MAX) {
+            break;
+        }
+    }
+    while (i < buffer_size && buffer[i] == 0xff) {
+        i++;
+    }
+    if (i >= buffer_size || buffer[i] != 0) {
+        return 0;
+    }
+    return i + 1;
+}
+
+/* the scratch buffer of the key, for a result of len bytes */
+static unsigned char *
+vcard_emul_key_scratch(VCardKey *key, unsigned len)
+{
+    if (key->scratch_len < len) {
+        g_free(key->scratch);
+        key->scratch = g_malloc(len);
+        key->scratch_len = len;
+    }
+    return key->scratch;
+}
+
 /* RSA sign/decrypt with the key, signature happens 'in place' */
 vcard_7816_status_t
 vcard_emul_rsa_op(VCard *card, VCardKey *key,
@@ -243,24 +326,28 @@ vcard_emul_rsa_op(VCard *card, VCardKey *key,
 {
     SECKEYPrivateKey *priv_key;
     unsigned signature_len;
-    PK11SlotInfo *slot;
     SECStatus rv;
-    unsigned char buf[2048];
-    unsigned char *bp = NULL;
+    unsigned char *bp;
     int pad_len;
+    PRBool use_x509;
     vcard_7816_status_t ret = VCARD7816_STATUS_SUCCESS;
+    gint64 start = g_get_monotonic_time();
 
     assert(buffer_size >= 0);
+    VCARD_PROBE3(rsa_op_begin, card, key, buffer_size);
     if ((!nss_emul_init) || (key == NULL)) {
+        VCARD_PROBE3(rsa_op_end, card, key,
+                     VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED);
         /* couldn't get the key, indicate that we aren't logged in */
         return VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED;
     }
-    priv_key = vcard_emul_get_nss_key(key);
+    priv_key = key->priv_key ? key->priv_key : vcard_emul_get_nss_key(key);
     if (priv_key == NULL) {
+        VCARD_PROBE3(rsa_op_end, card, key,
+                     VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED);
         /* couldn't get the key, indicate that we aren't logged in */
         return VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED;
     }
-    slot = vcard_emul_card_get_slot(card);
 
     /*
      * this is only true of the rsa signature
@@ -270,33 +357,69 @@ vcard_emul_rsa_op(VCard *card, VCardKey *key,
         ret = VCARD7816_STATUS_ERROR_DATA_INVALID;
         goto cleanup;
     }
-    /* be able to handle larger keys if necessary */
-    bp = &buf[0];
-    if (sizeof(buf) < signature_len) {
-        bp = g_malloc(signature_len);
-    }
+    bp = vcard_emul_key_scratch(key, signature_len);
 
     /*
-     * do the raw operations. Some tokens claim to do CKM_RSA_X_509, but then
-     * choke when they try to do the actual operations. Try to detect
-     * those cases and treat them as if the token didn't claim support for
-     * X_509.
+     * A PKCS #1 formatted signature is signed with CKM_RSA_PKCS, which gives
+     * the same result as the raw operation. The other buffers need the raw
+     * operation, some tokens claim to do CKM_RSA_X_509, but then choke when
+     * they try to do the actual operations. Try to detect those cases and
+     * treat them as if the token didn't claim support for X_509.
+     *
+     * NOTE: even if we accidentally got an encrypt buffer, which through
+     * sheer luck started with 00, 01, ff, 00, it won't matter because the
+     * resulting Sign operation will effectively decrypt the real buffer.
      */
-    if (key->failedX509 != VCardEmulTrue
-                              && PK11_DoesMechanism(slot, CKM_RSA_X_509)) {
+    use_x509 = key->does_x509 && key->failedX509 != VCardEmulTrue;
+    pad_len = key->does_pkcs ?
+              vcard_emul_pkcs1_sig_pad_len(buffer, buffer_size) : 0;
+    /* a key without CKA_SIGN would fail the signature, learn it before
+     * the first one rather than paying the failed PK11_Sign() on each
+     * operation; the outcome of the signature settles it otherwise */
+    if (pad_len > 0 && key->failedPKCS == VCardEmulUnknown && use_x509 &&
+        !PK11_HasAttributeSet(priv_key->pkcs11Slot, priv_key->pkcs11ID,
+                              CKA_SIGN, PR_FALSE)) {
+        key->failedPKCS = VCardEmulTrue;
+    }
+    if (pad_len > 0 && !(use_x509 && key->failedPKCS == VCardEmulTrue)) {
+        SECItem signature;
+        SECItem hash;
+
+        hash.data = &buffer[pad_len];
+        hash.len = buffer_size - pad_len;
+        signature.data = bp;
+        signature.len = signature_len;
+        rv = PK11_Sign(priv_key,  &signature, &hash);
+        if (rv == SECSuccess) {
+            assert((unsigned)buffer_size == signature.len);
+            memcpy(buffer, bp, signature.len);
+            key->failedPKCS = VCardEmulFalse;
+            goto cleanup;
+        }
+        if (!use_x509) {
+            ret = vcard_emul_map_error(PORT_GetError());
+            goto cleanup;
+        }
+        /* the key may be restricted to decrypting, try the raw operation */
+    }
+    if (use_x509) {
         rv = PK11_PrivDecryptRaw(priv_key, bp, &signature_len, signature_len,
                                  buffer, buffer_size);
         if (rv == SECSuccess) {
             assert((unsigned)buffer_size == signature_len);
             memcpy(buffer, bp, signature_len);
             key->failedX509 = VCardEmulFalse;
+            if (pad_len > 0 && key->failedPKCS == VCardEmulUnknown) {
+                /* the signature failed where the raw operation worked */
+                key->failedPKCS = VCardEmulTrue;
+            }
             goto cleanup;
         }
         /*
          * we've had a successful X509 operation, this failure must be
          * something else
          */
-        if (key->failedX509 == VCardEmulFalse) {
+        if (key->failedX509 == VCardEmulFalse || pad_len > 0) {
             ret = vcard_emul_map_error(PORT_GetError());
             goto cleanup;
         }
@@ -305,49 +428,6 @@ vcard_emul_rsa_op(VCard *card, VCardKey *key,
          * non-x_509 case
          */
     }
-    /* token does not support CKM_RSA_X509, emulate that with CKM_RSA_PKCS */
-    /* is this a PKCS #1 formatted signature? */
-    if ((buffer[0] == 0) && (buffer[1] == 1)) {
-        int i;
-
-        for (i = 2; i < buffer_size; i++) {
-            /* rsa signature pad */
-            if (buffer[i] != 0xff) {
-                break;
-            }
-        }
-        if ((i < buffer_size) && (buffer[i] == 0)) {
-            /* yes, we have a properly formatted PKCS #1 signature */
-            /*
-             * NOTE: even if we accidentally got an encrypt buffer, which
-             * through sheer luck started with 00, 01, ff, 00, it won't matter
-             * because the resulting Sign operation will effectively decrypt
-             * the real buffer.
-             */
-            SECItem signature;
-            SECItem hash;
-
-            i++;
-            hash.data = &buffer[i];
-            hash.len = buffer_size - i;
-            signature.data = bp;
-            signature.len = signature_len;
-            rv = PK11_Sign(priv_key,  &signature, &hash);
-            if (rv != SECSuccess) {
-                ret = vcard_emul_map_error(PORT_GetError());
-                goto cleanup;
-            }
-            assert((unsigned)buffer_size == signature.len);
-            memcpy(buffer, bp, signature.len);
-            /*
-             * we got here because either the X509 attempt failed, or the
-             * token couldn't do the X509 operation, in either case stay
-             * with the PKCS version for future operations on this key
-             */
-            key->failedX509 = VCardEmulTrue;
-            goto cleanup;
-        }
-    }
     /* We can not do raw RSA operation and the bytes do not look like PKCS#1.5
      * Assuming it is deciphering operation.
      */
@@ -388,10 +468,17 @@ vcard_emul_rsa_op(VCard *card, VCardKey *key,
      */
     key->failedX509 = VCardEmulTrue;
 cleanup:
-    if (bp != buf) {
-        g_free(bp);
+    /* don't let the plain text hang around in memory until the next
+     * operation */
+    if (key->scratch) {
+        memset(key->scratch, 0, key->scratch_len);
     }
-    SECKEY_DestroyPrivateKey(priv_key);
+    if (priv_key != key->priv_key) {
+        SECKEY_DestroyPrivateKey(priv_key);
+    }
+    vcard_diag_record_op(card, VCARD_DIAG_RSA_OP,
+                         g_get_monotonic_time() - start);
+    VCARD_PROBE3(rsa_op_end, card, key, ret);
     return ret;
 }
 
@@ -414,10 +501,14 @@ vcard_emul_login(VCard *card, unsigned char *pin, int pin_len)
     unsigned char *pin_string;
     int i;
     SECStatus rv;
+    vcard_7816_status_t ret;
+    gint64 start;
 
     if (!nss_emul_init) {
         return VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED;
     }
+    VCARD_PROBE1(login_begin, card);
+    start = g_get_monotonic_time();
     slot = vcard_emul_card_get_slot(card);
      /* We depend on the PKCS #11 module internal login state here because we
       * create a separate process to handle each guest instance. If we needed
@@ -442,10 +533,15 @@ vcard_emul_login(VCard *card, unsigned char *pin, int pin_len)
                                         to be snooped */
     g_free(pin_string);
     if (rv == SECSuccess) {
-        return VCARD7816_STATUS_SUCCESS;
+        ret = VCARD7816_STATUS_SUCCESS;
+    } else {
+        /* map the error from port get error */
+        ret = VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED;
     }
-    /* map the error from port get error */
-    return VCARD7816_STATUS_ERROR_CONDITION_NOT_SATISFIED;
+    vcard_diag_record_op(card, VCARD_DIAG_LOGIN,
+                         g_get_monotonic_time() - start);
+    VCARD_PROBE2(login_end, card, ret);
+    return ret;
 }
 
 int
@@ -902,6 +998,223 @@ vcard_emul_new_event_thread(SECMODModule *module)
                      PR_UNJOINABLE_THREAD, 0);
 }
 
+/*
+ * In-memory tokens (the memtoken option). The certificates and keys are read
+ * from files or generated at startup, and kept as session objects of the NSS
+ * internal slot: there is no database, and the card needs no PIN. The keys
+ * are held by the VCardKey, so the RSA operations do not look them up.
+ */
+
+/* DER of a PEM block, NULL if there is none */
+static guchar *
+vcard_emul_mem_pem_block(const char *pem, const char *label, gsize *len)
+{
+    gchar *begin = g_strdup_printf("-----BEGIN %s-----", label);
+    gchar *end = g_strdup_printf("-----END %s-----", label);
+    const char *start, *stop;
+    guchar *der = NULL;
+
+    start = strstr(pem, begin);
+    if (start) {
+        start += strlen(begin);
+        stop = strstr(start, end);
+        if (stop) {
+            gchar *base64 = g_strndup(start, stop - start);
+
+            der = g_base64_decode(base64, len);
+            g_free(base64);
+        }
+    }
+    g_free(begin);
+    g_free(end);
+    return der;
+}
+
+/*
+ * A PEM file with the certificate and its PKCS #8 private key, or a
+ * certificate (PEM or DER) with the key in the same file name plus ".key".
+ */
+static CERTCertificate *
+vcard_emul_mem_load(PK11SlotInfo *slot, const char *path,
+                    SECKEYPrivateKey **priv_key)
+{
+    gchar *contents = NULL, *key_contents = NULL, *key_path = NULL;
+    guchar *der = NULL, *key_der = NULL;
+    gsize len, der_len = 0, key_len = 0, key_der_len = 0;
+    CERTCertificate *cert = NULL;
+    SECItem item;
+    SECStatus rv;
+
+    if (!g_file_get_contents(path, &contents, &len, NULL)) {
+        g_warning("%s: can not read %s", __func__, path);
+        return NULL;
+    }
+    der = vcard_emul_mem_pem_block(contents, "CERTIFICATE", &der_len);
+    if (der == NULL) {
+        der = g_memdup2(contents, len);
+        der_len = len;
+    }
+    key_der = vcard_emul_mem_pem_block(contents, "PRIVATE KEY", &key_der_len);
+    if (key_der == NULL) {
+        key_path = g_strconcat(path, ".key", NULL);
+        if (g_file_get_contents(key_path, &key_contents, &key_len, NULL)) {
+            key_der = vcard_emul_mem_pem_block(key_contents, "PRIVATE KEY",
+                                               &key_der_len);
+            if (key_der == NULL) {
+                key_der = g_memdup2(key_contents, key_len);
+                key_der_len = key_len;
+            }
+        }
+    }
+    if (key_der == NULL) {
+        g_warning("%s: no private key for %s", __func__, path);
+        goto exit;
+    }
+
+    item.type = siBuffer;
+    item.data = der;
+    item.len = der_len;
+    cert = CERT_NewTempCertificate(CERT_GetDefaultCertDB(), &item,
+                                   NULL, PR_FALSE, PR_TRUE);
+    if (cert == NULL) {
+        g_warning("%s: invalid certificate in %s", __func__, path);
+        goto exit;
+    }
+
+    item.data = key_der;
+    item.len = key_der_len;
+    rv = PK11_ImportDERPrivateKeyInfoAndReturnKey(slot, &item, NULL, NULL,
+                                                  PR_FALSE, PR_FALSE, KU_ALL,
+                                                  priv_key, NULL);
+    if (rv != SECSuccess) {
+        g_warning("%s: invalid private key for %s", __func__, path);
+        CERT_DestroyCertificate(cert);
+        cert = NULL;
+    }
+
+exit:
+    /* don't let the key hang around in memory */
+    if (key_der) {
+        memset(key_der, 0, key_der_len);
+    }
+    if (key_contents) {
+        memset(key_contents, 0, key_len);
+    } else {
+        memset(contents, 0, len);
+    }
+    g_free(key_der);
+    g_free(key_contents);
+    g_free(key_path);
+    g_free(der);
+    g_free(contents);
+    return cert;
+}
+
+/* a new RSA key with a self-signed certificate */
+static CERTCertificate *
+vcard_emul_mem_generate(PK11SlotInfo *slot, int bits, int serial,
+                        SECKEYPrivateKey **priv_key)
+{
+    PK11RSAGenParams params;
+    SECKEYPublicKey *pub_key = NULL;
+    CERTSubjectPublicKeyInfo *spki = NULL;
+    CERTCertificateRequest *request = NULL;
+    CERTValidity *validity = NULL;
+    CERTName *name = NULL;
+    CERTCertificate *tbs = NULL, *cert = NULL;
+    SECItem der = { siBuffer, NULL, 0 };
+    PRTime now = PR_Now();
+    gchar *subject;
+
+    params.keySizeInBits = bits;
+    params.pe = 65537;
+    *priv_key = PK11_GenerateKeyPair(slot, CKM_RSA_PKCS_KEY_PAIR_GEN, &params,
+                                     &pub_key, PR_FALSE, PR_FALSE, NULL);
+    if (*priv_key == NULL) {
+        g_warning("%s: can not generate a %d bit key", __func__, bits);
+        return NULL;
+    }
+
+    subject = g_strdup_printf("CN=libcacard memtoken %d", serial);
+    name = CERT_AsciiToName(subject);
+    g_free(subject);
+    spki = SECKEY_CreateSubjectPublicKeyInfo(pub_key);
+    validity = CERT_CreateValidity(now, now + (PRTime)365 * 24 * 3600 *
+                                   PR_USEC_PER_SEC);
+    if (name == NULL || spki == NULL || validity == NULL) {
+        goto exit;
+    }
+    request = CERT_CreateCertificateRequest(name, spki, NULL);
+    if (request == NULL) {
+        goto exit;
+    }
+    tbs = CERT_CreateCertificate(serial, name, validity, request);
+    if (tbs == NULL) {
+        goto exit;
+    }
+    if (SECOID_SetAlgorithmID(tbs->arena, &tbs->signature,
+                              SEC_OID_PKCS1_SHA256_WITH_RSA_ENCRYPTION,
+                              NULL) != SECSuccess ||
+        SEC_ASN1EncodeItem(tbs->arena, &der, tbs,
+                           SEC_ASN1_GET(CERT_CertificateTemplate)) == NULL ||
+        SEC_DerSignData(tbs->arena, &tbs->derCert, der.data, der.len,
+                        *priv_key, SEC_OID_PKCS1_SHA256_WITH_RSA_ENCRYPTION)
+            != SECSuccess) {
+        goto exit;
+    }
+    cert = CERT_NewTempCertificate(CERT_GetDefaultCertDB(), &tbs->derCert,
+                                   NULL, PR_FALSE, PR_TRUE);
+
+exit:
+    if (cert == NULL) {
+        g_warning("%s: can not create the certificate", __func__);
+        SECKEY_DestroyPrivateKey(*priv_key);
+        *priv_key = NULL;
+    }
+    if (tbs) {
+        CERT_DestroyCertificate(tbs);
+    }
+    if (request) {
+        CERT_DestroyCertificateRequest(request);
+    }
+    if (validity) {
+        CERT_DestroyValidity(validity);
+    }
+    if (spki) {
+        SECKEY_DestroySubjectPublicKeyInfo(spki);
+    }
+    if (name) {
+        CERT_DestroyName(name);
+    }
+    SECKEY_DestroyPublicKey(pub_key);
+    return cert;
+}
+
+/* the cert of a soft card is a file, or "gen" or "gen:{bits}" */
+static VCardKey *
+vcard_emul_mem_make_key(PK11SlotInfo *slot, const char *spec, int serial,
+                        CERTCertificate **cert)
+{
+    SECKEYPrivateKey *priv_key = NULL;
+    VCardKey *key;
+
+    if (strcmp(spec, "gen") == 0) {
+        *cert = vcard_emul_mem_generate(slot, 2048, serial, &priv_key);
+    } else if (strncmp(spec, "gen:", 4) == 0) {
+        int bits = g_ascii_strtoll(spec + 4, NULL, 10);
+
+        *cert = vcard_emul_mem_generate(slot, bits, serial, &priv_key);
+    } else {
+        *cert = vcard_emul_mem_load(slot, spec, &priv_key);
+    }
+    if (*cert == NULL) {
+        return NULL;
+    }
+    key = vcard_emul_make_key(slot, *cert);
+    key->priv_key = priv_key;
+    return key;
+}
+
 static const VCardEmulOptions default_options = {
     .nss_db = NULL,
     .vreader = NULL,
@@ -909,6 +1222,7 @@ static const VCardEmulOptions default_options = {
     .hw_card_type = VCARD_EMUL_CAC,
     .hw_type_params = NULL,
     .use_hw = USE_HW_YES,
+    .mem_token = 0,
 };
 
 
@@ -1018,7 +1332,7 @@ vcard_emul_init(const VCardEmulOptions *options)
             return VCARD_EMUL_FAIL;
         }
 
-        if (capcsc_init()) {
+        if (capcsc_init(options->hw_type_params)) {
             fprintf(stderr, "Error initializing PCSC interface.\n");
             return VCARD_EMUL_FAIL;
         }
@@ -1028,6 +1342,19 @@ vcard_emul_init(const VCardEmulOptions *options)
     }
 #endif
 
+    /* the in-memory tokens need no database */
+    if (options->mem_token) {
+        nss_ctx = NSS_InitContext("", "", "", "", NULL,
+                                  NSS_INIT_READONLY | NSS_INIT_NOCERTDB |
+                                  NSS_INIT_NOMODDB | NSS_INIT_FORCEOPEN |
+                                  NSS_INIT_NOROOTINIT);
+        if (nss_ctx == NULL) {
+            g_debug("%s: NSS_InitContext without a database failed", __func__);
+            return VCARD_EMUL_FAIL;
+        }
+        goto soft_cards;
+    }
+
     /* first initialize NSS */
     nss_db = options->nss_db;
     if (nss_db == NULL) {
@@ -1054,6 +1381,7 @@ vcard_emul_init(const VCardEmulOptions *options)
     g_free(path);
     path = NULL;
 
+soft_cards:
     /* Set password callback function */
     PK11_SetPasswordFunc(vcard_emul_get_password);
 
@@ -1067,7 +1395,11 @@ vcard_emul_init(const VCardEmulOptions *options)
         VCardKey **keys;
         PK11SlotInfo *slot;
 
-        slot = PK11_FindSlotByName(options->vreader[i].name);
+        if (options->mem_token) {
+            slot = PK11_GetInternalSlot();
+        } else {
+            slot = PK11_FindSlotByName(options->vreader[i].name);
+        }
         if (slot == NULL) {
             continue;
         }
@@ -1082,22 +1414,37 @@ vcard_emul_init(const VCardEmulOptions *options)
 
         cert_count = 0;
         for (j = 0; j < options->vreader[i].cert_count; j++) {
-            /* we should have a better way of identifying certs than by
-             * nickname here */
-            CERTCertificate *cert = PK11_FindCertFromNickname(
+            CERTCertificate *cert;
+            VCardKey *key;
+
+            if (options->mem_token) {
+                key = vcard_emul_mem_make_key(slot,
+                                              options->vreader[i].cert_name[j],
+                                              j + 1, &cert);
+                if (key == NULL) {
+                    continue;
+                }
+            } else {
+                /* we should have a better way of identifying certs than by
+                 * nickname here */
+                cert = PK11_FindCertFromNickname(
                                         options->vreader[i].cert_name[j],
                                         NULL);
-            if (cert == NULL) {
-                continue;
+                if (cert == NULL) {
+                    continue;
+                }
+                key = vcard_emul_make_key(slot, cert);
             }
             certs[cert_count] = cert->derCert.data;
             cert_len[cert_count] = cert->derCert.len;
-            keys[cert_count] = vcard_emul_make_key(slot, cert);
+            keys[cert_count] = key;
             /* this is safe because the key is still holding a cert reference */
             CERT_DestroyCertificate(cert);
             cert_count++;
         }
-        if (cert_count) {
+        /* the replay cards answer from their transcript only */
+        if (cert_count ||
+            options->vreader[i].card_type == VCARD_EMUL_REPLAY) {
             VCard *vcard = vcard_emul_make_card(vreader, certs, cert_len,
                                                 keys, cert_count);
             vreader_insert_card(vreader, vcard);
@@ -1115,7 +1462,7 @@ vcard_emul_init(const VCardEmulOptions *options)
     }
 
     /* if we aren't suppose to use hw, skip looking up hardware tokens */
-    if (!options->use_hw) {
+    if (!options->use_hw || options->mem_token) {
         nss_emul_init = has_readers;
         g_debug("%s: returning: Not using HW", __func__);
         return has_readers ? VCARD_EMUL_OK : VCARD_EMUL_FAIL;
@@ -1218,6 +1565,7 @@ vcard_emul_finalize(void)
     }
     nss_ctx = NULL;
 
+    vcard_lock_stats_log();
     return VCARD_EMUL_OK;
 }
 
@@ -1417,6 +1765,9 @@ vcard_emul_options(const char *args)
             if (*args != 0) {
                 args++;
             }
+        } else if (strncmp(args, "memtoken", 8) == 0) {
+            opts->mem_token = 1;
+            args = find_blank(args + 8);
         } else if (strncmp(args, "nssemul", 7) == 0) {
             opts->hw_card_type = VCARD_EMUL_CAC;
             opts->use_hw = USE_HW_YES;
@@ -1515,6 +1866,7 @@ vcard_emul_usage(void)
 " hw_type={card_type_to_emulate}  (default CAC)\n"
 " hw_params={param_for_card}      (default \"\")\n"
 " nssemul                         (alias for use_hw=yes, hw_type=CAC)\n"
+" memtoken                        (soft cards from files, no NSS database)\n"
 #if defined(ENABLE_PCSC)
 " passthru                        (alias for use_hw=yes, hw_type=PASSTHRU)\n"
 #endif
@@ -1523,7 +1875,10 @@ vcard_emul_usage(void)
 "\n"
 "  {nss_database}          The location of the NSS cert & key database\n"
 "  {card_type_to_emulate}  What card interface to present to the guest\n"
-"  {param_for_card}        Card interface specific parameters\n"
+"  {param_for_card}        Card interface specific parameters, separated by\n"
+"                          colons. \"diag\" adds the diagnostic applet\n"
+"                          to CAC and PIV cards. REPLAY cards take\n"
+"                          \"file={path}\" (last) and \"timing\"\n"
 "  {slot_name}             NSS slot that contains the certs\n"
 "  {vreader_name}          Virtual reader name to present to the guest\n"
 "  {certN}                 Nickname of the certificate n on the virtual card\n"
@@ -1537,10 +1892,30 @@ vcard_emul_usage(void)
 "\n"
 "If more one or more soft= parameters are specified, these readers will be\n"
 "presented to the guest\n"
+"\n"
+"With memtoken, the soft cards are held in memory and no database is used.\n"
+"Their {slot_name} is ignored, and each {certN} is a PEM file with the\n"
+"certificate and its PKCS #8 key (or a certificate with the key in\n"
+"{certN}.key), or \"gen\" or \"gen:{bits}\" to generate an RSA key with a\n"
+"self-signed certificate. No PIN is needed.\n"
+"\n"
+"A card_type of PIV presents the certificates as a NIST SP 800-73 PIV card,\n"
+"in the key references 9A, 9C, 9D, 9E, then in the retired key slots.\n"
+"\n"
+"A card_type of REPLAY answers from an APDU transcript of a real card (see\n"
+"vscclient -r) and needs no certificate. With \"timing\", every response\n"
+"takes as long as it took the real card.\n"
 #if defined(ENABLE_PCSC)
 "\n"
 "If a hw_type of PASSTHRU is given, a connection will be made to the hardware\n"
 "using libpcscslite.  Note that in that case, no soft cards are permitted.\n"
+"With hw_params=t0_local, the 61xx and 6Cxx status words of T=0 cards are\n"
+"handled by the passthru layer instead of the guest. With hw_params=share,\n"
+"the card can be shared with the passthru readers of other processes: the\n"
+"APDUs of each guest are sent in PC/SC transactions, and its applet is\n"
+"selected again when it gets the card back. A PIN verified by the guest does\n"
+"not carry over: the card is reset at the end of the transaction, so the\n"
+"guest has to verify it again in its next one.\n"
 #endif
 );
 }
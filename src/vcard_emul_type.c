@@ -11,15 +11,58 @@
 
 #include <glib.h>
 
+#include <string.h>
 #include <strings.h>
 #include "vcardt.h"
 #include "vcard_emul_type.h"
 #include "cac.h"
 #include "gp.h"
 #include "msft.h"
+#include "diag.h"
+#include "replay.h"
+#include "piv.h"
+#include "vcardt_internal.h"
+
+gboolean
+vcard_params_has_flag(const char *params, const char *flag)
+{
+    size_t flag_len = strlen(flag);
+
+    while (params && *params) {
+        if (strncasecmp(params, flag, flag_len) == 0 &&
+            (params[flag_len] == 0 || params[flag_len] == ':')) {
+            return TRUE;
+        }
+        params = strchr(params, ':');
+        if (params) {
+            params++;
+        }
+    }
+    return FALSE;
+}
+
+/* value of the "name=" parameter, which takes the rest of the parameters so
+ * that it can hold a path */
+static const char *
+vcard_params_get_value(const char *params, const char *name)
+{
+    size_t name_len = strlen(name);
+
+    while (params && *params) {
+        if (strncasecmp(params, name, name_len) == 0 &&
+            params[name_len] == '=') {
+            return params + name_len + 1;
+        }
+        params = strchr(params, ':');
+        if (params) {
+            params++;
+        }
+    }
+    return NULL;
+}
 
 VCardStatus vcard_init(VReader *vreader, VCard *vcard,
-                       VCardEmulType type, G_GNUC_UNUSED const char *params,
+                       VCardEmulType type, const char *params,
                        unsigned char *const *cert, int cert_len[],
                        VCardKey *key[], int cert_count)
 {
@@ -37,6 +80,20 @@ VCardStatus vcard_init(VReader *vreader, VCard *vcard,
             rv = gp_card_init(vreader, vcard);
         if (rv == VCARD_DONE)
             rv = msft_card_init(vreader, vcard);
+        if (rv == VCARD_DONE && vcard_params_has_flag(params, "diag"))
+            rv = diag_card_init(vreader, vcard);
+        return rv;
+    case VCARD_EMUL_REPLAY:
+        return replay_card_init(vreader, vcard,
+                                vcard_params_get_value(params, "file"),
+                                vcard_params_has_flag(params, "timing"));
+    case VCARD_EMUL_PIV:
+        rv = piv_card_init(vreader, vcard,
+            cert, cert_len, key, cert_count);
+        if (rv == VCARD_DONE)
+            rv = gp_card_init(vreader, vcard);
+        if (rv == VCARD_DONE && vcard_params_has_flag(params, "diag"))
+            rv = diag_card_init(vreader, vcard);
         return rv;
     /* add new ones here */
     case VCARD_EMUL_PASSTHRU:
@@ -58,6 +115,12 @@ VCardEmulType vcard_emul_type_from_string(const char *type_string)
      if (strcasecmp(type_string, "CAC") == 0) {
         return VCARD_EMUL_CAC;
      }
+     if (strcasecmp(type_string, "PIV") == 0) {
+        return VCARD_EMUL_PIV;
+     }
+     if (strcasecmp(type_string, "REPLAY") == 0) {
+        return VCARD_EMUL_REPLAY;
+     }
 #ifdef ENABLE_PCSC
      if (strcasecmp(type_string, "PASSTHRU") == 0) {
         return VCARD_EMUL_PASSTHRU;
@@ -20,7 +20,9 @@
 typedef enum {
      VCARD_EMUL_NONE = 0,
      VCARD_EMUL_CAC,
-     VCARD_EMUL_PASSTHRU
+     VCARD_EMUL_PASSTHRU,
+     VCARD_EMUL_REPLAY,
+     VCARD_EMUL_PIV
 } VCardEmulType;
 
 /* functions used by the rest of the emulator */
@@ -0,0 +1,306 @@
+/*
+ * Mutexes with optional contention instrumentation.
+ *
+ * When the instrumentation is off, locking costs a check of a flag on top of
+ * the GMutex. When it is on, the uncontended case is detected with a trylock
+ * and only the contended acquisitions are timed.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "vcard_lock_internal.h"
+#include "vcardt_internal.h"
+
+struct VCardLockClassStruct {
+    VCardLockClass *next;
+    char *name;
+    GMutex stats_lock;
+    VCardLockStats stats;
+};
+
+/* the classes are never freed, so the locks can keep pointers to them */
+static VCardLockClass *vcard_lock_classes;
+static int vcard_lock_class_count;
+static GMutex vcard_lock_classes_lock;
+
+/* -1 until the environment was checked */
+static gint vcard_lock_stats_enabled = -1;
+
+static gboolean
+vcard_lock_stats_active(void)
+{
+    gint enabled = g_atomic_int_get(&vcard_lock_stats_enabled);
+
+    if (G_UNLIKELY(enabled < 0)) {
+        const char *env = g_getenv("LIBCACARD_LOCK_STATS");
+
+        enabled = env != NULL && g_strcmp0(env, "0") != 0;
+        g_atomic_int_compare_and_exchange(&vcard_lock_stats_enabled, -1,
+                                          enabled);
+        enabled = g_atomic_int_get(&vcard_lock_stats_enabled);
+    }
+    return enabled;
+}
+
+static VCardLockClass *
+vcard_lock_class_get(const char *name)
+{
+    VCardLockClass *lock_class;
+
+    g_mutex_lock(&vcard_lock_classes_lock);
+    for (lock_class = vcard_lock_classes; lock_class;
+         lock_class = lock_class->next) {
+        if (g_strcmp0(lock_class->name, name) == 0) {
+            break;
+        }
+    }
+    if (lock_class == NULL) {
+        lock_class = g_new0(VCardLockClass, 1);
+        lock_class->name = g_strdup(name);
+        lock_class->stats.name = lock_class->name;
+        g_mutex_init(&lock_class->stats_lock);
+        lock_class->next = vcard_lock_classes;
+        vcard_lock_classes = lock_class;
+        vcard_lock_class_count++;
+    }
+    g_mutex_unlock(&vcard_lock_classes_lock);
+    return lock_class;
+}
+
+static void
+vcard_lock_record_acquire(VCardLock *lock, gint64 wait, gboolean contended)
+{
+    VCardLockClass *lock_class;
+    gint64 bound = 1;
+    int i;
+
+    /* we hold the lock, so nobody else resolves the class concurrently */
+    if (lock->lock_class == NULL) {
+        lock->lock_class = vcard_lock_class_get(lock->class_name);
+    }
+    lock_class = lock->lock_class;
+
+    for (i = 0; i < VCARD_LOCK_WAIT_BUCKETS - 1; i++, bound *= 10) {
+        if (wait < bound) {
+            break;
+        }
+    }
+
+    g_mutex_lock(&lock_class->stats_lock);
+    lock_class->stats.acquisitions++;
+    if (contended) {
+        lock_class->stats.contended++;
+    }
+    lock_class->stats.wait_total += wait;
+    if ((guint64)wait > lock_class->stats.wait_max) {
+        lock_class->stats.wait_max = wait;
+    }
+    lock_class->stats.wait_hist[i]++;
+    g_mutex_unlock(&lock_class->stats_lock);
+}
+
+static void
+vcard_lock_record_hold(VCardLockClass *lock_class, gint64 hold)
+{
+    g_mutex_lock(&lock_class->stats_lock);
+    if ((guint64)hold > lock_class->stats.hold_max) {
+        lock_class->stats.hold_max = hold;
+    }
+    g_mutex_unlock(&lock_class->stats_lock);
+}
+
+void
+vcard_lock_init(VCardLock *lock, const char *class_name)
+{
+    g_mutex_init(&lock->mutex);
+    lock->class_name = class_name;
+    lock->lock_class = NULL;
+    lock->acquired = 0;
+}
+
+void
+vcard_lock_clear(VCardLock *lock)
+{
+    g_mutex_clear(&lock->mutex);
+}
+
+VCardLock *
+vcard_lock_new(const char *class_name)
+{
+    VCardLock *lock = g_new(VCardLock, 1);
+
+    vcard_lock_init(lock, class_name);
+    return lock;
+}
+
+void
+vcard_lock_free(VCardLock *lock)
+{
+    if (lock == NULL) {
+        return;
+    }
+    vcard_lock_clear(lock);
+    g_free(lock);
+}
+
+void
+vcard_lock_lock(VCardLock *lock)
+{
+    gint64 start, now;
+    gboolean contended;
+
+    if (!vcard_lock_stats_active()) {
+        g_mutex_lock(&lock->mutex);
+        lock->acquired = 0;
+        return;
+    }
+    contended = !g_mutex_trylock(&lock->mutex);
+    if (contended) {
+        start = g_get_monotonic_time();
+        g_mutex_lock(&lock->mutex);
+        now = g_get_monotonic_time();
+    } else {
+        now = g_get_monotonic_time();
+        start = now;
+    }
+    lock->acquired = now;
+    vcard_lock_record_acquire(lock, now - start, contended);
+}
+
+gboolean
+vcard_lock_trylock(VCardLock *lock)
+{
+    if (!g_mutex_trylock(&lock->mutex)) {
+        return FALSE;
+    }
+    if (!vcard_lock_stats_active()) {
+        lock->acquired = 0;
+        return TRUE;
+    }
+    lock->acquired = g_get_monotonic_time();
+    vcard_lock_record_acquire(lock, 0, FALSE);
+    return TRUE;
+}
+
+void
+vcard_lock_unlock(VCardLock *lock)
+{
+    gint64 acquired = lock->acquired;
+    VCardLockClass *lock_class = lock->lock_class;
+
+    g_mutex_unlock(&lock->mutex);
+    /* the instrumentation might have been switched on while we held it */
+    if (acquired != 0 && lock_class != NULL) {
+        vcard_lock_record_hold(lock_class, g_get_monotonic_time() - acquired);
+    }
+}
+
+void
+vcard_lock_cond_wait(GCond *cond, VCardLock *lock)
+{
+    gint64 now;
+
+    if (lock->acquired != 0 && lock->lock_class != NULL) {
+        vcard_lock_record_hold(lock->lock_class,
+                               g_get_monotonic_time() - lock->acquired);
+    }
+    g_cond_wait(cond, &lock->mutex);
+    if (!vcard_lock_stats_active()) {
+        lock->acquired = 0;
+        return;
+    }
+    /* count the wake up as an acquisition which did not wait for the lock */
+    now = g_get_monotonic_time();
+    lock->acquired = now;
+    vcard_lock_record_acquire(lock, 0, FALSE);
+}
+
+void
+vcard_lock_stats_enable(gboolean enable)
+{
+    g_atomic_int_set(&vcard_lock_stats_enabled, enable ? 1 : 0);
+}
+
+int
+vcard_lock_stats_get(VCardLockStats *stats, int max_stats)
+{
+    VCardLockClass *lock_class;
+    int count, i = 0;
+
+    g_mutex_lock(&vcard_lock_classes_lock);
+    count = vcard_lock_class_count;
+    for (lock_class = vcard_lock_classes; lock_class && i < max_stats;
+         lock_class = lock_class->next, i++) {
+        g_mutex_lock(&lock_class->stats_lock);
+        stats[i] = lock_class->stats;
+        g_mutex_unlock(&lock_class->stats_lock);
+    }
+    g_mutex_unlock(&vcard_lock_classes_lock);
+    return count;
+}
+
+void
+vcard_lock_stats_reset(void)
+{
+    VCardLockClass *lock_class;
+
+    g_mutex_lock(&vcard_lock_classes_lock);
+    for (lock_class = vcard_lock_classes; lock_class;
+         lock_class = lock_class->next) {
+        g_mutex_lock(&lock_class->stats_lock);
+        memset(&lock_class->stats, 0, sizeof(VCardLockStats));
+        lock_class->stats.name = lock_class->name;
+        g_mutex_unlock(&lock_class->stats_lock);
+    }
+    g_mutex_unlock(&vcard_lock_classes_lock);
+}
+
+char *
+vcard_lock_stats_dump(void)
+{
+    static const char *bucket_names[VCARD_LOCK_WAIT_BUCKETS] = {
+        "<1us", "<10us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms"
+    };
+    GString *out = g_string_new(NULL);
+    VCardLockStats *stats;
+    int count, i, j;
+
+    count = vcard_lock_stats_get(NULL, 0);
+    stats = g_new0(VCardLockStats, count);
+    count = MIN(count, vcard_lock_stats_get(stats, count));
+    for (i = 0; i < count; i++) {
+        g_string_append_printf(out,
+            "%s: acquisitions=%lu contended=%lu wait_total=%" G_GUINT64_FORMAT
+            "us wait_max=%" G_GUINT64_FORMAT "us hold_max=%" G_GUINT64_FORMAT
+            "us wait:", stats[i].name, stats[i].acquisitions,
+            stats[i].contended, stats[i].wait_total, stats[i].wait_max,
+            stats[i].hold_max);
+        for (j = 0; j < VCARD_LOCK_WAIT_BUCKETS; j++) {
+            g_string_append_printf(out, " %s=%lu", bucket_names[j],
+                                   stats[i].wait_hist[j]);
+        }
+        g_string_append_c(out, '\n');
+    }
+    g_free(stats);
+    return g_string_free(out, FALSE);
+}
+
+void
+vcard_lock_stats_log(void)
+{
+    char *dump;
+
+    if (!vcard_lock_stats_active()) {
+        return;
+    }
+    dump = vcard_lock_stats_dump();
+    g_message("lock statistics:\n%s", dump);
+    g_free(dump);
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */
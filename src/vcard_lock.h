@@ -0,0 +1,51 @@
+/*
+ * Mutexes with optional contention instrumentation.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef VCARD_LOCK_H
+#define VCARD_LOCK_H 1
+
+#include <glib.h>
+
+/*
+ * A mutex which belongs to a lock class. The statistics are kept per class,
+ * so all the readers share the "reader" class, for example.
+ */
+typedef struct VCardLockStruct VCardLock;
+
+/* the wait histogram buckets are < 1us, < 10us, ... < 100ms and the rest */
+#define VCARD_LOCK_WAIT_BUCKETS 7
+
+typedef struct VCardLockStatsStruct {
+    const char *name;
+    unsigned long acquisitions;
+    unsigned long contended;    /* acquisitions which had to wait */
+    guint64 wait_total;         /* microseconds */
+    guint64 wait_max;
+    unsigned long wait_hist[VCARD_LOCK_WAIT_BUCKETS];
+    guint64 hold_max;           /* microseconds */
+} VCardLockStats;
+
+VCardLock *vcard_lock_new(const char *class_name);
+void vcard_lock_free(VCardLock *lock);
+void vcard_lock_lock(VCardLock *lock);
+/* FALSE if the lock is held, without waiting for it */
+gboolean vcard_lock_trylock(VCardLock *lock);
+void vcard_lock_unlock(VCardLock *lock);
+/* g_cond_wait() on the lock, the wait does not count as holding the lock */
+void vcard_lock_cond_wait(GCond *cond, VCardLock *lock);
+
+/*
+ * The instrumentation is off by default. It can be switched on at run time
+ * or by setting LIBCACARD_LOCK_STATS=1 in the environment.
+ */
+void vcard_lock_stats_enable(gboolean enable);
+/* fill up to max_stats entries, returns the number of lock classes */
+int vcard_lock_stats_get(VCardLockStats *stats, int max_stats);
+void vcard_lock_stats_reset(void);
+/* text report of all the lock classes, free with g_free() */
+char *vcard_lock_stats_dump(void);
+
+#endif
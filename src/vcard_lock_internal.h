@@ -0,0 +1,33 @@
+/*
+ * The layout of the locks, for the structures of the library which embed
+ * them. The applications allocate theirs with vcard_lock_new().
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef VCARD_LOCK_INTERNAL_H
+#define VCARD_LOCK_INTERNAL_H 1
+
+#include <glib.h>
+
+#include "vcard_lock.h"
+
+typedef struct VCardLockClassStruct VCardLockClass;
+
+/*
+ * Static locks can be initialized with VCARD_LOCK_INIT, the others with
+ * vcard_lock_init().
+ */
+struct VCardLockStruct {
+    GMutex mutex;
+    const char *class_name;
+    VCardLockClass *lock_class; /* resolved on the first use */
+    gint64 acquired;            /* when the holder got it, 0 if unknown */
+};
+
+#define VCARD_LOCK_INIT(name) { { 0 }, name, NULL, 0 }
+
+void vcard_lock_init(VCardLock *lock, const char *class_name);
+void vcard_lock_clear(VCardLock *lock);
+
+#endif
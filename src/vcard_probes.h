@@ -0,0 +1,49 @@
+/*
+ * Static tracepoints (USDT) for perf, bpftrace and systemtap.
+ *
+ * The probes are built only with the usdt option. They are nops in the code
+ * until a tracer attaches, and compile to nothing without the option.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef VCARD_PROBES_H
+#define VCARD_PROBES_H 1
+
+#include "config.h"
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define VCARD_PROBE1(name, a1) \
+    DTRACE_PROBE1(libcacard, name, a1)
+#define VCARD_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(libcacard, name, a1, a2)
+#define VCARD_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(libcacard, name, a1, a2, a3)
+#define VCARD_PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(libcacard, name, a1, a2, a3, a4)
+#else
+#define VCARD_PROBE1(name, a1) do { } while (0)
+#define VCARD_PROBE2(name, a1, a2) do { } while (0)
+#define VCARD_PROBE3(name, a1, a2, a3) do { } while (0)
+#define VCARD_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#endif
+
+/*
+ * libcacard:apdu_begin(reader, cla, ins, len)
+ * libcacard:apdu_end(reader, ins, sw, len)
+ * libcacard:applet_begin(card, channel, ins)
+ * libcacard:applet_end(card, channel, ins, status)
+ * libcacard:rsa_op_begin(card, key, len)
+ * libcacard:rsa_op_end(card, key, sw)
+ * libcacard:login_begin(card)
+ * libcacard:login_end(card, sw)
+ * libcacard:card_insert(reader, card)
+ * libcacard:card_remove(reader)
+ * libcacard:event_enqueue(event, type, reader)
+ * libcacard:event_dequeue(event, type, reader)
+ * libcacard:event_drop(subscription, type, reader)
+ */
+
+#endif
@@ -38,3 +38,11 @@ unsigned char *vcard_alloc_atr(const char *postfix, int *atr_len)
     }
     return atr;
 }
+
+void
+vcard_mem_stats_add(VCardMemStats *stats, VCardMemSubsystem subsystem,
+                    size_t bytes)
+{
+    stats->subsystem[subsystem].bytes += bytes;
+    stats->subsystem[subsystem].objects++;
+}
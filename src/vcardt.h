@@ -9,6 +9,7 @@
  * these should come from some common spice header file
  */
 #include <assert.h>
+#include <stddef.h>
 #ifndef MIN
 #define MIN(x, y) ((x) > (y) ? (y) : (x))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
@@ -48,9 +49,31 @@ typedef VCardStatus (*VCardProcessAPDU)(VCard *card, VCardAPDU *apdu,
                                         VCardResponse **response);
 typedef VCardStatus (*VCardResetApplet)(VCard *card, int channel);
 typedef void (*VCardAppletPrivateFree) (VCardAppletPrivate *);
+typedef void (*VCardAppletPrivateRelease) (VCardAppletPrivate *);
 typedef void (*VCardEmulFree) (VCardEmul *);
 typedef void (*VCardGetAtr) (VCard *, unsigned char *atr, int *atr_len);
 
+/*
+ * memory accounting, see vcard_get_mem_stats() and vreader_get_mem_stats()
+ */
+typedef enum {
+    VCARD_MEM_CARD,   /* reader, card, applet and their private structures */
+    VCARD_MEM_TLV,    /* SimpleTLV structures and encoded buffers */
+    VCARD_MEM_CERT,   /* copies of the certificates */
+    VCARD_MEM_APDU,   /* APDUs in processing and pending responses */
+    VCARD_MEM_EVENT,  /* events waiting in the queue */
+    VCARD_MEM_LAST
+} VCardMemSubsystem;
+
+typedef struct VCardMemStatsStruct {
+    struct {
+        size_t bytes;
+        unsigned int objects;
+    } subsystem[VCARD_MEM_LAST];
+} VCardMemStats;
+
+typedef void (*VCardAppletMemUsage) (VCardAppletPrivate *, VCardMemStats *);
+
 struct VCardBufferResponseStruct {
     unsigned char *buffer;
     int buffer_len;
@@ -1,6 +1,74 @@
 #ifndef VCARDT_INTERNAL_H
 #define VCARDT_INTERNAL_H
 
+#include <glib.h>
+#include <stdint.h>
+
+#include "vcardt.h"
+#include "vreadert.h"
+
 unsigned char *vcard_alloc_atr(const char *postfix, int *atr_len);
 
+/* the card parameters (hw_params= and soft= ones) are a list of flags
+ * separated by colons */
+gboolean vcard_params_has_flag(const char *params, const char *flag);
+
+/* account one object of the given size in the memory statistics */
+void vcard_mem_stats_add(VCardMemStats *stats, VCardMemSubsystem subsystem,
+                         size_t bytes);
+/* add the memory used by the card to the statistics */
+void vcard_collect_mem_stats(VCard *card, VCardMemStats *stats);
+/* add the memory used by the events of the reader waiting in the queue */
+void vevent_queue_collect_mem_stats(VReader *reader, VCardMemStats *stats);
+
+/* log the lock statistics, if they are enabled */
+void vcard_lock_stats_log(void);
+
+/*
+ * Diagnostic counters of a card. They are kept only on the cards which have
+ * the diagnostic applet, see diag.c.
+ */
+typedef enum {
+    VCARD_DIAG_RSA_OP,
+    VCARD_DIAG_LOGIN,
+    VCARD_DIAG_LAST
+} VCardDiagOp;
+
+typedef struct VCardDiagStatsStruct {
+    unsigned long ins_count[256];
+    struct {
+        unsigned long count;
+        uint64_t total;         /* microseconds */
+        uint64_t max;
+    } op[VCARD_DIAG_LAST];
+    unsigned long chains;           /* responses split by GET RESPONSE */
+    unsigned long chains_abandoned; /* other APDU before the end */
+    unsigned long get_responses;
+    unsigned long chain_max;        /* longest chain, on any channel */
+} VCardDiagStats;
+
+void vcard_diag_enable(VCard *card);
+/* NULL if the card does not keep the counters */
+VCardDiagStats *vcard_get_diag_stats(VCard *card);
+/* the counters are updated from several channels, copy them under the lock */
+gboolean vcard_get_diag_snapshot(VCard *card, VCardDiagStats *snapshot);
+void vcard_diag_count_apdu(VCard *card, VCardAPDU *apdu);
+void vcard_diag_record_op(VCard *card, VCardDiagOp op, int64_t elapsed);
+
+/*
+ * Logical channels. An APDU is processed under the lock of its channel, so
+ * the APDUs of different channels of a card can run in parallel.
+ */
+void vcard_channel_lock(VCard *card, int channel);
+void vcard_channel_unlock(VCard *card, int channel);
+/* MANAGE CHANNEL: the opened channel or -1, FALSE if it can not be closed */
+int vcard_channel_open(VCard *card, int channel, int current);
+gboolean vcard_channel_close(VCard *card, int current, int channel);
+gboolean vcard_channel_is_open(VCard *card, int channel);
+/* the response buffer for GET RESPONSE, per channel */
+VCardBufferResponse *vcard_get_channel_buffer_response(VCard *card,
+                                                        int channel);
+void vcard_set_channel_buffer_response(VCard *card, int channel,
+                                       VCardBufferResponse *buffer);
+
 #endif
@@ -24,5 +24,24 @@ void vevent_queue_init(void);
 VEvent *vevent_wait_next_vevent(void);
 VEvent *vevent_get_next_vevent(void);
 
+/*
+ * VEvent subscriptions. Each subscription gets its own copy of the events of
+ * the types in the mask (VEVENT_MASK()), for the readers added to it (all
+ * the readers if none was added), in a queue of at most max_queued events
+ * (0 for no limit). The events which do not fit are dropped and counted.
+ */
+VEventSubscription *vevent_subscribe(unsigned int mask,
+                                     unsigned int max_queued);
+void vevent_subscription_add_reader(VEventSubscription *subscription,
+                                    VReader *reader);
+void vevent_unsubscribe(VEventSubscription *subscription);
+VEvent *vevent_subscription_wait(VEventSubscription *subscription);
+VEvent *vevent_subscription_get(VEventSubscription *subscription);
+unsigned int vevent_subscription_get_dropped(VEventSubscription *subscription);
+/* disable the default queue when it has no consumer */
+void vevent_queue_set_default(gboolean enabled);
+/* the events waiting in the default queue and in all the subscriptions */
+unsigned int vevent_queue_get_length(void);
+
 
 #endif
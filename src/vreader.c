@@ -15,15 +15,24 @@
 #include "vreader.h"
 #include "vevent.h"
 #include "cac.h" /* just for debugging defines */
+#include "vcardt_internal.h"
+#include "vcard_lock_internal.h"
+#include "vcard_probes.h"
 
 struct VReaderStruct {
     int    reference_count;
     VCard *card;
     char *name;
     vreader_id_t id;
-    GMutex lock;
+    VCardLock lock;
     VReaderEmul  *reader_private;
     VReaderEmulFree reader_private_free;
+    /* idle policy, see vreader_hibernate_idle() */
+    unsigned int idle_timeout; /* in ms, 0 disables hibernation */
+    gint64 last_activity;
+    int xfr_active;
+    size_t xfr_bytes; /* APDUs in processing */
+    gboolean hibernated;
 };
 
 /*
@@ -91,13 +100,13 @@ apdu_ins_to_string(int ins)
 static inline void
 vreader_lock(VReader *reader)
 {
-    g_mutex_lock(&reader->lock);
+    vcard_lock_lock(&reader->lock);
 }
 
 static inline void
 vreader_unlock(VReader *reader)
 {
-    g_mutex_unlock(&reader->lock);
+    vcard_lock_unlock(&reader->lock);
 }
 
 /*
@@ -110,13 +119,18 @@ vreader_new(const char *name, VReaderEmul *private,
     VReader *reader;
 
     reader = g_new(VReader, 1);
-    g_mutex_init(&reader->lock);
+    vcard_lock_init(&reader->lock, "reader");
     reader->reference_count = 1;
     reader->name = g_strdup(name);
     reader->card = NULL;
     reader->id = (vreader_id_t)-1;
     reader->reader_private = private;
     reader->reader_private_free = private_free;
+    reader->idle_timeout = 0;
+    reader->last_activity = g_get_monotonic_time();
+    reader->xfr_active = 0;
+    reader->xfr_bytes = 0;
+    reader->hibernated = FALSE;
     return reader;
 }
 
@@ -146,7 +160,7 @@ vreader_free(VReader *reader)
         return;
     }
     vreader_unlock(reader);
-    g_mutex_clear(&reader->lock);
+    vcard_lock_clear(&reader->lock);
     if (reader->card) {
         vcard_free(reader->card);
     }
@@ -214,6 +228,52 @@ vreader_get_private(VReader *reader)
     return reader->reader_private;
 }
 
+VReaderStatus
+vreader_set_idle_timeout(VReader *reader, unsigned int timeout_ms)
+{
+    if (reader == NULL) {
+        return VREADER_NO_CARD;
+    }
+    vreader_lock(reader);
+    reader->idle_timeout = timeout_ms;
+    vreader_unlock(reader);
+    return VREADER_OK;
+}
+
+/*
+ * get the card for the APDU processing and mark the reader busy so the
+ * idle policy does not release the card state under our hands
+ */
+static VCard *
+vreader_xfr_begin(VReader *reader, int send_buf_len)
+{
+    VCard *card;
+
+    vreader_lock(reader);
+    card = vcard_reference(reader->card);
+    if (card != NULL) {
+        reader->xfr_active++;
+        reader->xfr_bytes += send_buf_len;
+        if (reader->hibernated) {
+            g_debug("%s: waking up card in reader %s", __func__, reader->name);
+            reader->hibernated = FALSE;
+        }
+    }
+    vreader_unlock(reader);
+    return card;
+}
+
+static void
+vreader_xfr_end(VReader *reader, VCard *card, int send_buf_len)
+{
+    vreader_lock(reader);
+    reader->xfr_active--;
+    reader->xfr_bytes -= send_buf_len;
+    reader->last_activity = g_get_monotonic_time();
+    vreader_unlock(reader);
+    vcard_free(card); /* free our reference */
+}
+
 static VReaderStatus
 vreader_reset(VReader *reader, VCardPower power, unsigned char *atr, int *len)
 {
@@ -246,29 +306,39 @@ vreader_power_off(VReader *reader)
 }
 
 
-VReaderStatus
-vreader_xfr_bytes(VReader *reader,
-                  unsigned char *send_buf, int send_buf_len,
-                  unsigned char *receive_buf, int *receive_buf_len)
+/*
+ * process one APDU on the card, for which the caller holds a reference.
+ * In a batch, the response is never truncated: the command is not processed
+ * when receive_buf can not hold Le bytes and the status word, and a response
+ * longer than that (only a passthru card can return one) is dropped.
+ */
+static VReaderStatus
+vreader_xfr_card(VReader *reader, VCard *card,
+                 unsigned char *send_buf, int send_buf_len,
+                 unsigned char *receive_buf, int *receive_buf_len,
+                 unsigned short *sw, gboolean batch)
 {
     VCardAPDU *apdu;
     VCardResponse *response = NULL;
     VCardStatus card_status;
     VReaderStatus ret;
     unsigned short status;
-    VCard *card = vreader_get_card(reader);
     int size;
 
-    g_debug("%s: called", __func__);
-
-    if (card == NULL) {
-        return VREADER_NO_CARD;
-    }
+    VCARD_PROBE4(apdu_begin, reader,
+                 send_buf_len > 0 ? send_buf[0] : 0,
+                 send_buf_len > 1 ? send_buf[1] : 0, send_buf_len);
 
     apdu = vcard_apdu_new(send_buf, send_buf_len, &status);
     if (apdu == NULL) {
         response = vcard_make_response(status);
         card_status = VCARD_DONE;
+    } else if (batch) {
+        if (*receive_buf_len < apdu->a_Le + 2) {
+            ret = VREADER_OUT_OF_MEMORY;
+            goto no_response;
+        }
+        card_status = vcard_process_apdu(card, apdu, &response);
     } else {
         g_debug("%s: CLS=0x%x,INS=0x%x,P1=0x%x,P2=0x%x,Lc=%d,Le=%d %s",
               __func__, apdu->a_cla, apdu->a_ins, apdu->a_p1, apdu->a_p2,
@@ -281,24 +351,194 @@ vreader_xfr_bytes(VReader *reader,
         }
     }
     if (card_status == VCARD_FAIL) {
-        *receive_buf_len = 0;
         ret = VREADER_NO_CARD;
-        goto exit;
+        goto no_response;
     }
 
     assert(card_status == VCARD_DONE && response);
+    if (batch && response->b_total_len > *receive_buf_len) {
+        ret = VREADER_OUT_OF_MEMORY;
+        goto no_response;
+    }
     size = MIN(*receive_buf_len, response->b_total_len);
     memcpy(receive_buf, response->b_data, size);
     *receive_buf_len = size;
+    if (sw) {
+        *sw = (response->b_sw1 << 8) | response->b_sw2;
+    }
     ret = VREADER_OK;
-
+    VCARD_PROBE4(apdu_end, reader, send_buf_len > 1 ? send_buf[1] : 0,
+                 (response->b_sw1 << 8) | response->b_sw2, size);
+    goto exit;
+
+ no_response:
+    *receive_buf_len = 0;
+    VCARD_PROBE4(apdu_end, reader, send_buf_len > 1 ? send_buf[1] : 0,
+                 0, -1);
  exit:
     vcard_response_delete(response);
     vcard_apdu_delete(apdu);
-    vcard_free(card); /* free our reference */
     return ret;
 }
 
+VReaderStatus
+vreader_xfr_bytes(VReader *reader,
+                  unsigned char *send_buf, int send_buf_len,
+                  unsigned char *receive_buf, int *receive_buf_len)
+{
+    VCard *card = vreader_xfr_begin(reader, send_buf_len);
+    VReaderStatus ret;
+
+    g_debug("%s: called", __func__);
+
+    /* no apdu_begin fired yet, so no apdu_end either */
+    if (card == NULL) {
+        return VREADER_NO_CARD;
+    }
+
+    ret = vreader_xfr_card(reader, card, send_buf, send_buf_len,
+                           receive_buf, receive_buf_len, NULL, FALSE);
+    vreader_xfr_end(reader, card, send_buf_len);
+    return ret;
+}
+
+static gboolean
+vreader_xfr_should_stop(unsigned short sw, unsigned int stop_on)
+{
+    unsigned char sw1 = sw >> 8;
+
+    switch (sw1) {
+    case VCARD7816_SW1_SUCCESS:
+    case VCARD7816_SW1_RESPONSE_BYTES:
+        return FALSE;
+    case VCARD7816_SW1_WARNING:
+    case VCARD7816_SW1_WARNING_CHANGE:
+        return (stop_on & VREADER_XFR_STOP_ON_WARNING) != 0;
+    default:
+        return (stop_on & VREADER_XFR_STOP_ON_ERROR) != 0;
+    }
+}
+
+/*
+ * Process the commands in order under a single card reference. The
+ * responses are stored one after another in the arena, each command gets
+ * the pointer to its response in receive_buf and the length in
+ * receive_buf_len. Returns the number of commands processed; the processing
+ * stops early when the card goes away, when the rest of the arena can not
+ * hold the full response of the next command, or on the status words
+ * selected by stop_on.
+ */
+int
+vreader_xfr_batch(VReader *reader, VReaderXfr *xfr, int count,
+                  unsigned char *arena, int arena_len, unsigned int stop_on)
+{
+    VCard *card;
+    int send_len = 0;
+    int used = 0;
+    int i;
+
+    g_debug("%s: called for %d commands", __func__, count);
+
+    for (i = 0; i < count; i++) {
+        send_len += xfr[i].send_buf_len;
+    }
+    card = vreader_xfr_begin(reader, send_len);
+    if (card == NULL) {
+        if (count > 0) {
+            xfr[0].receive_buf = NULL;
+            xfr[0].receive_buf_len = 0;
+            xfr[0].status = VREADER_NO_CARD;
+            return 1;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        unsigned short sw = 0;
+
+        xfr[i].receive_buf = arena + used;
+        xfr[i].receive_buf_len = arena_len - used;
+        /* we need at least the room for the status word */
+        if (xfr[i].receive_buf_len < 2) {
+            xfr[i].receive_buf_len = 0;
+            xfr[i].status = VREADER_OUT_OF_MEMORY;
+            i++;
+            break;
+        }
+        xfr[i].status = vreader_xfr_card(reader, card, xfr[i].send_buf,
+                                         xfr[i].send_buf_len,
+                                         xfr[i].receive_buf,
+                                         &xfr[i].receive_buf_len, &sw, TRUE);
+        used += xfr[i].receive_buf_len;
+        if (xfr[i].status != VREADER_OK ||
+            vreader_xfr_should_stop(sw, stop_on)) {
+            i++;
+            break;
+        }
+    }
+
+    vreader_xfr_end(reader, card, send_len);
+    return i;
+}
+
+/*
+ * Memory accounting
+ */
+static const char *vreader_mem_subsystem_names[VCARD_MEM_LAST] = {
+    [VCARD_MEM_CARD] = "card",
+    [VCARD_MEM_TLV] = "tlv",
+    [VCARD_MEM_CERT] = "cert",
+    [VCARD_MEM_APDU] = "apdu",
+    [VCARD_MEM_EVENT] = "event",
+};
+
+void
+vreader_get_mem_stats(VReader *reader, VCardMemStats *stats)
+{
+    VCard *card;
+
+    memset(stats, 0, sizeof(VCardMemStats));
+
+    vreader_lock(reader);
+    vcard_mem_stats_add(stats, VCARD_MEM_CARD,
+                        sizeof(VReader) + strlen(reader->name) + 1);
+    stats->subsystem[VCARD_MEM_APDU].bytes += reader->xfr_bytes;
+    stats->subsystem[VCARD_MEM_APDU].objects += reader->xfr_active;
+    card = vcard_reference(reader->card);
+    vreader_unlock(reader);
+
+    /* A busy card is counted as well: the applet and channel locks taken by
+     * vcard_collect_mem_stats() wait for the APDUs in processing. The reader
+     * lock is not held meanwhile, so the other APDUs can still start */
+    if (card) {
+        vcard_collect_mem_stats(card, stats);
+        vcard_free(card);
+    }
+
+    vevent_queue_collect_mem_stats(reader, stats);
+}
+
+static void
+vreader_mem_stats_append(GString *out, const char *name,
+                         const VCardMemStats *stats)
+{
+    size_t total_bytes = 0;
+    unsigned int total_objects = 0;
+    int i;
+
+    g_string_append_printf(out, "%s:", name);
+    for (i = 0; i < VCARD_MEM_LAST; i++) {
+        g_string_append_printf(out, " %s=%" G_GSIZE_FORMAT "/%u",
+                               vreader_mem_subsystem_names[i],
+                               stats->subsystem[i].bytes,
+                               stats->subsystem[i].objects);
+        total_bytes += stats->subsystem[i].bytes;
+        total_objects += stats->subsystem[i].objects;
+    }
+    g_string_append_printf(out, " total=%" G_GSIZE_FORMAT "/%u\n",
+                           total_bytes, total_objects);
+}
+
 struct VReaderListStruct {
     VReaderListEntry *head;
     VReaderListEntry *tail;
@@ -410,7 +650,7 @@ vreader_dequeue(VReaderList *list, VReaderListEntry *entry)
 }
 
 static VReaderList *vreader_list;
-static GMutex vreader_list_mutex;
+static VCardLock vreader_list_mutex = VCARD_LOCK_INIT("reader-list");
 
 static void
 vreader_list_init(void)
@@ -421,13 +661,13 @@ vreader_list_init(void)
 static void
 vreader_list_lock(void)
 {
-    g_mutex_lock(&vreader_list_mutex);
+    vcard_lock_lock(&vreader_list_mutex);
 }
 
 static void
 vreader_list_unlock(void)
 {
-    g_mutex_unlock(&vreader_list_mutex);
+    vcard_lock_unlock(&vreader_list_mutex);
 }
 
 static VReaderList *
@@ -569,11 +809,82 @@ vreader_insert_card(VReader *reader, VCard *card)
         reader->card = NULL;
     }
     reader->card = vcard_reference(card);
+    reader->last_activity = g_get_monotonic_time();
+    reader->hibernated = FALSE;
     vreader_unlock(reader);
+    if (card) {
+        VCARD_PROBE2(card_insert, reader, card);
+    } else {
+        VCARD_PROBE1(card_remove, reader);
+    }
     vreader_queue_card_event(reader);
     return VREADER_OK;
 }
 
+/*
+ * Release the reconstructible state of the cards which did not see any APDU
+ * for longer than the idle timeout of their reader. The state is rebuilt by
+ * the applets when the next APDU needs it. Returns the number of cards put
+ * to sleep.
+ */
+int
+vreader_hibernate_idle(void)
+{
+    VReaderListEntry *current_entry;
+    gint64 now = g_get_monotonic_time();
+    int count = 0;
+
+    vreader_list_lock();
+    for (current_entry = vreader_list_get_first(vreader_list); current_entry;
+            current_entry = vreader_list_get_next(current_entry)) {
+        VReader *reader = current_entry->reader;
+
+        vreader_lock(reader);
+        if (reader->card && reader->idle_timeout && !reader->hibernated &&
+            reader->xfr_active == 0 &&
+            now - reader->last_activity >= (gint64)reader->idle_timeout * 1000) {
+            g_debug("%s: hibernating card in reader %s", __func__, reader->name);
+            vcard_hibernate(reader->card);
+            reader->hibernated = TRUE;
+            count++;
+        }
+        vreader_unlock(reader);
+    }
+    vreader_list_unlock();
+    return count;
+}
+
+/*
+ * Report the memory used by all the readers as bytes/objects per subsystem,
+ * one reader per line followed by the totals. The caller frees the string.
+ */
+char *
+vreader_mem_dump(void)
+{
+    VReaderList *reader_list = vreader_get_reader_list();
+    VReaderListEntry *current_entry;
+    VCardMemStats stats, total;
+    GString *out = g_string_new(NULL);
+    int i;
+
+    memset(&total, 0, sizeof(total));
+    for (current_entry = vreader_list_get_first(reader_list); current_entry;
+            current_entry = vreader_list_get_next(current_entry)) {
+        VReader *reader = vreader_list_get_reader(current_entry);
+
+        vreader_get_mem_stats(reader, &stats);
+        vreader_mem_stats_append(out, reader->name, &stats);
+        for (i = 0; i < VCARD_MEM_LAST; i++) {
+            total.subsystem[i].bytes += stats.subsystem[i].bytes;
+            total.subsystem[i].objects += stats.subsystem[i].objects;
+        }
+        vreader_free(reader);
+    }
+    vreader_list_delete(reader_list);
+    vreader_mem_stats_append(out, "all readers", &total);
+    return g_string_free(out, FALSE);
+}
+
 /*
  * initialize all the static reader structures
  */
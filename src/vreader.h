@@ -18,6 +18,10 @@ VReaderStatus vreader_power_off(VReader *reader);
 VReaderStatus vreader_xfr_bytes(VReader *reader, unsigned char *send_buf,
                                 int send_buf_len, unsigned char *receive_buf,
                                 int *receive_buf_len);
+/* several commands under one card reference, see vreader.c */
+int vreader_xfr_batch(VReader *reader, VReaderXfr *xfr, int count,
+                      unsigned char *arena, int arena_len,
+                      unsigned int stop_on);
 
 /* constructor */
 VReader *vreader_new(const char *readerName, VReaderEmul *emul_private,
@@ -34,6 +38,8 @@ void vreader_queue_card_event(VReader *reader);
 const char *vreader_get_name(VReader *reader);
 vreader_id_t vreader_get_id(VReader *reader);
 VReaderStatus vreader_set_id(VReader *reader, vreader_id_t id);
+/* release card state after timeout_ms without APDUs, 0 disables */
+VReaderStatus vreader_set_idle_timeout(VReader *reader, unsigned int timeout_ms);
 
 /* list operations */
 VReaderList *vreader_get_reader_list(void);
@@ -43,6 +49,13 @@ VReaderListEntry *vreader_list_get_first(VReaderList *list);
 VReaderListEntry *vreader_list_get_next(VReaderListEntry *list);
 VReader *vreader_get_reader_by_id(vreader_id_t id);
 VReader *vreader_get_reader_by_name(const char *name);
+/* hibernate the cards idle longer than their reader's timeout */
+int vreader_hibernate_idle(void);
+
+/* memory accounting */
+void vreader_get_mem_stats(VReader *reader, VCardMemStats *stats);
+/* text report of all the readers, free with g_free() */
+char *vreader_mem_dump(void);
 
 /*
  * list tools for vcard_emul
@@ -20,5 +20,18 @@ typedef struct VReaderListEntryStruct VReaderListEntry;
 typedef struct VReaderEmulStruct VReaderEmul;
 typedef void (*VReaderEmulFree)(VReaderEmul *);
 
+/* one command of vreader_xfr_batch() */
+typedef struct VReaderXfrStruct {
+    unsigned char *send_buf;
+    int send_buf_len;
+    unsigned char *receive_buf;     /* set to the response in the arena */
+    int receive_buf_len;            /* length of the response */
+    VReaderStatus status;
+} VReaderXfr;
+
+/* status words which stop a batch, after the command returning them */
+#define VREADER_XFR_STOP_ON_ERROR   0x01 /* anything but 90 00, 61 xx, 62/63 xx */
+#define VREADER_XFR_STOP_ON_WARNING 0x02 /* 62 xx, 63 xx */
+
 #endif
 
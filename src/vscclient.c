@@ -12,11 +12,13 @@
 
 #include <glib.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #ifndef _WIN32
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -25,6 +27,11 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <getopt.h>
+/* the send queue is written through these, see socket_writev() */
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
 #endif
 
 #if defined(ENABLE_PCSC)
@@ -36,14 +43,27 @@
 # endif
 #endif
 
+#if defined(ENABLE_IO_URING)
+#include <glib-unix.h>
+#include <liburing.h>
+#include <sys/eventfd.h>
+#endif
+
 #include "vscard_common.h"
 
 #include "vreader.h"
 #include "vcard_emul.h"
 #include "vevent.h"
+#include "vcard_lock.h"
+#include "cac.h"
 
 static int verbose;
 static int with_pcsc;
+static int with_uring;
+static FILE *transcript;
+static unsigned int idle_timeout;
+static char *metrics_file;
+static unsigned int metrics_interval = 10;
 
 static void
 print_byte_array(
@@ -57,6 +77,52 @@ print_byte_array(
     printf("\n");
 }
 
+static void
+transcript_append_hex(GString *line, const uint8_t *data, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        g_string_append_printf(line, "%02X", data[i]);
+    }
+}
+
+/* the transcript can be replayed with a soft card of the REPLAY type */
+static void
+transcript_write_atr(const uint8_t *atr, int atr_len)
+{
+    static gboolean written;
+    GString *line;
+
+    if (transcript == NULL || written) {
+        return;
+    }
+    written = TRUE;
+    line = g_string_new("atr ");
+    transcript_append_hex(line, atr, atr_len);
+    fprintf(transcript, "%s\n", line->str);
+    fflush(transcript);
+    g_string_free(line, TRUE);
+}
+
+static void
+transcript_write(const uint8_t *command, int command_len,
+                 const uint8_t *response, int response_len, gint64 us)
+{
+    GString *line;
+
+    if (transcript == NULL) {
+        return;
+    }
+    line = g_string_new(NULL);
+    transcript_append_hex(line, command, command_len);
+    g_string_append_c(line, ' ');
+    transcript_append_hex(line, response, response_len);
+    fprintf(transcript, "%s %" G_GINT64_FORMAT "\n", line->str, us);
+    fflush(transcript);
+    g_string_free(line, TRUE);
+}
+
 static void
 print_usage(void) {
     printf("vscclient OPTIONS <host> <port>\n");
@@ -64,6 +130,12 @@ print_usage(void) {
     printf(" -c <certname>         - Software emulation certificates\n");
     printf(" -d <level>            - Debug level\n");
     printf(" -p                    - Use real smartcard to compare with emulator\n");
+    printf(" -i <seconds>          - Release card state after idle time\n");
+    printf(" -m <file>             - Write metrics in Prometheus text format\n");
+    printf(" -M <seconds>          - Metrics write interval (default 10)\n");
+    printf(" -u                    - Use io_uring for the socket I/O\n");
+    printf(" -r <file>             - Record the APDUs and the card timings, for\n");
+    printf("                         a REPLAY card (the real card's with -p)\n");
     vcard_emul_usage();
 }
 
@@ -111,6 +183,16 @@ static gboolean pcsc_init(void)
                       SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &scard, &protocol);
     g_return_val_if_fail(rv == SCARD_S_SUCCESS, FALSE);
 
+    if (transcript) {
+        BYTE atr[MAX_ATR_SIZE];
+        DWORD atr_len = sizeof(atr);
+
+        rv = SCardStatus(scard, NULL, NULL, NULL, NULL, atr, &atr_len);
+        if (rv == SCARD_S_SUCCESS) {
+            transcript_write_atr(atr, atr_len);
+        }
+    }
+
     switch(protocol) {
     case SCARD_PROTOCOL_T0:
         scard_pci = *SCARD_PCI_T0;
@@ -148,32 +230,152 @@ static void pcsc_deinit(void)
 #endif
 
 
+static GMainLoop *loop;
 static GIOChannel *channel_socket;
-static GByteArray *socket_to_send;
-static GMutex socket_to_send_lock;
+
+/*
+ * The messages to send are queued each in its own allocation, with the
+ * header right before the payload. A message is reserved at the end of the
+ * queue, its payload (the response of an APDU) is produced in place without
+ * the send lock, and it is committed once complete: it never moves in the
+ * meantime, when other messages are queued after it. The queue is written,
+ * with one writev(), up to the first message still reserved.
+ */
+typedef struct {
+    gboolean ready;         /* committed, can be written */
+    gsize len;              /* header and payload */
+    VSCMsgHeader header;
+    uint8_t payload[];
+} SendMsg;
+
+#define SEND_IOV_MAX 64
+
+static GQueue socket_to_send = G_QUEUE_INIT; /* SendMsg */
+static gsize socket_sent; /* bytes of the first message written */
+static gsize socket_to_send_len; /* bytes of the ready messages not written */
+static VCardLock *socket_to_send_lock;
 static guint socket_tag;
 
 static void
 update_socket_watch(void);
 
+/* the first message can be written, called with the send lock held */
+static gboolean
+send_queue_ready(void)
+{
+    SendMsg *m = g_queue_peek_head(&socket_to_send);
+
+    return m != NULL && m->ready;
+}
+
+/*
+ * The vectors of the ready messages at the head of the queue, called with
+ * the send lock held. Only the socket writer takes the messages out, so the
+ * vectors stay valid after the lock is released.
+ */
+static int
+send_queue_iov(struct iovec *iov, int max)
+{
+    gsize offset = socket_sent;
+    GList *l;
+    int n = 0;
+
+    for (l = socket_to_send.head; l != NULL && n < max; l = l->next) {
+        SendMsg *m = l->data;
+
+        if (!m->ready) {
+            break;
+        }
+        iov[n].iov_base = (uint8_t *)&m->header + offset;
+        iov[n].iov_len = m->len - offset;
+        offset = 0;
+        n++;
+    }
+    return n;
+}
+
+/* written bytes were written, called with the send lock held */
+static void
+send_queue_advance(gsize written)
+{
+    socket_to_send_len -= written;
+    written += socket_sent;
+    while (written > 0) {
+        SendMsg *m = g_queue_peek_head(&socket_to_send);
+
+        if (written < m->len) {
+            break;
+        }
+        written -= m->len;
+        g_queue_pop_head(&socket_to_send);
+        g_free(m);
+    }
+    socket_sent = written;
+}
+
+/* the number of bytes written, 0 if the socket is full, -1 on error */
+static gssize
+socket_writev(struct iovec *iov, int count)
+{
+#ifndef _WIN32
+    gssize ret;
+
+    do {
+        ret = writev(g_io_channel_unix_get_fd(channel_socket), iov, count);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return ret;
+#else
+    gssize total = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        GError *err = NULL;
+        gsize bw = 0;
+
+        g_io_channel_write_chars(channel_socket, iov[i].iov_base,
+                                 iov[i].iov_len, &bw, &err);
+        total += bw;
+        if (err != NULL) {
+            g_error_free(err);
+            return total > 0 ? total : -1;
+        }
+        if (bw < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+#endif
+}
+
 static gboolean
 do_socket_send(GIOCondition condition)
 {
-    gsize bw;
-    GError *err = NULL;
+    struct iovec iov[SEND_IOV_MAX];
+    gssize written;
+    gboolean pending;
+    int n;
 
-    g_return_val_if_fail(socket_to_send->len != 0, FALSE);
     g_return_val_if_fail(condition & G_IO_OUT, FALSE);
 
-    g_io_channel_write_chars(channel_socket,
-        (gchar *)socket_to_send->data, socket_to_send->len, &bw, &err);
-    if (err != NULL) {
-        g_error("Error while sending socket %s", err->message);
+    vcard_lock_lock(socket_to_send_lock);
+    n = send_queue_iov(iov, G_N_ELEMENTS(iov));
+    vcard_lock_unlock(socket_to_send_lock);
+
+    written = n > 0 ? socket_writev(iov, n) : 0;
+    if (written < 0) {
+        g_error("Error while sending socket %s", g_strerror(errno));
         return FALSE;
     }
-    g_byte_array_remove_range(socket_to_send, 0, bw);
 
-    if (socket_to_send->len == 0) {
+    vcard_lock_lock(socket_to_send_lock);
+    send_queue_advance(written);
+    pending = send_queue_ready();
+    vcard_lock_unlock(socket_to_send_lock);
+
+    if (!pending) {
         update_socket_watch();
         return FALSE;
     }
@@ -188,38 +390,364 @@ socket_prepare_sending(G_GNUC_UNUSED gpointer user_data)
     return FALSE;
 }
 
-static int
-send_msg(
+static void
+send_msg_set_header(
+    SendMsg *m,
     VSCMsgType type,
     uint32_t reader_id,
-    const void *msg,
     unsigned int length
 ) {
-    VSCMsgHeader mhHeader;
-
-    g_mutex_lock(&socket_to_send_lock);
-
     if (verbose > 10) {
         printf("sending type=%d id=%u, len =%u (0x%x)\n",
                type, reader_id, length, length);
     }
 
-    mhHeader.type = htonl(type);
-    mhHeader.reader_id = 0;
-    mhHeader.length = htonl(length);
-    g_byte_array_append(socket_to_send, (guint8 *)&mhHeader, sizeof(mhHeader));
-    g_byte_array_append(socket_to_send, (guint8 *)msg, length);
+    m->header.type = htonl(type);
+    m->header.reader_id = 0;
+    m->header.length = htonl(length);
+    m->len = sizeof(m->header) + length;
+}
+
+/* with the send lock held */
+static void
+send_msg_ready(SendMsg *m)
+{
+    m->ready = TRUE;
+    socket_to_send_len += m->len;
     g_idle_add(socket_prepare_sending, NULL);
+}
 
-    g_mutex_unlock(&socket_to_send_lock);
+static int
+send_msg(
+    VSCMsgType type,
+    uint32_t reader_id,
+    const void *msg,
+    unsigned int length
+) {
+    SendMsg *m = g_malloc(sizeof(SendMsg) + length);
+
+    send_msg_set_header(m, type, reader_id, length);
+    if (length > 0) {
+        memcpy(m->payload, msg, length);
+    }
+
+    vcard_lock_lock(socket_to_send_lock);
+    g_queue_push_tail(&socket_to_send, m);
+    send_msg_ready(m);
+    vcard_lock_unlock(socket_to_send_lock);
 
     return 0;
 }
 
+/*
+ * Reserve a message of at most max_length bytes at the end of the queue,
+ * its payload is produced in place in m->payload. The messages queued after
+ * it wait until it is completed with send_msg_commit() or dropped with
+ * send_msg_cancel().
+ */
+static SendMsg *
+send_msg_reserve(unsigned int max_length)
+{
+    SendMsg *m = g_malloc(sizeof(SendMsg) + max_length);
+
+    m->ready = FALSE;
+    vcard_lock_lock(socket_to_send_lock);
+    g_queue_push_tail(&socket_to_send, m);
+    vcard_lock_unlock(socket_to_send_lock);
+    return m;
+}
+
+static void
+send_msg_commit(
+    SendMsg *m,
+    VSCMsgType type,
+    uint32_t reader_id,
+    unsigned int length
+) {
+    send_msg_set_header(m, type, reader_id, length);
+
+    vcard_lock_lock(socket_to_send_lock);
+    send_msg_ready(m);
+    vcard_lock_unlock(socket_to_send_lock);
+}
+
+static void
+send_msg_cancel(SendMsg *m)
+{
+    vcard_lock_lock(socket_to_send_lock);
+    g_queue_remove(&socket_to_send, m);
+    /* the messages queued after it may be ready */
+    g_idle_add(socket_prepare_sending, NULL);
+    vcard_lock_unlock(socket_to_send_lock);
+    g_free(m);
+}
+
 static VReader *pending_reader;
-static GMutex pending_reader_lock;
+static VCardLock *pending_reader_lock;
 static GCond pending_reader_condition;
 
+/*
+ * Metrics, written periodically to metrics_file in the Prometheus text
+ * format. The APDUs are recorded from the main loop, the card and reader
+ * events from the event thread.
+ */
+enum {
+    METRICS_OP_LOGIN,
+    METRICS_OP_CRYPTO,
+    METRICS_OP_OTHER,
+    METRICS_OP_LAST
+};
+
+static const char *metrics_op_names[METRICS_OP_LAST] = {
+    [METRICS_OP_LOGIN] = "login",
+    [METRICS_OP_CRYPTO] = "crypto",
+    [METRICS_OP_OTHER] = "other",
+};
+
+/* upper bounds of the latency histogram buckets in microseconds */
+static const gint64 metrics_buckets[] = {
+    100, 1000, 10000, 100000, 1000000
+};
+#define METRICS_BUCKETS G_N_ELEMENTS(metrics_buckets)
+
+typedef struct {
+    guint64 apdus;
+    guint64 bytes_in;
+    guint64 bytes_out;
+    guint64 errors;
+} ReaderMetrics;
+
+typedef struct {
+    guint64 buckets[METRICS_BUCKETS + 1]; /* the last one is +Inf */
+    guint64 count;
+    gint64 sum;
+} LatencyMetrics;
+
+static GMutex metrics_lock;
+static GHashTable *metrics_readers;       /* reader id -> ReaderMetrics */
+static GHashTable *metrics_status_words;  /* SW1SW2 -> count */
+static LatencyMetrics metrics_latency[METRICS_OP_LAST];
+static guint64 metrics_login_attempts;
+static guint64 metrics_events[VEVENT_LAST];
+
+static void
+metrics_init(void)
+{
+    metrics_readers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+    metrics_status_words = g_hash_table_new(g_direct_hash, g_direct_equal);
+}
+
+static void
+metrics_record_apdu(uint32_t reader_id, const uint8_t *cmd, int cmd_len,
+                    const uint8_t *resp, int resp_len, gboolean error,
+                    gint64 elapsed)
+{
+    ReaderMetrics *rm;
+    LatencyMetrics *lm;
+    int op = METRICS_OP_OTHER;
+    unsigned int i;
+
+    if (metrics_file == NULL) {
+        return;
+    }
+    if (cmd_len >= 4) {
+        if (cmd[1] == VCARD7816_INS_VERIFY) {
+            op = METRICS_OP_LOGIN;
+        } else if (cmd[1] == CAC_SIGN_DECRYPT) {
+            op = METRICS_OP_CRYPTO;
+        }
+    }
+
+    g_mutex_lock(&metrics_lock);
+    rm = g_hash_table_lookup(metrics_readers, GUINT_TO_POINTER(reader_id));
+    if (rm == NULL) {
+        rm = g_new0(ReaderMetrics, 1);
+        g_hash_table_insert(metrics_readers, GUINT_TO_POINTER(reader_id), rm);
+    }
+    rm->apdus++;
+    rm->bytes_in += cmd_len;
+    if (error) {
+        rm->errors++;
+    } else {
+        rm->bytes_out += resp_len;
+    }
+
+    /* VERIFY without data only checks the login status */
+    if (op == METRICS_OP_LOGIN && cmd_len > 5) {
+        metrics_login_attempts++;
+    }
+
+    if (!error && resp_len >= 2) {
+        unsigned int sw = (resp[resp_len - 2] << 8) | resp[resp_len - 1];
+
+        if (sw != 0x9000 && resp[resp_len - 2] != VCARD7816_SW1_RESPONSE_BYTES) {
+            gpointer count = g_hash_table_lookup(metrics_status_words,
+                                                 GUINT_TO_POINTER(sw));
+            g_hash_table_insert(metrics_status_words, GUINT_TO_POINTER(sw),
+                                GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+        }
+    }
+
+    lm = &metrics_latency[op];
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        if (elapsed <= metrics_buckets[i]) {
+            break;
+        }
+    }
+    lm->buckets[i]++;
+    lm->count++;
+    lm->sum += elapsed;
+    g_mutex_unlock(&metrics_lock);
+}
+
+static void
+metrics_record_event(VEventType type)
+{
+    if (metrics_file == NULL || type >= VEVENT_LAST) {
+        return;
+    }
+    g_mutex_lock(&metrics_lock);
+    metrics_events[type]++;
+    g_mutex_unlock(&metrics_lock);
+}
+
+static gboolean
+metrics_write(G_GNUC_UNUSED gpointer user_data)
+{
+    static const char *event_names[VEVENT_LAST] = {
+        [VEVENT_READER_INSERT] = "reader_insert",
+        [VEVENT_READER_REMOVE] = "reader_remove",
+        [VEVENT_CARD_INSERT] = "card_insert",
+        [VEVENT_CARD_REMOVE] = "card_remove",
+    };
+    GString *out = g_string_new(NULL);
+    GHashTableIter iter;
+    gpointer key, value;
+    VReaderList *list;
+    VReaderListEntry *reader_entry;
+    guint64 backlog = 0, readers = 0, cards = 0;
+    guint send_queue;
+    GError *err = NULL;
+    int i;
+    unsigned int j;
+
+    /* gauges */
+    list = vreader_get_reader_list();
+    for (reader_entry = vreader_list_get_first(list); reader_entry;
+         reader_entry = vreader_list_get_next(reader_entry)) {
+        VReader *r = vreader_list_get_reader(reader_entry);
+
+        readers++;
+        if (vreader_card_is_present(r) == VREADER_OK) {
+            cards++;
+        }
+        vreader_free(r);
+    }
+    vreader_list_delete(list);
+    backlog = vevent_queue_get_length();
+
+    vcard_lock_lock(socket_to_send_lock);
+    send_queue = socket_to_send_len;
+    vcard_lock_unlock(socket_to_send_lock);
+
+    g_string_append_printf(out,
+        "# TYPE vscclient_readers gauge\n"
+        "vscclient_readers %" G_GUINT64_FORMAT "\n"
+        "# TYPE vscclient_cards_present gauge\n"
+        "vscclient_cards_present %" G_GUINT64_FORMAT "\n"
+        "# TYPE vscclient_event_backlog gauge\n"
+        "vscclient_event_backlog %" G_GUINT64_FORMAT "\n"
+        "# TYPE vscclient_send_queue_bytes gauge\n"
+        "vscclient_send_queue_bytes %u\n",
+        readers, cards, backlog, send_queue);
+
+    g_mutex_lock(&metrics_lock);
+
+    g_string_append(out, "# TYPE vscclient_apdus_total counter\n");
+    g_hash_table_iter_init(&iter, metrics_readers);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_string_append_printf(out,
+            "vscclient_apdus_total{reader=\"%u\"} %" G_GUINT64_FORMAT "\n",
+            GPOINTER_TO_UINT(key), ((ReaderMetrics *)value)->apdus);
+    }
+    g_string_append(out, "# TYPE vscclient_bytes_in_total counter\n");
+    g_hash_table_iter_init(&iter, metrics_readers);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_string_append_printf(out,
+            "vscclient_bytes_in_total{reader=\"%u\"} %" G_GUINT64_FORMAT "\n",
+            GPOINTER_TO_UINT(key), ((ReaderMetrics *)value)->bytes_in);
+    }
+    g_string_append(out, "# TYPE vscclient_bytes_out_total counter\n");
+    g_hash_table_iter_init(&iter, metrics_readers);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_string_append_printf(out,
+            "vscclient_bytes_out_total{reader=\"%u\"} %" G_GUINT64_FORMAT "\n",
+            GPOINTER_TO_UINT(key), ((ReaderMetrics *)value)->bytes_out);
+    }
+    g_string_append(out, "# TYPE vscclient_transfer_errors_total counter\n");
+    g_hash_table_iter_init(&iter, metrics_readers);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_string_append_printf(out,
+            "vscclient_transfer_errors_total{reader=\"%u\"} %" G_GUINT64_FORMAT "\n",
+            GPOINTER_TO_UINT(key), ((ReaderMetrics *)value)->errors);
+    }
+
+    g_string_append(out, "# TYPE vscclient_status_words_total counter\n");
+    g_hash_table_iter_init(&iter, metrics_status_words);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_string_append_printf(out,
+            "vscclient_status_words_total{sw=\"%04X\"} %u\n",
+            GPOINTER_TO_UINT(key), GPOINTER_TO_UINT(value));
+    }
+
+    g_string_append(out, "# TYPE vscclient_events_total counter\n");
+    for (i = 0; i < VEVENT_LAST; i++) {
+        g_string_append_printf(out,
+            "vscclient_events_total{type=\"%s\"} %" G_GUINT64_FORMAT "\n",
+            event_names[i], metrics_events[i]);
+    }
+    g_string_append_printf(out,
+        "# TYPE vscclient_login_attempts_total counter\n"
+        "vscclient_login_attempts_total %" G_GUINT64_FORMAT "\n",
+        metrics_login_attempts);
+
+    g_string_append(out, "# TYPE vscclient_apdu_latency_seconds histogram\n");
+    for (i = 0; i < METRICS_OP_LAST; i++) {
+        LatencyMetrics *lm = &metrics_latency[i];
+        guint64 cumulative = 0;
+
+        for (j = 0; j < METRICS_BUCKETS; j++) {
+            cumulative += lm->buckets[j];
+            g_string_append_printf(out,
+                "vscclient_apdu_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %"
+                G_GUINT64_FORMAT "\n", metrics_op_names[i],
+                metrics_buckets[j] / 1e6, cumulative);
+        }
+        cumulative += lm->buckets[METRICS_BUCKETS];
+        g_string_append_printf(out,
+            "vscclient_apdu_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %"
+            G_GUINT64_FORMAT "\n"
+            "vscclient_apdu_latency_seconds_sum{op=\"%s\"} %g\n"
+            "vscclient_apdu_latency_seconds_count{op=\"%s\"} %"
+            G_GUINT64_FORMAT "\n",
+            metrics_op_names[i], cumulative,
+            metrics_op_names[i], lm->sum / 1e6,
+            metrics_op_names[i], lm->count);
+    }
+
+    g_mutex_unlock(&metrics_lock);
+
+    /* written to a temporary file and renamed, so readers never see a
+     * partial file */
+    if (!g_file_set_contents(metrics_file, out->str, out->len, &err)) {
+        fprintf(stderr, "Failed to write metrics: %s\n", err->message);
+        g_error_free(err);
+    }
+    g_string_free(out, TRUE);
+    return TRUE;
+}
+
 #define MAX_ATR_LEN 40
 static gpointer
 event_thread(G_GNUC_UNUSED gpointer arg)
@@ -236,26 +764,27 @@ event_thread(G_GNUC_UNUSED gpointer arg)
         if (event == NULL) {
             break;
         }
+        metrics_record_event(event->type);
         reader_id = vreader_get_id(event->reader);
         if (reader_id == VSCARD_UNDEFINED_READER_ID &&
             event->type != VEVENT_READER_INSERT) {
             /* ignore events from readers qemu has rejected */
             /* if qemu is still deciding on this reader, wait to see if need to
              * forward this event */
-            g_mutex_lock(&pending_reader_lock);
+            vcard_lock_lock(pending_reader_lock);
             if (!pending_reader || (pending_reader != event->reader)) {
                 /* wasn't for a pending reader, this reader has already been
                  * rejected by qemu */
-                g_mutex_unlock(&pending_reader_lock);
+                vcard_lock_unlock(pending_reader_lock);
                 vevent_delete(event);
                 continue;
             }
             /* this reader hasn't been told its status from qemu yet, wait for
              * that status */
             while (pending_reader != NULL) {
-                g_cond_wait(&pending_reader_condition, &pending_reader_lock);
+                vcard_lock_cond_wait(&pending_reader_condition, pending_reader_lock);
             }
-            g_mutex_unlock(&pending_reader_lock);
+            vcard_lock_unlock(pending_reader_lock);
             /* now recheck the id */
             reader_id = vreader_get_id(event->reader);
             if (reader_id == VSCARD_UNDEFINED_READER_ID) {
@@ -271,12 +800,13 @@ event_thread(G_GNUC_UNUSED gpointer arg)
             /* wait until qemu has responded to our first reader insert
              * before we send a second. That way we won't confuse the responses
              * */
-            g_mutex_lock(&pending_reader_lock);
+            vcard_lock_lock(pending_reader_lock);
             while (pending_reader != NULL) {
-                g_cond_wait(&pending_reader_condition, &pending_reader_lock);
+                vcard_lock_cond_wait(&pending_reader_condition, pending_reader_lock);
             }
             pending_reader = vreader_reference(event->reader);
-            g_mutex_unlock(&pending_reader_lock);
+            vcard_lock_unlock(pending_reader_lock);
+            vreader_set_idle_timeout(event->reader, idle_timeout * 1000);
             reader_name = vreader_get_name(event->reader);
             if (verbose > 10) {
                 printf(" READER INSERT: %s\n", reader_name);
@@ -302,6 +832,9 @@ event_thread(G_GNUC_UNUSED gpointer arg)
                 printf(" CARD INSERT %u: ", reader_id);
                 print_byte_array(atr, atr_len);
             }
+            if (!with_pcsc) {
+                transcript_write_atr(atr, atr_len);
+            }
             send_msg(VSC_ATR, reader_id, atr, atr_len);
             break;
         case VEVENT_CARD_REMOVE:
@@ -321,6 +854,17 @@ event_thread(G_GNUC_UNUSED gpointer arg)
 }
 
 
+static gboolean
+hibernate_idle(G_GNUC_UNUSED gpointer user_data)
+{
+    int count = vreader_hibernate_idle();
+
+    if (count > 0 && verbose > 10) {
+        printf("hibernated %d idle cards\n", count);
+    }
+    return TRUE;
+}
+
 static unsigned int
 get_id_from_string(char *string, unsigned int default_id)
 {
@@ -366,29 +910,312 @@ on_host_init(VSCMsgHeader *mhHeader, VSCMsgInit *incoming)
     return 0;
 }
 
+#if defined(ENABLE_PCSC)
+/*
+ * Emulator and hardware timings in pcsc mode, by selected applet and INS.
+ * Only used from the main loop thread.
+ */
+typedef struct {
+    char *applet;       /* AID in hex, "-" before any SELECT */
+    unsigned char ins;
+    guint64 count;
+    guint64 diffs;      /* responses differing from the hardware ones */
+    gint64 emul_total;
+    gint64 emul_max;
+    gint64 hw_total;
+    gint64 hw_max;
+} CompareStats;
+
+static GHashTable *compare_stats;    /* "applet/INS" -> CompareStats */
+static GHashTable *compare_applets;  /* reader id -> selected AID in hex */
+
+static void
+compare_stats_free(CompareStats *stats)
+{
+    g_free(stats->applet);
+    g_free(stats);
+}
+
+static void
+compare_record(uint32_t reader_id, const uint8_t *command, int command_len,
+               const uint8_t *response, int response_len,
+               gint64 emul_time, gint64 hw_time, gboolean diff)
+{
+    CompareStats *stats;
+    const char *applet;
+    char *key;
+
+    if (command_len < 4) {
+        return;
+    }
+    if (compare_stats == NULL) {
+        compare_stats = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)compare_stats_free);
+        compare_applets = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                NULL, g_free);
+    }
+
+    applet = g_hash_table_lookup(compare_applets, GUINT_TO_POINTER(reader_id));
+    if (applet == NULL) {
+        applet = "-";
+    }
+    key = g_strdup_printf("%s/%02X", applet, command[1]);
+    stats = g_hash_table_lookup(compare_stats, key);
+    if (stats == NULL) {
+        stats = g_new0(CompareStats, 1);
+        stats->applet = g_strdup(applet);
+        stats->ins = command[1];
+        g_hash_table_insert(compare_stats, key, stats);
+    } else {
+        g_free(key);
+    }
+    stats->count++;
+    stats->diffs += diff;
+    stats->emul_total += emul_time;
+    stats->emul_max = MAX(stats->emul_max, emul_time);
+    stats->hw_total += hw_time;
+    stats->hw_max = MAX(stats->hw_max, hw_time);
+
+    /* the next APDUs go to the applet the card selected */
+    if (command[1] == 0xA4 && command[2] == 0x04 && command_len > 5 &&
+        response_len >= 2 &&
+        (response[response_len - 2] == 0x90 ||
+         response[response_len - 2] == 0x61)) {
+        int aid_len = MIN(command[4], command_len - 5);
+        GString *aid = g_string_new(NULL);
+        int i;
+
+        for (i = 0; i < aid_len; i++) {
+            g_string_append_printf(aid, "%02X", command[5 + i]);
+        }
+        g_hash_table_insert(compare_applets, GUINT_TO_POINTER(reader_id),
+                            g_string_free(aid, FALSE));
+    }
+}
+
+static gint
+compare_stats_cmp(gconstpointer a, gconstpointer b)
+{
+    const CompareStats *x = *(CompareStats * const *)a;
+    const CompareStats *y = *(CompareStats * const *)b;
+    int ret = strcmp(x->applet, y->applet);
+
+    return ret ? ret : x->ins - y->ins;
+}
+
+static void
+compare_report(void)
+{
+    GPtrArray *sorted;
+    GHashTableIter iter;
+    CompareStats *stats, total = { NULL, 0, 0, 0, 0, 0, 0, 0 };
+    guint i;
+
+    if (compare_stats == NULL) {
+        return;
+    }
+    sorted = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, compare_stats);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stats)) {
+        g_ptr_array_add(sorted, stats);
+    }
+    g_ptr_array_sort(sorted, compare_stats_cmp);
+
+    printf("Emulator vs hardware (us):\n");
+    printf("%-32s %3s %8s %6s %10s %10s %10s %10s %7s\n", "applet", "INS",
+           "count", "diffs", "emul avg", "emul max", "hw avg", "hw max",
+           "ratio");
+    for (i = 0; i < sorted->len; i++) {
+        stats = g_ptr_array_index(sorted, i);
+        printf("%-32s  %02X %8" G_GUINT64_FORMAT " %6" G_GUINT64_FORMAT
+               " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT
+               " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT " %7.2f\n",
+               stats->applet, stats->ins, stats->count, stats->diffs,
+               stats->emul_total / (gint64)stats->count, stats->emul_max,
+               stats->hw_total / (gint64)stats->count, stats->hw_max,
+               stats->hw_total ?
+                   (double)stats->emul_total / stats->hw_total : 0.0);
+        total.count += stats->count;
+        total.diffs += stats->diffs;
+        total.emul_total += stats->emul_total;
+        total.emul_max = MAX(total.emul_max, stats->emul_max);
+        total.hw_total += stats->hw_total;
+        total.hw_max = MAX(total.hw_max, stats->hw_max);
+    }
+    printf("%-32s %3s %8" G_GUINT64_FORMAT " %6" G_GUINT64_FORMAT
+           " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT
+           " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT " %7.2f\n",
+           "total", "", total.count, total.diffs,
+           total.count ? total.emul_total / (gint64)total.count : 0,
+           total.emul_max,
+           total.count ? total.hw_total / (gint64)total.count : 0,
+           total.hw_max,
+           total.hw_total ? (double)total.emul_total / total.hw_total : 0.0);
+    g_ptr_array_free(sorted, TRUE);
+}
+#endif
 
 enum {
     STATE_HEADER,
     STATE_MESSAGE,
 };
 
-#define APDUBufSize 270
+/* room for an extended length response (Le up to 65536) of a PIV card */
+#define APDUBufSize (65536 + 2)
 
+/* Handle a complete message from the host */
 static gboolean
-do_socket_read(GIOChannel *source,
-               GIOCondition condition)
+do_socket_message(VSCMsgHeader *mhHeader, uint8_t *payload)
 {
     int rv;
     int dwSendLength;
     int dwRecvLength;
-    uint8_t pbRecvBuffer[APDUBufSize];
-    static uint8_t pbSendBuffer[APDUBufSize];
+    SendMsg *msg;
+    uint8_t *response;
+#if defined(ENABLE_PCSC)
+    static uint8_t pbRecvBuffer[APDUBufSize];
+#endif
+    uint8_t *emulated;
     VReaderStatus reader_status;
     VReader *reader = NULL;
-    static VSCMsgHeader mhHeader;
     VSCMsgError error_msg;
-    GError *err = NULL;
     VSCMsgInit init;
+    gint64 xfr_start, card_time;
+
+    switch (mhHeader->type) {
+    case VSC_APDU:
+        if (verbose) {
+            static int n = 0;
+            printf("\n\n >>> %d recv APDU: \n", n++);
+            print_byte_array(payload, mhHeader->length);
+        }
+
+        /* The response is written by libcacard (or the card) directly
+         * in the message to send, which does not move meanwhile */
+        msg = send_msg_reserve(APDUBufSize);
+        response = msg->payload;
+        emulated = response;
+#if defined(ENABLE_PCSC)
+        if (with_pcsc) {
+            /* the emulated response is only compared to the HW one */
+            emulated = pbRecvBuffer;
+        }
+#endif
+
+        /* Transmit received APDU */
+        dwSendLength = mhHeader->length;
+        dwRecvLength = APDUBufSize;
+        reader = vreader_get_reader_by_id(mhHeader->reader_id);
+        xfr_start = g_get_monotonic_time();
+        reader_status = vreader_xfr_bytes(reader,
+                                          payload, dwSendLength,
+                                          emulated, &dwRecvLength);
+        card_time = g_get_monotonic_time() - xfr_start;
+        metrics_record_apdu(mhHeader->reader_id, payload, dwSendLength,
+                            emulated, dwRecvLength,
+                            reader_status != VREADER_OK, card_time);
+        if (verbose) {
+            printf("libcacard response: ");
+            print_byte_array(emulated, dwRecvLength);
+        }
+
+#if defined(ENABLE_PCSC)
+        if (with_pcsc) {
+            int emulated_size = dwRecvLength;
+            gint64 emul_time = card_time;
+
+            dwSendLength = mhHeader->length;
+            dwRecvLength = APDUBufSize;
+
+            xfr_start = g_get_monotonic_time();
+            if (!pcsc_transmit(payload, dwSendLength,
+                               response, &dwRecvLength))
+                reader_status = VREADER_OK;
+            else
+                reader_status = VREADER_NO_CARD;
+            card_time = g_get_monotonic_time() - xfr_start;
+
+            if (reader_status == VREADER_OK) {
+                int diff = emulated_size != dwRecvLength ||
+                  memcmp(response, emulated, emulated_size);
+
+                compare_record(mhHeader->reader_id,
+                               payload, mhHeader->length,
+                               response, dwRecvLength,
+                               emul_time, card_time, diff);
+                if (verbose) {
+                    printf("HW response (emul %" G_GINT64_FORMAT "us, hw %"
+                           G_GINT64_FORMAT "us):%s ", emul_time, card_time,
+                           diff ? "\x1B[31m!!!\x1B[0m" : "");
+                    print_byte_array(response, dwRecvLength);
+                }
+            }
+        }
+#endif
+
+        if (reader_status == VREADER_OK) {
+            transcript_write(payload, mhHeader->length,
+                             response, dwRecvLength, card_time);
+            send_msg_commit(msg, VSC_APDU, mhHeader->reader_id, dwRecvLength);
+        } else {
+            send_msg_cancel(msg);
+            rv = reader_status; /* warning: not meaningful */
+            send_msg(VSC_Error, mhHeader->reader_id, &rv, sizeof(uint32_t));
+        }
+        vreader_free(reader);
+        reader = NULL; /* we've freed it, don't use it by accident
+                          again */
+        break;
+    case VSC_Flush:
+        /* TODO: actually flush */
+        send_msg(VSC_FlushComplete, mhHeader->reader_id, NULL, 0);
+        break;
+    case VSC_Error:
+        memcpy(&error_msg, payload, sizeof(VSCMsgError));
+        if (error_msg.code == VSC_SUCCESS) {
+            vcard_lock_lock(pending_reader_lock);
+            if (pending_reader) {
+                vreader_set_id(pending_reader, mhHeader->reader_id);
+                vreader_free(pending_reader);
+                pending_reader = NULL;
+                g_cond_signal(&pending_reader_condition);
+            }
+            vcard_lock_unlock(pending_reader_lock);
+            break;
+        }
+        printf("warning: qemu refused to add reader\n");
+        if (error_msg.code == VSC_CANNOT_ADD_MORE_READERS) {
+            /* clear pending reader, qemu can't handle any more */
+            vcard_lock_lock(pending_reader_lock);
+            if (pending_reader) {
+                pending_reader = NULL;
+                /* make sure the event loop doesn't hang */
+                g_cond_signal(&pending_reader_condition);
+            }
+            vcard_lock_unlock(pending_reader_lock);
+        }
+        break;
+    case VSC_Init:
+        memcpy(&init, payload, sizeof(VSCMsgInit));
+        if (on_host_init(mhHeader, &init) < 0) {
+            return FALSE;
+        }
+        break;
+    default:
+        fprintf(stderr, "Unexpected message of type 0x%X\n", mhHeader->type);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+do_socket_read(GIOChannel *source,
+               GIOCondition condition)
+{
+    static uint8_t pbSendBuffer[APDUBufSize];
+    static VSCMsgHeader mhHeader;
+    GError *err = NULL;
 
     static gchar *buf;
     static gsize br, to_read;
@@ -438,112 +1265,12 @@ do_socket_read(GIOChannel *source,
     }
 
     if (state == STATE_MESSAGE) {
-        char *reply = NULL;
-#if defined(ENABLE_PCSC)
-        int reply_size;
-#endif
-
-        switch (mhHeader.type) {
-        case VSC_APDU:
-            if (verbose) {
-                static int n = 0;
-                printf("\n\n >>> %d recv APDU: \n", n++);
-                print_byte_array(pbSendBuffer, mhHeader.length);
-            }
-
-            /* Transmit received APDU */
-            dwSendLength = mhHeader.length;
-            dwRecvLength = sizeof(pbRecvBuffer);
-            reader = vreader_get_reader_by_id(mhHeader.reader_id);
-            reader_status = vreader_xfr_bytes(reader,
-                                              pbSendBuffer, dwSendLength,
-                                              pbRecvBuffer, &dwRecvLength);
-            if (verbose) {
-                printf("libcacard response: ");
-                print_byte_array(pbRecvBuffer, dwRecvLength);
-            }
-
-#if defined(ENABLE_PCSC)
-            if (with_pcsc) {
-                reply_size = dwRecvLength;
-                reply = g_memdup2(pbRecvBuffer, reply_size);
-
-                dwSendLength = mhHeader.length;
-                dwRecvLength = sizeof(pbRecvBuffer);
-
-                if (!pcsc_transmit(pbSendBuffer, dwSendLength,
-                                   pbRecvBuffer, &dwRecvLength))
-                    reader_status = VREADER_OK;
-                else
-                    reader_status = VREADER_NO_CARD;
-            }
-#endif
-
-            if (reader_status == VREADER_OK) {
-                mhHeader.length = dwRecvLength;
-#if defined(ENABLE_PCSC)
-                if (with_pcsc && verbose) {
-                    int diff = (unsigned int) reply_size != mhHeader.length ||
-                      memcmp(pbRecvBuffer, reply, reply_size);
-                    printf("HW response:%s ", diff ? "\x1B[31m!!!\x1B[0m" : "");
-                    print_byte_array(pbRecvBuffer, mhHeader.length);
-                }
-#endif
-                send_msg(VSC_APDU, mhHeader.reader_id,
-                         pbRecvBuffer, dwRecvLength);
-            } else {
-                rv = reader_status; /* warning: not meaningful */
-                send_msg(VSC_Error, mhHeader.reader_id, &rv, sizeof(uint32_t));
-            }
-            g_free(reply);
-            vreader_free(reader);
-            reader = NULL; /* we've freed it, don't use it by accident
-                              again */
-            break;
-        case VSC_Flush:
-            /* TODO: actually flush */
-            send_msg(VSC_FlushComplete, mhHeader.reader_id, NULL, 0);
-            break;
-        case VSC_Error:
-            memcpy(&error_msg, pbSendBuffer, sizeof(VSCMsgError));
-            if (error_msg.code == VSC_SUCCESS) {
-                g_mutex_lock(&pending_reader_lock);
-                if (pending_reader) {
-                    vreader_set_id(pending_reader, mhHeader.reader_id);
-                    vreader_free(pending_reader);
-                    pending_reader = NULL;
-                    g_cond_signal(&pending_reader_condition);
-                }
-                g_mutex_unlock(&pending_reader_lock);
-                break;
-            }
-            printf("warning: qemu refused to add reader\n");
-            if (error_msg.code == VSC_CANNOT_ADD_MORE_READERS) {
-                /* clear pending reader, qemu can't handle any more */
-                g_mutex_lock(&pending_reader_lock);
-                if (pending_reader) {
-                    pending_reader = NULL;
-                    /* make sure the event loop doesn't hang */
-                    g_cond_signal(&pending_reader_condition);
-                }
-                g_mutex_unlock(&pending_reader_lock);
-            }
-            break;
-        case VSC_Init:
-            memcpy(&init, pbSendBuffer, sizeof(VSCMsgInit));
-            if (on_host_init(&mhHeader, &init) < 0) {
-                return FALSE;
-            }
-            break;
-        default:
-            g_assert_not_reached();
+        state = STATE_HEADER;
+        if (!do_socket_message(&mhHeader, pbSendBuffer)) {
             return FALSE;
         }
-
-        state = STATE_HEADER;
     }
 
-
     return TRUE;
 }
 
@@ -561,6 +1288,9 @@ do_socket(GIOChannel *source,
 
     if (condition & G_IO_IN) {
         if (!do_socket_read(source, condition)) {
+            fprintf(stderr, "Error while reading the socket, exiting\n");
+            socket_tag = 0;
+            g_main_loop_quit(loop);
             return FALSE;
         }
     }
@@ -568,10 +1298,280 @@ do_socket(GIOChannel *source,
     return TRUE;
 }
 
+#if defined(ENABLE_IO_URING)
+/*
+ * io_uring engine: a read of the socket is always queued in a registered
+ * buffer, and all the messages it brings are handled at once, so the
+ * responses for all the readers go out in a single writev of the send
+ * queue, submitted together with the next read. The completions are
+ * signalled to the main loop through an eventfd.
+ */
+#define URING_ENTRIES 8
+/* at least one message of the largest (extended length) APDU */
+#define URING_BUF_SIZE (2 * (sizeof(VSCMsgHeader) + APDUBufSize))
+
+enum {
+    URING_OP_READ = 1,
+    URING_OP_WRITE,
+};
+
+static struct io_uring uring;
+static int uring_eventfd = -1;
+static int uring_socket;
+static gboolean uring_fixed; /* the read buffer is registered */
+static struct iovec uring_iov[1];
+/* the messages being written, they stay in the send queue until then */
+static struct iovec uring_write_iov[SEND_IOV_MAX];
+static uint8_t *uring_read_buf;
+static gsize uring_read_len;
+static gboolean uring_reading;
+static gboolean uring_writing;
+/* waiting for the socket to be ready again after an EAGAIN */
+static gboolean uring_read_blocked;
+static gboolean uring_write_blocked;
+static gboolean uring_failed;
+
+static void
+uring_queue_read(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uring_reading || uring_read_blocked || uring_failed) {
+        return;
+    }
+    sqe = io_uring_get_sqe(&uring);
+    g_return_if_fail(sqe != NULL);
+    if (uring_fixed) {
+        io_uring_prep_read_fixed(sqe, uring_socket,
+                                 uring_read_buf + uring_read_len,
+                                 URING_BUF_SIZE - uring_read_len, 0, 0);
+    } else {
+        io_uring_prep_read(sqe, uring_socket, uring_read_buf + uring_read_len,
+                           URING_BUF_SIZE - uring_read_len, 0);
+    }
+    io_uring_sqe_set_data(sqe, GINT_TO_POINTER(URING_OP_READ));
+    uring_reading = TRUE;
+}
+
+/* called from the main loop thread only */
+static void
+uring_queue_write(void)
+{
+    struct io_uring_sqe *sqe;
+    int n;
+
+    if (uring_writing || uring_write_blocked) {
+        return;
+    }
+    /* the new messages are queued after these while they are written */
+    vcard_lock_lock(socket_to_send_lock);
+    n = send_queue_iov(uring_write_iov, G_N_ELEMENTS(uring_write_iov));
+    vcard_lock_unlock(socket_to_send_lock);
+    if (n == 0) {
+        return;
+    }
+
+    sqe = io_uring_get_sqe(&uring);
+    g_return_if_fail(sqe != NULL);
+    io_uring_prep_writev(sqe, uring_socket, uring_write_iov, n, 0);
+    io_uring_sqe_set_data(sqe, GINT_TO_POINTER(URING_OP_WRITE));
+    uring_writing = TRUE;
+}
+
+static void
+uring_submit(void)
+{
+    uring_queue_read();
+    uring_queue_write();
+    if (io_uring_sq_ready(&uring) > 0) {
+        io_uring_submit(&uring);
+    }
+}
+
+/* handle all the complete messages of the read buffer */
+static void
+uring_handle_messages(void)
+{
+    gsize pos = 0;
+
+    while (!uring_failed && uring_read_len - pos >= sizeof(VSCMsgHeader)) {
+        VSCMsgHeader mhHeader;
+
+        memcpy(&mhHeader, uring_read_buf + pos, sizeof(mhHeader));
+        mhHeader.type = ntohl(mhHeader.type);
+        mhHeader.reader_id = ntohl(mhHeader.reader_id);
+        mhHeader.length = ntohl(mhHeader.length);
+        if (mhHeader.length > APDUBufSize) {
+            fprintf(stderr, "Message too long (%u)\n", mhHeader.length);
+            uring_failed = TRUE;
+            break;
+        }
+        if (uring_read_len - pos < sizeof(mhHeader) + mhHeader.length) {
+            break;
+        }
+        if (verbose) {
+            printf("Header: type=%d, reader_id=%u length=%d (0x%x)\n",
+                   mhHeader.type, mhHeader.reader_id, mhHeader.length,
+                   mhHeader.length);
+        }
+        if (!do_socket_message(&mhHeader,
+                               uring_read_buf + pos + sizeof(mhHeader))) {
+            uring_failed = TRUE;
+        }
+        pos += sizeof(mhHeader) + mhHeader.length;
+    }
+
+    /* at most one incomplete message is left */
+    memmove(uring_read_buf, uring_read_buf + pos, uring_read_len - pos);
+    uring_read_len -= pos;
+}
+
+static gboolean
+uring_socket_ready(G_GNUC_UNUSED gint fd,
+                   G_GNUC_UNUSED GIOCondition condition,
+                   gpointer user_data)
+{
+    if (GPOINTER_TO_INT(user_data) == URING_OP_READ) {
+        uring_read_blocked = FALSE;
+    } else {
+        uring_write_blocked = FALSE;
+    }
+    uring_submit();
+    return G_SOURCE_REMOVE;
+}
+
+/* the operation got EAGAIN, queue it again only once the socket is ready */
+static void
+uring_wait_socket(int op)
+{
+    if (op == URING_OP_READ) {
+        uring_read_blocked = TRUE;
+    } else {
+        uring_write_blocked = TRUE;
+    }
+    g_unix_fd_add(uring_socket, op == URING_OP_READ ? G_IO_IN : G_IO_OUT,
+                  uring_socket_ready, GINT_TO_POINTER(op));
+}
+
+static gboolean
+uring_dispatch(G_GNUC_UNUSED gint fd,
+               G_GNUC_UNUSED GIOCondition condition,
+               G_GNUC_UNUSED gpointer user_data)
+{
+    struct io_uring_cqe *cqe;
+    eventfd_t count;
+
+    eventfd_read(uring_eventfd, &count);
+
+    while (io_uring_peek_cqe(&uring, &cqe) == 0) {
+        int op = GPOINTER_TO_INT(io_uring_cqe_get_data(cqe));
+        int res = cqe->res;
+
+        io_uring_cqe_seen(&uring, cqe);
+
+        if (res < 0 && res != -EINTR && res != -EAGAIN) {
+            g_error("Error on socket: %s", g_strerror(-res));
+        }
+        switch (op) {
+        case URING_OP_READ:
+            uring_reading = FALSE;
+            if (res == 0) {
+                printf("connection closed\n");
+                exit(0);
+            }
+            if (res == -EAGAIN) {
+                uring_wait_socket(op);
+            }
+            if (res > 0) {
+                uring_read_len += res;
+                uring_handle_messages();
+                if (uring_failed) {
+                    fprintf(stderr, "Error while reading the socket, "
+                            "exiting\n");
+                    g_main_loop_quit(loop);
+                }
+            }
+            break;
+        case URING_OP_WRITE:
+            uring_writing = FALSE;
+            if (res == -EAGAIN) {
+                uring_wait_socket(op);
+            }
+            /* after a short write, the rest is queued again below */
+            if (res > 0) {
+                vcard_lock_lock(socket_to_send_lock);
+                send_queue_advance(res);
+                vcard_lock_unlock(socket_to_send_lock);
+            }
+            break;
+        default:
+            g_warn_if_reached();
+        }
+    }
+
+    uring_submit();
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+uring_init(int sock)
+{
+    int ret;
+
+    ret = io_uring_queue_init(URING_ENTRIES, &uring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring: %s\n", g_strerror(-ret));
+        return FALSE;
+    }
+    uring_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (uring_eventfd < 0 ||
+        io_uring_register_eventfd(&uring, uring_eventfd) < 0) {
+        fprintf(stderr, "io_uring: can not register the eventfd\n");
+        if (uring_eventfd >= 0) {
+            close(uring_eventfd);
+            uring_eventfd = -1;
+        }
+        io_uring_queue_exit(&uring);
+        return FALSE;
+    }
+    uring_socket = sock;
+
+    uring_read_buf = g_malloc(URING_BUF_SIZE);
+    uring_iov[0].iov_base = uring_read_buf;
+    uring_iov[0].iov_len = URING_BUF_SIZE;
+    /* may fail because of RLIMIT_MEMLOCK, plain reads are used then */
+    uring_fixed = io_uring_register_buffers(&uring, uring_iov,
+                                            G_N_ELEMENTS(uring_iov)) == 0;
+
+    g_unix_fd_add(uring_eventfd, G_IO_IN, uring_dispatch, NULL);
+    uring_submit();
+    return TRUE;
+}
+
+static void
+uring_deinit(void)
+{
+    io_uring_queue_exit(&uring);
+    close(uring_eventfd);
+    g_free(uring_read_buf);
+}
+#endif
+
 static void
 update_socket_watch(void)
 {
-    gboolean out = socket_to_send->len > 0;
+    gboolean out;
+
+#if defined(ENABLE_IO_URING)
+    if (with_uring) {
+        uring_submit();
+        return;
+    }
+#endif
+
+    vcard_lock_lock(socket_to_send_lock);
+    out = send_queue_ready();
+    vcard_lock_unlock(socket_to_send_lock);
 
     if (socket_tag != 0) {
         g_source_remove(socket_tag);
@@ -700,12 +1700,41 @@ do_command(GIOChannel *source,
                        vreader_get_name(r));
             }
             vreader_list_delete(list);
+        } else if (strncmp(string, "compare", 7) == 0) {
+#if defined(ENABLE_PCSC)
+            compare_report();
+#else
+            printf("No PCSC support\n");
+#endif
+        } else if (strncmp(string, "mem", 3) == 0) {
+            char *report = vreader_mem_dump();
+            printf("Memory (bytes/objects):\n%s", report);
+            g_free(report);
+        } else if (strncmp(string, "locks", 5) == 0) {
+            string += 5;
+            while (*string == ' ') {
+                string++;
+            }
+            if (strncmp(string, "on", 2) == 0) {
+                vcard_lock_stats_enable(TRUE);
+            } else if (strncmp(string, "off", 3) == 0) {
+                vcard_lock_stats_enable(FALSE);
+            } else if (strncmp(string, "reset", 5) == 0) {
+                vcard_lock_stats_reset();
+            } else {
+                char *report = vcard_lock_stats_dump();
+                printf("Locks:\n%s", report);
+                g_free(report);
+            }
         } else if (*string != 0) {
             printf("valid commands:\n");
             printf("insert [reader_id]\n");
             printf("remove [reader_id]\n");
             printf("select reader_id\n");
             printf("list\n");
+            printf("mem\n");
+            printf("compare\n");
+            printf("locks [on|off|reset]\n");
             printf("debug [level]\n");
             printf("exit\n");
         }
@@ -776,7 +1805,6 @@ main(
     int argc,
     char *argv[]
 ) {
-    GMainLoop *loop;
     GIOChannel *channel_stdin;
     char *qemu_host;
     char *qemu_port;
@@ -798,7 +1826,10 @@ main(
     }
 #endif
 
-    while ((c = getopt(argc, argv, "c:e:d:p")) != -1) {
+    socket_to_send_lock = vcard_lock_new("vscclient-send");
+    pending_reader_lock = vcard_lock_new("vscclient-pending");
+
+    while ((c = getopt(argc, argv, "c:e:d:pi:m:M:ur:")) != -1) {
         if (c == '?') {
             break;
         }
@@ -823,6 +1854,36 @@ main(
         case 'p':
             with_pcsc = 1;
             break;
+        case 'u':
+            with_uring = 1;
+            break;
+        case 'r':
+            assert(optarg != NULL);
+            transcript = fopen(optarg, "w");
+            if (transcript == NULL) {
+                perror(optarg);
+                exit(5);
+            }
+            fprintf(transcript, "# libcacard APDU transcript\n");
+            break;
+        case 'i':
+            assert(optarg != NULL);
+            idle_timeout = get_id_from_string(optarg, 0);
+            /* the readers take the timeout in ms */
+            if (idle_timeout > G_MAXUINT / 1000) {
+                printf("idle timeout too large (max = %u)\n",
+                       G_MAXUINT / 1000);
+                exit(5);
+            }
+            break;
+        case 'm':
+            assert(optarg != NULL);
+            metrics_file = optarg;
+            break;
+        case 'M':
+            assert(optarg != NULL);
+            metrics_interval = get_id_from_string(optarg, metrics_interval);
+            break;
         default:
             g_warn_if_reached();
         }
@@ -874,7 +1935,6 @@ main(
         exit(5);
     }
 
-    socket_to_send = g_byte_array_new();
     vcard_emul_init(command_line_options);
     loop = g_main_loop_new(NULL, TRUE);
 
@@ -896,10 +1956,24 @@ main(
     /* we buffer ourself for thread safety reasons */
     g_io_channel_set_buffered(channel_socket, FALSE);
 
+    if (with_uring) {
+#if defined(ENABLE_IO_URING)
+        if (!uring_init(sock)) {
+            printf("io_uring not available, using the main loop\n");
+            with_uring = 0;
+        }
+#else
+        printf("No io_uring support\n");
+        return 1;
+#endif
+    }
+
     if (with_pcsc) {
 #if defined(ENABLE_PCSC)
 	if (!pcsc_init())
 	        return 1;
+        /* the exit command and a closed connection leave with exit() */
+        atexit(compare_report);
 #else
         printf("No PCSC support\n");
         return 1;
@@ -914,14 +1988,32 @@ main(
     };
     send_msg(VSC_Init, 0, &init, sizeof(init));
 
+    if (idle_timeout > 0) {
+        g_timeout_add_seconds(MAX(idle_timeout / 4, 1), hibernate_idle, NULL);
+    }
+    if (metrics_file != NULL) {
+        metrics_init();
+        g_timeout_add_seconds(MAX(metrics_interval, 1), metrics_write, NULL);
+    }
+
     g_main_loop_run(loop);
     g_main_loop_unref(loop);
 
     g_io_channel_unref(channel_stdin);
     g_io_channel_unref(channel_socket);
-    g_byte_array_free(socket_to_send, TRUE);
+#if defined(ENABLE_IO_URING)
+    if (with_uring) {
+        uring_deinit();
+    }
+#endif
+    while (!g_queue_is_empty(&socket_to_send)) {
+        g_free(g_queue_pop_head(&socket_to_send));
+    }
 
     closesocket(sock);
+    if (transcript) {
+        fclose(transcript);
+    }
 
 #if defined(ENABLE_PCSC)
     pcsc_deinit();
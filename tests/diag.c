@@ -0,0 +1,131 @@
+/*
+ * Test the diagnostic applet, which only the cards with the "diag"
+ * parameter have
+ *
+ * This code is licensed under the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <string.h>
+#include "libcacard.h"
+#include "common.h"
+
+#define ARGS "memtoken use_hw=no soft=(,Diag,CAC,diag,gen)"
+
+static void test_diag_init(void)
+{
+    VCardEmulOptions *command_line_options;
+    VReader *reader;
+
+    command_line_options = vcard_emul_options(ARGS);
+    g_assert_nonnull(command_line_options);
+    g_assert_cmpint(vcard_emul_init(command_line_options), ==, VCARD_EMUL_OK);
+
+    reader = vreader_get_reader_by_name("Diag");
+    g_assert_nonnull(reader);
+    g_assert_cmpint(vreader_card_is_present(reader), ==, VREADER_OK);
+    vreader_free(reader);
+}
+
+static void test_diag_applet(void)
+{
+    VReader *reader = vreader_get_reader_by_name("Diag");
+    int dwRecvLength = APDUBufSize;
+    VReaderStatus status;
+    uint8_t pbRecvBuffer[APDUBufSize], *p, *p_end;
+    uint8_t diag_aid[] = {
+        0xF0, 0x6C, 0x69, 0x62, 0x63, 0x61, 0x63, 0x64
+    };
+    uint8_t getdata[] = {
+        /* Get Data (max we can get) */
+        0x00, 0xca, 0xff, 0x70, 0x00
+    };
+    gboolean select_counted = FALSE;
+    int tags = 0;
+
+    g_assert_nonnull(reader);
+
+    /* the FCI stub has 14 bytes for 8B AID */
+    select_aid_response(reader, diag_aid, sizeof(diag_aid), 0x0e);
+
+    status = vreader_xfr_bytes(reader,
+                               getdata, sizeof(getdata),
+                               pbRecvBuffer, &dwRecvLength);
+    g_assert_cmpint(status, ==, VREADER_OK);
+    g_assert_cmpint(dwRecvLength, >, 4);
+    g_assert_cmphex(pbRecvBuffer[dwRecvLength-2], ==, VCARD7816_SW1_SUCCESS);
+    g_assert_cmphex(pbRecvBuffer[dwRecvLength-1], ==, 0x00);
+
+    /* FF 70 template */
+    g_assert_cmphex(pbRecvBuffer[0], ==, 0xff);
+    g_assert_cmphex(pbRecvBuffer[1], ==, 0x70);
+    if (pbRecvBuffer[2] == 0x81) {
+        g_assert_cmpint(pbRecvBuffer[3], ==, dwRecvLength - 6);
+        p = &pbRecvBuffer[4];
+    } else {
+        g_assert_cmpint(pbRecvBuffer[2], ==, dwRecvLength - 5);
+        p = &pbRecvBuffer[3];
+    }
+    p_end = &pbRecvBuffer[dwRecvLength - 2];
+    while (p < p_end) {
+        uint8_t tag = *p++;
+        uint8_t len = *p++;
+
+        g_assert_cmpint(len, <, 0x80);
+        g_assert_true(p + len <= p_end);
+        switch (tag) {
+        case 0x81: /* INS, count */
+            g_assert_cmpint(len % 5, ==, 0);
+            for (; len > 0; len -= 5, p += 5) {
+                if (p[0] == VCARD7816_INS_SELECT_FILE) {
+                    select_counted = p[4] > 0;
+                }
+            }
+            break;
+        case 0x82: /* op, count, total, max */
+            g_assert_cmpint(len, ==, 2 * 13);
+            p += len;
+            break;
+        case 0x83: /* cache */
+        case 0x84: /* GET RESPONSE chains */
+            g_assert_cmpint(len, ==, 16);
+            p += len;
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        tags++;
+    }
+    g_assert_cmpint(tags, ==, 4);
+    g_assert_true(select_counted);
+
+    /* other tags are not found */
+    getdata[3] = 0x71;
+    dwRecvLength = APDUBufSize;
+    status = vreader_xfr_bytes(reader,
+                               getdata, sizeof(getdata),
+                               pbRecvBuffer, &dwRecvLength);
+    g_assert_cmpint(status, ==, VREADER_OK);
+    g_assert_cmpint(dwRecvLength, ==, 2);
+    g_assert_cmphex(pbRecvBuffer[0], ==, VCARD7816_SW1_P1_P2_ERROR);
+    g_assert_cmphex(pbRecvBuffer[1], ==, 0x88);
+
+    vreader_free(reader);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/diag/init", test_diag_init);
+    g_test_add_func("/diag/applet", test_diag_applet);
+
+    ret = g_test_run();
+
+    vcard_emul_finalize();
+    return ret;
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */
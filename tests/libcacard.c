@@ -156,6 +156,56 @@ static void test_card_remove_insert(void)
     vreader_free(reader); /* get by id ref */
 }
 
+static void test_event_subscription(void)
+{
+    VReader *reader = vreader_get_reader_by_id(0);
+    VReader *other_reader = vreader_new("Other", NULL, NULL);
+    VEventSubscription *all, *cards, *other;
+    VEvent *event;
+
+    g_assert_nonnull(reader);
+
+    all = vevent_subscribe(VEVENT_MASK_ALL, 0);
+    /* the card events of the reader, one at a time */
+    cards = vevent_subscribe(VEVENT_MASK(VEVENT_CARD_INSERT) |
+                             VEVENT_MASK(VEVENT_CARD_REMOVE), 1);
+    vevent_subscription_add_reader(cards, reader);
+    other = vevent_subscribe(VEVENT_MASK_ALL, 0);
+    vevent_subscription_add_reader(other, other_reader);
+
+    g_assert_cmpint(vcard_emul_force_card_remove(reader), ==, VCARD_EMUL_OK);
+    g_assert_cmpint(vcard_emul_force_card_insert(reader), ==, VCARD_EMUL_OK);
+    /* both events for all, one for cards, the default queue has its own */
+    g_assert_cmpuint(vevent_queue_get_length(), >=, 3);
+
+    event = vevent_subscription_wait(all);
+    g_assert_cmpint(event->type, ==, VEVENT_CARD_REMOVE);
+    g_assert_true(event->reader == reader);
+    vevent_delete(event);
+    event = vevent_subscription_wait(all);
+    g_assert_cmpint(event->type, ==, VEVENT_CARD_INSERT);
+    g_assert_nonnull(event->card);
+    vevent_delete(event);
+    g_assert_null(vevent_subscription_get(all));
+    g_assert_cmpuint(vevent_subscription_get_dropped(all), ==, 0);
+
+    /* the insertion did not fit */
+    event = vevent_subscription_get(cards);
+    g_assert_nonnull(event);
+    g_assert_cmpint(event->type, ==, VEVENT_CARD_REMOVE);
+    vevent_delete(event);
+    g_assert_null(vevent_subscription_get(cards));
+    g_assert_cmpuint(vevent_subscription_get_dropped(cards), ==, 1);
+
+    g_assert_null(vevent_subscription_get(other));
+
+    vevent_unsubscribe(all);
+    vevent_unsubscribe(cards);
+    vevent_unsubscribe(other);
+    vreader_free(other_reader);
+    vreader_free(reader); /* get by id ref */
+}
+
 static void test_xfer(void)
 {
     VReader *reader = vreader_get_reader_by_id(0);
@@ -534,6 +584,375 @@ static void test_cac_pki_2(void)
     vreader_free(reader); /* get by id ref */
 }
 
+static void test_hibernate(void)
+{
+    VReader *reader = vreader_get_reader_by_id(0);
+
+    /* select the first PKI applet */
+    select_applet(reader, TEST_PKI);
+    read_buffer(reader, CAC_FILE_VALUE, TEST_PKI);
+
+    /* the card was used just now so it should not be hibernated yet */
+    vreader_set_idle_timeout(reader, 60 * 1000);
+    g_assert_cmpint(vreader_hibernate_idle(), ==, 0);
+
+    /* let it sleep */
+    vreader_set_idle_timeout(reader, 1);
+    g_usleep(5 * 1000);
+    g_assert_cmpint(vreader_hibernate_idle(), ==, 1);
+    /* already asleep */
+    g_assert_cmpint(vreader_hibernate_idle(), ==, 0);
+
+    /* the selection is kept and the buffers are rebuilt on demand */
+    get_properties(reader, TEST_PKI);
+    read_buffer(reader, CAC_FILE_TAG, TEST_PKI);
+    read_buffer(reader, CAC_FILE_VALUE, TEST_PKI);
+
+    vreader_set_idle_timeout(reader, 0);
+    vreader_free(reader); /* get by id ref */
+}
+
+static void test_cache_budget(void)
+{
+    VReader *reader = vreader_get_reader_by_id(0);
+    VCardCacheStats stats;
+    unsigned long misses;
+
+    select_applet(reader, TEST_PKI);
+    read_buffer(reader, CAC_FILE_VALUE, TEST_PKI);
+    vcard_cache_get_stats(&stats);
+    g_assert_cmpint(stats.budget, ==, 0);
+    g_assert_cmpint(stats.used, >, 0);
+    g_assert_cmpint(stats.entries, >, 0);
+
+    /* Nothing fits into one byte */
+    vcard_cache_set_budget(1);
+    vcard_cache_get_stats(&stats);
+    g_assert_cmpint(stats.used, ==, 0);
+    g_assert_cmpint(stats.evictions, >, 0);
+    misses = stats.misses;
+
+    /* The buffers are rebuilt on demand and evicted once not used */
+    read_buffer(reader, CAC_FILE_TAG, TEST_PKI);
+    read_buffer(reader, CAC_FILE_VALUE, TEST_PKI);
+    vcard_cache_get_stats(&stats);
+    g_assert_cmpint(stats.misses, >, misses);
+    g_assert_cmpint(stats.used, ==, 0);
+
+    vcard_cache_set_budget(0);
+    vreader_free(reader); /* get by id ref */
+}
+
+static void test_mem_stats(void)
+{
+    VReader *reader = vreader_get_reader_by_id(0);
+    VCardMemStats stats;
+    char *report;
+
+    select_applet(reader, TEST_PKI);
+    read_buffer(reader, CAC_FILE_VALUE, TEST_PKI);
+
+    vreader_get_mem_stats(reader, &stats);
+    g_assert_cmpint(stats.subsystem[VCARD_MEM_CARD].objects, >, 0);
+    g_assert_cmpint(stats.subsystem[VCARD_MEM_TLV].bytes, >, 0);
+    /* the certificates of the PKI applets */
+    g_assert_cmpint(stats.subsystem[VCARD_MEM_CERT].bytes, >, 0);
+    /* nothing is processed right now */
+    g_assert_cmpint(stats.subsystem[VCARD_MEM_APDU].objects, ==, 0);
+
+    report = vreader_mem_dump();
+    g_assert_nonnull(strstr(report, vreader_get_name(reader)));
+    g_free(report);
+
+    vreader_free(reader); /* get by id ref */
+}
+
+static gpointer
+lock_holder(gpointer opaque)
+{
+    VCardLock *lock = opaque;
+
+    vcard_lock_lock(lock);
+    vcard_lock_unlock(lock);
+    return NULL;
+}
+
+static const VCardLockStats *
+lock_stats_find(const VCardLockStats *stats, int count, const char *name)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (g_strcmp0(stats[i].name, name) == 0) {
+            return &stats[i];
+        }
+    }
+    return NULL;
+}
+
+static void test_lock_stats(void)
+{
+    VReader *reader = vreader_get_reader_by_id(0);
+    VCardLockStats stats[16];
+    char *report;
+    int count, i;
+    gboolean found = FALSE;
+
+    vcard_lock_stats_enable(TRUE);
+    vcard_lock_stats_reset();
+
+    select_applet(reader, TEST_PKI);
+    read_buffer(reader, CAC_FILE_VALUE, TEST_PKI);
+
+    count = vcard_lock_stats_get(stats, G_N_ELEMENTS(stats));
+    g_assert_cmpint(count, >, 0);
+    for (i = 0; i < MIN(count, (int)G_N_ELEMENTS(stats)); i++) {
+        if (g_strcmp0(stats[i].name, "reader") == 0) {
+            g_assert_cmpint(stats[i].acquisitions, >, 0);
+            g_assert_cmpint(stats[i].contended, <=, stats[i].acquisitions);
+            found = TRUE;
+        }
+    }
+    g_assert_true(found);
+
+    /* held by another thread */
+    {
+        VCardLock *lock = vcard_lock_new("test");
+        const VCardLockStats *test_stats;
+        GThread *holder;
+
+        vcard_lock_lock(lock);
+        holder = g_thread_new("lock-holder", lock_holder, lock);
+        /* leave the thread the time to block on the lock */
+        g_usleep(G_USEC_PER_SEC / 10);
+        vcard_lock_unlock(lock);
+        g_thread_join(holder);
+        /* free again */
+        vcard_lock_lock(lock);
+        vcard_lock_unlock(lock);
+
+        count = vcard_lock_stats_get(stats, G_N_ELEMENTS(stats));
+        test_stats = lock_stats_find(stats,
+                                     MIN(count, (int)G_N_ELEMENTS(stats)),
+                                     "test");
+        g_assert_nonnull(test_stats);
+        g_assert_cmpint(test_stats->acquisitions, ==, 3);
+        g_assert_cmpint(test_stats->contended, ==, 1);
+        vcard_lock_free(lock);
+    }
+
+    report = vcard_lock_stats_dump();
+    g_assert_nonnull(strstr(report, "reader:"));
+    g_free(report);
+
+    vcard_lock_stats_enable(FALSE);
+    vreader_free(reader); /* get by id ref */
+}
+
+#define CHANNEL_ROUNDS 200
+
+/* SELECT PKI and fetch the FCI on a logical channel */
+static void
+channel_select_get_response(VReader *reader, int channel)
+{
+    uint8_t select_pki[] = {
+        0x00, 0xa4, 0x04, 0x00, 0x07,
+        0xa0, 0x00, 0x00, 0x00, 0x79, 0x01, 0x00
+    };
+    uint8_t getresp[] = {
+        0x00, 0xc0, 0x00, 0x00, 0x0d
+    };
+    uint8_t pbRecvBuffer[APDUBufSize];
+    int dwRecvLength = APDUBufSize;
+
+    select_pki[0] = channel;
+    getresp[0] = channel;
+    g_assert_cmpint(vreader_xfr_bytes(reader, select_pki, sizeof(select_pki),
+                                      pbRecvBuffer, &dwRecvLength),
+                    ==, VREADER_OK);
+    g_assert_cmpint(dwRecvLength, ==, 2);
+    g_assert_cmphex(pbRecvBuffer[0], ==, VCARD7816_SW1_RESPONSE_BYTES);
+
+    dwRecvLength = APDUBufSize;
+    g_assert_cmpint(vreader_xfr_bytes(reader, getresp, sizeof(getresp),
+                                      pbRecvBuffer, &dwRecvLength),
+                    ==, VREADER_OK);
+    g_assert_cmpint(dwRecvLength, ==, 0x0d + 2);
+    g_assert_cmphex(pbRecvBuffer[0x0d], ==, VCARD7816_SW1_SUCCESS);
+}
+
+static gpointer
+channel_thread(gpointer arg)
+{
+    VReader *reader = vreader_get_reader_by_id(0);
+    int i;
+
+    for (i = 0; i < CHANNEL_ROUNDS; i++) {
+        channel_select_get_response(reader, GPOINTER_TO_INT(arg));
+    }
+    vreader_free(reader);
+    return NULL;
+}
+
+static void test_logical_channels(void)
+{
+    VReader *reader = vreader_get_reader_by_id(0);
+    uint8_t open_channel[] = {
+        /* MANAGE CHANNEL open, the card picks the channel */
+        0x00, 0x70, 0x00, 0x00, 0x01
+    };
+    uint8_t close_channel[] = {
+        /* MANAGE CHANNEL close channel 1 */
+        0x00, 0x70, 0x80, 0x01
+    };
+    uint8_t select_pki[] = {
+        0x01, 0xa4, 0x04, 0x00, 0x07,
+        0xa0, 0x00, 0x00, 0x00, 0x79, 0x01, 0x00
+    };
+    uint8_t getresp[] = {
+        0x01, 0xc0, 0x00, 0x00, 0x0d
+    };
+    uint8_t pbRecvBuffer[APDUBufSize];
+    int dwRecvLength = APDUBufSize;
+    GThread *threads[2];
+
+    g_assert_cmpint(vreader_xfr_bytes(reader, open_channel,
+                                      sizeof(open_channel),
+                                      pbRecvBuffer, &dwRecvLength),
+                    ==, VREADER_OK);
+    g_assert_cmpint(dwRecvLength, ==, 3);
+    g_assert_cmphex(pbRecvBuffer[0], ==, 0x01);
+    g_assert_cmphex(pbRecvBuffer[1], ==, VCARD7816_SW1_SUCCESS);
+
+    /* the response waiting on channel 1 survives the APDUs of channel 0 */
+    dwRecvLength = APDUBufSize;
+    g_assert_cmpint(vreader_xfr_bytes(reader, select_pki, sizeof(select_pki),
+                                      pbRecvBuffer, &dwRecvLength),
+                    ==, VREADER_OK);
+    g_assert_cmphex(pbRecvBuffer[0], ==, VCARD7816_SW1_RESPONSE_BYTES);
+    select_applet(reader, TEST_CCC);
+
+    dwRecvLength = APDUBufSize;
+    g_assert_cmpint(vreader_xfr_bytes(reader, getresp, sizeof(getresp),
+                                      pbRecvBuffer, &dwRecvLength),
+                    ==, VREADER_OK);
+    g_assert_cmpint(dwRecvLength, ==, 0x0d + 2);
+    g_assert_cmphex(pbRecvBuffer[0x0d], ==, VCARD7816_SW1_SUCCESS);
+
+    /* both channels in parallel */
+    threads[0] = g_thread_new("test/channel0", channel_thread,
+                              GINT_TO_POINTER(0));
+    threads[1] = g_thread_new("test/channel1", channel_thread,
+                              GINT_TO_POINTER(1));
+    g_thread_join(threads[0]);
+    g_thread_join(threads[1]);
+
+    dwRecvLength = APDUBufSize;
+    g_assert_cmpint(vreader_xfr_bytes(reader, close_channel,
+                                      sizeof(close_channel),
+                                      pbRecvBuffer, &dwRecvLength),
+                    ==, VREADER_OK);
+    g_assert_cmpint(dwRecvLength, ==, 2);
+    g_assert_cmphex(pbRecvBuffer[0], ==, VCARD7816_SW1_SUCCESS);
+
+    /* no APDU on a closed channel, nor on one never opened */
+    dwRecvLength = APDUBufSize;
+    g_assert_cmpint(vreader_xfr_bytes(reader, select_pki, sizeof(select_pki),
+                                      pbRecvBuffer, &dwRecvLength),
+                    ==, VREADER_OK);
+    g_assert_cmpint(dwRecvLength, ==, 2);
+    g_assert_cmphex(pbRecvBuffer[0], ==, VCARD7816_SW1_CLA_ERROR);
+    g_assert_cmphex(pbRecvBuffer[1], ==, 0x81);
+    select_pki[0] = 0x02;
+    dwRecvLength = APDUBufSize;
+    g_assert_cmpint(vreader_xfr_bytes(reader, select_pki, sizeof(select_pki),
+                                      pbRecvBuffer, &dwRecvLength),
+                    ==, VREADER_OK);
+    g_assert_cmphex(pbRecvBuffer[0], ==, VCARD7816_SW1_CLA_ERROR);
+    g_assert_cmphex(pbRecvBuffer[1], ==, 0x81);
+
+    /* the basic channel can not be closed */
+    close_channel[3] = 0x00;
+    dwRecvLength = APDUBufSize;
+    g_assert_cmpint(vreader_xfr_bytes(reader, close_channel,
+                                      sizeof(close_channel),
+                                      pbRecvBuffer, &dwRecvLength),
+                    ==, VREADER_OK);
+    g_assert_cmphex(pbRecvBuffer[0], ==, VCARD7816_SW1_P1_P2_ERROR);
+    g_assert_cmphex(pbRecvBuffer[1], ==, 0x86);
+
+    vreader_free(reader); /* get by id ref */
+}
+
+static void test_xfr_batch(void)
+{
+    VReader *reader = vreader_get_reader_by_id(0);
+    uint8_t select_pki[] = {
+        0x00, 0xa4, 0x04, 0x00, 0x07,
+        0xa0, 0x00, 0x00, 0x00, 0x79, 0x01, 0x00
+    };
+    uint8_t getresp[] = {
+        0x00, 0xc0, 0x00, 0x00, 0x0d
+    };
+    uint8_t invalid[] = {
+        0x00, 0xff, 0x00, 0x00, 0x00
+    };
+    VReaderXfr xfr[4] = {
+        { select_pki, sizeof(select_pki), NULL, 0, VREADER_OK },
+        { getresp, sizeof(getresp), NULL, 0, VREADER_OK },
+        { invalid, sizeof(invalid), NULL, 0, VREADER_OK },
+        { select_pki, sizeof(select_pki), NULL, 0, VREADER_OK },
+    };
+    uint8_t arena[APDUBufSize];
+    int done;
+
+    /* the last command is not processed after the error */
+    done = vreader_xfr_batch(reader, xfr, 4, arena, sizeof(arena),
+                             VREADER_XFR_STOP_ON_ERROR);
+    g_assert_cmpint(done, ==, 3);
+
+    g_assert_cmpint(xfr[0].status, ==, VREADER_OK);
+    g_assert_true(xfr[0].receive_buf == arena);
+    g_assert_cmpint(xfr[0].receive_buf_len, ==, 2);
+    g_assert_cmphex(xfr[0].receive_buf[0], ==, VCARD7816_SW1_RESPONSE_BYTES);
+    g_assert_cmphex(xfr[0].receive_buf[1], ==, 0x0d);
+
+    g_assert_cmpint(xfr[1].status, ==, VREADER_OK);
+    g_assert_true(xfr[1].receive_buf == arena + 2);
+    g_assert_cmpint(xfr[1].receive_buf_len, ==, 0x0d + 2);
+    g_assert_cmphex(xfr[1].receive_buf[0x0d], ==, VCARD7816_SW1_SUCCESS);
+
+    g_assert_cmpint(xfr[2].status, ==, VREADER_OK);
+    g_assert_cmpint(xfr[2].receive_buf_len, ==, 2);
+    g_assert_cmphex(xfr[2].receive_buf[0], ==, VCARD7816_SW1_INS_ERROR);
+
+    /* without the stop condition, all of them are processed */
+    done = vreader_xfr_batch(reader, xfr, 4, arena, sizeof(arena), 0);
+    g_assert_cmpint(done, ==, 4);
+    g_assert_cmpint(xfr[3].status, ==, VREADER_OK);
+    g_assert_cmphex(xfr[3].receive_buf[0], ==, VCARD7816_SW1_RESPONSE_BYTES);
+
+    /* the arena is too small for the second response */
+    done = vreader_xfr_batch(reader, xfr, 4, arena, 3, 0);
+    g_assert_cmpint(done, ==, 2);
+    g_assert_cmpint(xfr[1].status, ==, VREADER_OUT_OF_MEMORY);
+
+    /* one byte short of the full response: not truncated, not processed */
+    done = vreader_xfr_batch(reader, xfr, 4, arena, 2 + 0x0d + 1, 0);
+    g_assert_cmpint(done, ==, 2);
+    g_assert_cmpint(xfr[1].status, ==, VREADER_OUT_OF_MEMORY);
+    g_assert_cmpint(xfr[1].receive_buf_len, ==, 0);
+
+    /* so the pending response is still there for the next batch */
+    done = vreader_xfr_batch(reader, xfr + 1, 1, arena, 0x0d + 2, 0);
+    g_assert_cmpint(done, ==, 1);
+    g_assert_cmpint(xfr[1].status, ==, VREADER_OK);
+    g_assert_cmpint(xfr[1].receive_buf_len, ==, 0x0d + 2);
+    g_assert_cmphex(xfr[1].receive_buf[0x0d], ==, VCARD7816_SW1_SUCCESS);
+
+    vreader_free(reader); /* get by id ref */
+}
+
 static void test_cac_ccc(void)
 {
     VReader *reader = vreader_get_reader_by_id(0);
@@ -1152,10 +1571,17 @@ int main(int argc, char *argv[])
     g_test_add_func("/libcacard/hexdump", test_hex_dump);
     g_test_add_func("/libcacard/list", test_list);
     g_test_add_func("/libcacard/card-remove-insert", test_card_remove_insert);
+    g_test_add_func("/libcacard/event-subscription", test_event_subscription);
     g_test_add_func("/libcacard/xfer", test_xfer);
     g_test_add_func("/libcacard/select-coid", test_select_coid);
     g_test_add_func("/libcacard/cac-pki", test_cac_pki);
     g_test_add_func("/libcacard/cac-pki-2", test_cac_pki_2);
+    g_test_add_func("/libcacard/hibernate", test_hibernate);
+    g_test_add_func("/libcacard/cache-budget", test_cache_budget);
+    g_test_add_func("/libcacard/mem-stats", test_mem_stats);
+    g_test_add_func("/libcacard/lock-stats", test_lock_stats);
+    g_test_add_func("/libcacard/xfr-batch", test_xfr_batch);
+    g_test_add_func("/libcacard/logical-channels", test_logical_channels);
     g_test_add_func("/libcacard/cac-ccc", test_cac_ccc);
     g_test_add_func("/libcacard/cac-aca", test_cac_aca);
     g_test_add_func("/libcacard/get-response", test_get_response);
@@ -0,0 +1,78 @@
+/*
+ * Test the in-memory soft tokens, which need no NSS database
+ *
+ * This code is licensed under the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <string.h>
+#include "libcacard.h"
+#include "common.h"
+
+#define ARGS "memtoken use_hw=no soft=(,Memory,CAC,,gen,gen)"
+
+static void test_memtoken_init(void)
+{
+    VCardEmulOptions *command_line_options;
+    VReader *reader;
+    gint64 start = g_get_monotonic_time();
+
+    command_line_options = vcard_emul_options(ARGS);
+    g_assert_nonnull(command_line_options);
+    g_assert_cmpint(vcard_emul_init(command_line_options), ==, VCARD_EMUL_OK);
+    g_debug("%s: initialized in %" G_GINT64_FORMAT " us", __func__,
+            g_get_monotonic_time() - start);
+
+    reader = vreader_get_reader_by_name("Memory");
+    g_assert_nonnull(reader);
+    g_assert_cmpint(vreader_card_is_present(reader), ==, VREADER_OK);
+    vreader_free(reader);
+}
+
+static void test_memtoken_sign(void)
+{
+    VReader *reader = vreader_get_reader_by_name("Memory");
+    int dwRecvLength = APDUBufSize;
+    uint8_t pbRecvBuffer[APDUBufSize];
+    uint8_t login[] = {
+        /* VERIFY   [p1,p2=0 ]  [Lc]  [empty pin padded to 6 chars     ] */
+        0x00, 0x20, 0x00, 0x00, 0x06, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+    };
+
+    g_assert_nonnull(reader);
+
+    /* no PIN is needed, any is accepted */
+    select_applet(reader, TEST_ACA);
+    g_assert_cmpint(vreader_xfr_bytes(reader, login, sizeof(login),
+                                      pbRecvBuffer, &dwRecvLength),
+                    ==, VREADER_OK);
+    g_assert_cmphex(pbRecvBuffer[0], ==, VCARD7816_SW1_SUCCESS);
+
+    /* both generated keys */
+    select_applet(reader, TEST_PKI);
+    get_properties(reader, TEST_PKI);
+    do_sign(reader, 0);
+    do_sign(reader, 1);
+
+    select_applet(reader, TEST_PKI_2);
+    do_sign(reader, 0);
+
+    vreader_free(reader);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/memtoken/init", test_memtoken_init);
+    g_test_add_func("/memtoken/sign", test_memtoken_sign);
+
+    ret = g_test_run();
+
+    vcard_emul_finalize();
+    return ret;
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */
@@ -0,0 +1,263 @@
+/*
+ * Test the PIV card type
+ *
+ * This code is licensed under the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <string.h>
+#include "libcacard.h"
+
+#define ARGS "memtoken use_hw=no soft=(,PIV,PIV,,gen:1024,gen:1024)"
+
+#define KEY_LEN (1024 / 8)
+
+static VReader *
+piv_reader(void)
+{
+    VReader *reader = vreader_get_reader_by_name("PIV");
+    uint8_t select[] = {
+        /* SELECT [p1,p2=04 00] [Lc] [PIV AID                       ] */
+        0x00, 0xa4, 0x04, 0x00, 0x09, 0xa0, 0x00, 0x00, 0x03, 0x08, 0x00,
+        0x00, 0x10, 0x00, 0x00
+    };
+    uint8_t response[64];
+    int response_len = sizeof(response);
+
+    g_assert_nonnull(reader);
+    g_assert_cmpint(vreader_xfr_bytes(reader, select, sizeof(select),
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    /* the application property template */
+    g_assert_cmpint(response_len, ==, 0x13 + 2);
+    g_assert_cmphex(response[0], ==, 0x61);
+    g_assert_cmphex(response[response_len - 2], ==, VCARD7816_SW1_SUCCESS);
+    return reader;
+}
+
+static void test_piv_init(void)
+{
+    VCardEmulOptions *command_line_options;
+    VReader *reader;
+
+    command_line_options = vcard_emul_options(ARGS);
+    g_assert_nonnull(command_line_options);
+    g_assert_cmpint(vcard_emul_init(command_line_options), ==, VCARD_EMUL_OK);
+
+    reader = vreader_get_reader_by_name("PIV");
+    g_assert_nonnull(reader);
+    g_assert_cmpint(vreader_card_is_present(reader), ==, VREADER_OK);
+    vreader_free(reader);
+}
+
+static void test_piv_select_full_aid(void)
+{
+    VReader *reader = vreader_get_reader_by_name("PIV");
+    uint8_t select[] = {
+        /* SELECT [p1,p2=04 00] [Lc] [PIV AID with the version           ] */
+        0x00, 0xa4, 0x04, 0x00, 0x0b, 0xa0, 0x00, 0x00, 0x03, 0x08, 0x00,
+        0x00, 0x10, 0x00, 0x01, 0x00, 0x00
+    };
+    uint8_t response[64];
+    int response_len = sizeof(response);
+
+    g_assert_nonnull(reader);
+    g_assert_cmpint(vreader_xfr_bytes(reader, select, sizeof(select),
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmpint(response_len, ==, 0x13 + 2);
+    g_assert_cmphex(response[0], ==, 0x61);
+    g_assert_cmphex(response[response_len - 2], ==, VCARD7816_SW1_SUCCESS);
+    g_assert_cmphex(response[response_len - 1], ==, 0x00);
+
+    /* shorter than the RID, it selects nothing */
+    select[4] = 0x04;
+    select[9] = 0x00;
+    response_len = sizeof(response);
+    g_assert_cmpint(vreader_xfr_bytes(reader, select, 10,
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmpint(response_len, ==, 2);
+    g_assert_cmphex(response[0], ==, VCARD7816_SW1_P1_P2_ERROR);
+    g_assert_cmphex(response[1], ==, 0x82);
+    vreader_free(reader);
+}
+
+static void test_piv_get_data(void)
+{
+    VReader *reader = piv_reader();
+    uint8_t get_data[] = {
+        /* GET DATA [p1,p2=3F FF] [extended Lc] [5C 03 5F C1 05    ] [Le] */
+        0x00, 0xcb, 0x3f, 0xff, 0x00, 0x00, 0x05, 0x5c, 0x03, 0x5f, 0xc1,
+        0x05, 0x00, 0x00
+    };
+    uint8_t discovery[] = {
+        /* GET DATA [p1,p2=3F FF] [Lc] [5C 01 7E        ] [Le] */
+        0x00, 0xcb, 0x3f, 0xff, 0x03, 0x5c, 0x01, 0x7e, 0x00
+    };
+    uint8_t response[4096];
+    int response_len = sizeof(response);
+    int len;
+
+    /* the whole certificate in a single response */
+    g_assert_cmpint(vreader_xfr_bytes(reader, get_data, sizeof(get_data),
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmpint(response_len, >, 256);
+    g_assert_cmphex(response[response_len - 2], ==, VCARD7816_SW1_SUCCESS);
+    g_assert_cmphex(response[response_len - 1], ==, 0x00);
+    g_assert_cmphex(response[0], ==, 0x53);
+    g_assert_cmphex(response[1], ==, 0x82);
+    len = response[2] << 8 | response[3];
+    g_assert_cmpint(len + 4 + 2, ==, response_len);
+    /* 70 <certificate>, 71 01 00, FE 00 */
+    g_assert_cmphex(response[4], ==, 0x70);
+    g_assert_cmphex(response[response_len - 4], ==, 0xfe);
+
+    /* the second certificate is the digital signature key (9C) */
+    get_data[11] = 0x0a;
+    response_len = sizeof(response);
+    g_assert_cmpint(vreader_xfr_bytes(reader, get_data, sizeof(get_data),
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmphex(response[response_len - 2], ==, VCARD7816_SW1_SUCCESS);
+
+    /* there is no key management key (9D) */
+    get_data[11] = 0x0b;
+    response_len = sizeof(response);
+    g_assert_cmpint(vreader_xfr_bytes(reader, get_data, sizeof(get_data),
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmpint(response_len, ==, 2);
+    g_assert_cmphex(response[0], ==, 0x6a);
+    g_assert_cmphex(response[1], ==, 0x82);
+
+    /* CHUID */
+    get_data[11] = 0x02;
+    response_len = sizeof(response);
+    g_assert_cmpint(vreader_xfr_bytes(reader, get_data, sizeof(get_data),
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmphex(response[0], ==, 0x53);
+    g_assert_cmphex(response[2], ==, 0x30);
+    g_assert_cmphex(response[response_len - 2], ==, VCARD7816_SW1_SUCCESS);
+
+    /* the discovery object has its own tag */
+    response_len = sizeof(response);
+    g_assert_cmpint(vreader_xfr_bytes(reader, discovery, sizeof(discovery),
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmphex(response[0], ==, 0x7e);
+    g_assert_cmphex(response[response_len - 2], ==, VCARD7816_SW1_SUCCESS);
+
+    vreader_free(reader);
+}
+
+static void test_piv_general_authenticate(void)
+{
+    VReader *reader = piv_reader();
+    uint8_t verify[] = {
+        /* VERIFY [p1,p2=00 80] [Lc] [empty pin padded to 8 chars          ] */
+        0x00, 0x20, 0x00, 0x80, 0x08, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff
+    };
+    /* 7C 81 86 { 82 00, 81 81 80 <PKCS#1 v1.5 padded data> } */
+    uint8_t auth[5 + 8 + KEY_LEN];
+    uint8_t response[1024];
+    int response_len = sizeof(response);
+    int split = 64;
+
+    /* no PIN is needed for the memory tokens, any is accepted */
+    g_assert_cmpint(vreader_xfr_bytes(reader, verify, sizeof(verify),
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmphex(response[0], ==, VCARD7816_SW1_SUCCESS);
+
+    auth[5] = 0x7c;
+    auth[6] = 0x81;
+    auth[7] = 3 + 2 + KEY_LEN;
+    auth[8] = 0x82;
+    auth[9] = 0x00;
+    auth[10] = 0x81;
+    auth[11] = 0x81;
+    auth[12] = KEY_LEN;
+    memset(&auth[13], 0xff, KEY_LEN);
+    auth[13] = 0x00;
+    auth[14] = 0x01;
+    auth[13 + KEY_LEN - 21] = 0x00;
+    memset(&auth[13 + KEY_LEN - 20], 0x42, 20);
+
+    /* the template is sent in two chained commands */
+    auth[0] = 0x10;
+    auth[1] = 0x87;
+    auth[2] = 0x06; /* RSA 1024 */
+    auth[3] = 0x9a; /* PIV authentication key */
+    auth[4] = split;
+    response_len = sizeof(response);
+    g_assert_cmpint(vreader_xfr_bytes(reader, auth, 5 + split,
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmpint(response_len, ==, 2);
+    g_assert_cmphex(response[0], ==, VCARD7816_SW1_SUCCESS);
+
+    memmove(&auth[5], &auth[5 + split], 8 + KEY_LEN - split);
+    auth[0] = 0x00;
+    auth[4] = 8 + KEY_LEN - split;
+    response_len = sizeof(response);
+    g_assert_cmpint(vreader_xfr_bytes(reader, auth, 5 + auth[4],
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    /* 7C 81 83 { 82 81 80 <signature> } */
+    g_assert_cmpint(response_len, ==, 6 + KEY_LEN + 2);
+    g_assert_cmphex(response[0], ==, 0x7c);
+    g_assert_cmphex(response[3], ==, 0x82);
+    g_assert_cmphex(response[response_len - 2], ==, VCARD7816_SW1_SUCCESS);
+
+    /* the algorithm has to match the key */
+    auth[2] = 0x07;
+    response_len = sizeof(response);
+    g_assert_cmpint(vreader_xfr_bytes(reader, auth, 5 + auth[4],
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmphex(response[0], ==, 0x6a);
+    g_assert_cmphex(response[1], ==, 0x86);
+
+    /* a chain can not grow past the largest template for the key size */
+    auth[0] = 0x10;
+    auth[2] = 0x06;
+    auth[4] = KEY_LEN;
+    response_len = sizeof(response);
+    g_assert_cmpint(vreader_xfr_bytes(reader, auth, 5 + KEY_LEN,
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmphex(response[0], ==, VCARD7816_SW1_SUCCESS);
+    response_len = sizeof(response);
+    g_assert_cmpint(vreader_xfr_bytes(reader, auth, 5 + KEY_LEN,
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    g_assert_cmpint(response_len, ==, 2);
+    g_assert_cmphex(response[0], ==, VCARD7816_SW1_ERROR_WRONG_LENGTH);
+    g_assert_cmphex(response[1], ==, 0x00);
+
+    vreader_free(reader);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/piv/init", test_piv_init);
+    g_test_add_func("/piv/select-full-aid", test_piv_select_full_aid);
+    g_test_add_func("/piv/get-data", test_piv_get_data);
+    g_test_add_func("/piv/general-authenticate",
+                    test_piv_general_authenticate);
+
+    ret = g_test_run();
+
+    vcard_emul_finalize();
+    return ret;
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */
@@ -0,0 +1,152 @@
+/*
+ * Test the replay card type, which answers from an APDU transcript
+ *
+ * This code is licensed under the GNU LGPL, version 2.1 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "libcacard.h"
+
+#define ARGS "db=\"sql:%s\" use_hw=no soft=(,Replay,REPLAY,%sfile=%s,)"
+
+#define TRANSCRIPT \
+    "# recorded from a test card\n" \
+    "atr 3B8880010000000000000000\n" \
+    "00A4040007A0000000790100 9000 1500\n" \
+    "\n" \
+    "0084000008 01020304050607089000 2000\n" \
+    "0084000008   11121314151617189000\n" \
+    "0084000008 21222324252627289000 10\n"
+
+static gchar *transcript;
+
+static VReader *
+replay_init(gboolean timing)
+{
+    VCardEmulOptions *command_line_options;
+    gchar *dbdir = g_test_build_filename(G_TEST_DIST, "db", NULL);
+    gchar *args = g_strdup_printf(ARGS, dbdir, timing ? "timing:" : "",
+                                  transcript);
+    VReader *reader;
+
+    command_line_options = vcard_emul_options(args);
+    g_assert_nonnull(command_line_options);
+    g_assert_cmpint(vcard_emul_init(command_line_options), ==, VCARD_EMUL_OK);
+
+    reader = vreader_get_reader_by_name("Replay");
+    g_assert_nonnull(reader);
+    g_assert_cmpint(vreader_card_is_present(reader), ==, VREADER_OK);
+
+    g_free(args);
+    g_free(dbdir);
+    return reader;
+}
+
+static void
+xfr(VReader *reader, const char *command_hex, const char *expected_hex)
+{
+    unsigned char command[64], response[64];
+    int command_len = strlen(command_hex) / 2;
+    int response_len = sizeof(response);
+    GString *hex = g_string_new(NULL);
+    int i;
+
+    for (i = 0; i < command_len; i++) {
+        sscanf(command_hex + 2 * i, "%2hhx", &command[i]);
+    }
+    g_assert_cmpint(vreader_xfr_bytes(reader, command, command_len,
+                                      response, &response_len),
+                    ==, VREADER_OK);
+    for (i = 0; i < response_len; i++) {
+        g_string_append_printf(hex, "%02X", response[i]);
+    }
+    g_assert_cmpstr(hex->str, ==, expected_hex);
+    g_string_free(hex, TRUE);
+}
+
+static void test_replay(void)
+{
+    if (g_test_subprocess()) {
+        VReader *reader = replay_init(FALSE);
+        unsigned char atr[40];
+        int atr_len = sizeof(atr);
+
+        g_assert_cmpint(vreader_power_on(reader, atr, &atr_len),
+                        ==, VREADER_OK);
+        g_assert_cmpint(atr_len, ==, 12);
+        g_assert_cmpint(atr[0], ==, 0x3B);
+
+        /* in the recorded order */
+        xfr(reader, "00A4040007A0000000790100", "9000");
+        xfr(reader, "0084000008", "01020304050607089000");
+        xfr(reader, "0084000008", "11121314151617189000");
+        /* not recorded */
+        xfr(reader, "00B0000000", "6900");
+        xfr(reader, "0084000008", "21222324252627289000");
+        /* past the last recording, back to the first one */
+        xfr(reader, "0084000008", "01020304050607089000");
+
+        /* a reset restarts the session */
+        vreader_power_off(reader);
+        atr_len = sizeof(atr);
+        vreader_power_on(reader, atr, &atr_len);
+        /* out of order, the next recording of the command is taken */
+        xfr(reader, "0084000008", "01020304050607089000");
+        xfr(reader, "00A4040007A0000000790100", "9000");
+
+        vreader_free(reader);
+        vcard_emul_finalize();
+        return;
+    }
+
+    g_test_trap_subprocess(NULL, 0, 0);
+    g_test_trap_assert_passed();
+}
+
+static void test_replay_timing(void)
+{
+    if (g_test_subprocess()) {
+        VReader *reader = replay_init(TRUE);
+        gint64 start;
+
+        /* the recorded card took 1.5 ms */
+        start = g_get_monotonic_time();
+        xfr(reader, "00A4040007A0000000790100", "9000");
+        g_assert_cmpint(g_get_monotonic_time() - start, >=, 1500);
+
+        vreader_free(reader);
+        vcard_emul_finalize();
+        return;
+    }
+
+    g_test_trap_subprocess(NULL, 0, 0);
+    g_test_trap_assert_passed();
+}
+
+int main(int argc, char *argv[])
+{
+    GError *err = NULL;
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = g_file_open_tmp("libcacard-replay-XXXXXX", &transcript, &err);
+    g_assert_no_error(err);
+    g_assert_true(g_file_set_contents(transcript, TRANSCRIPT, -1, NULL));
+    close(fd);
+
+    g_test_add_func("/replay/replay", test_replay);
+    g_test_add_func("/replay/timing", test_replay_timing);
+
+    ret = g_test_run();
+
+    g_unlink(transcript);
+    g_free(transcript);
+    return ret;
+}
+
+/* vim: set ts=4 sw=4 tw=0 noet expandtab: */